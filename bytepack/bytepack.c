@@ -1,36 +1,175 @@
 #include "bytepack.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+// Maximum iovec count passed to a single writev
+#define BYTEPACK_IOV_MAX 1024
+
+// Buffer pool size classes are powers of two, larger buffers are malloc'd
+#define POOL_MIN_SHIFT 6                // 64 bytes
+#define POOL_MAX_SHIFT 20               // 1 MiB
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_CACHE_MAX_SHIFT 16         // Largest class cached by threads
+#define POOL_CACHE_SIZE 8               // Buffers of each class cached by a thread
+#define POOL_SHARED_BYTES (8 << 20)     // Bytes of each class kept in the shared lists
 
 const char* error_msg = NULL;
 
+// ------------ BUFFER POOL -------------- //
+
+typedef struct pool_cache_t {
+    void* buffers[POOL_CLASSES][POOL_CACHE_SIZE];
+    int count[POOL_CLASSES];
+} pool_cache_t;
+
+// Shared free lists, linked through the first bytes of the buffers
+static void* pool_head[POOL_CLASSES];
+static int pool_count[POOL_CLASSES];
+static sem_t pool_lock[POOL_CLASSES];
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;             // Flushes the cache of a thread when it exits
+static __thread pool_cache_t* pool_cache;
+
+static void pool_push(int cls, void* data) {
+    sem_wait(&pool_lock[cls]);
+    if (pool_count[cls] < (POOL_SHARED_BYTES >> (cls + POOL_MIN_SHIFT))) {
+        *(void**)data = pool_head[cls];
+        pool_head[cls] = data;
+        pool_count[cls]++;
+        data = NULL;
+    }
+    sem_post(&pool_lock[cls]);
+    free(data);
+}
+
+static void* pool_pop(int cls) {
+    sem_wait(&pool_lock[cls]);
+    void* data = pool_head[cls];
+    if (data != NULL) {
+        pool_head[cls] = *(void**)data;
+        pool_count[cls]--;
+    }
+    sem_post(&pool_lock[cls]);
+    return data;
+}
+
+static void pool_flush_cache(void* arg) {
+    pool_cache_t* cache = (pool_cache_t*)arg;
+    for (int cls = 0; cls < POOL_CLASSES; ++cls) {
+        for (int i = 0; i < cache->count[cls]; ++i) {
+            pool_push(cls, cache->buffers[cls][i]);
+        }
+    }
+    free(cache);
+}
+
+static void pool_init() {
+    for (int cls = 0; cls < POOL_CLASSES; ++cls) {
+        sem_init(&pool_lock[cls], 0, 1);
+    }
+    pthread_key_create(&pool_key, pool_flush_cache);
+}
+
+static pool_cache_t* pool_get_cache() {
+    if (pool_cache == NULL) {
+        pool_cache = (pool_cache_t*)calloc(1, sizeof(pool_cache_t));
+        if (pool_cache != NULL) pthread_setspecific(pool_key, pool_cache);
+    }
+    return pool_cache;
+}
+
+// Size class of size bytes, -1 if too large for the pool
+static int pool_class(size_t size) {
+    int shift = POOL_MIN_SHIFT;
+    while (shift <= POOL_MAX_SHIFT && ((size_t)1 << shift) < size) shift++;
+    return shift <= POOL_MAX_SHIFT ? shift - POOL_MIN_SHIFT : -1;
+}
+
+void* bytepack_pool_alloc(size_t size, size_t* capacity) {
+    int cls = pool_class(size);
+    if (cls < 0) {
+        *capacity = size;
+        return malloc(size);
+    }
+    pthread_once(&pool_once, pool_init);
+    *capacity = (size_t)1 << (cls + POOL_MIN_SHIFT);
+    pool_cache_t* cache = cls + POOL_MIN_SHIFT <= POOL_CACHE_MAX_SHIFT ? pool_get_cache() : NULL;
+    if (cache != NULL && cache->count[cls] > 0) {
+        return cache->buffers[cls][--cache->count[cls]];
+    }
+    void* data = pool_pop(cls);
+    return data != NULL ? data : malloc(*capacity);
+}
+
+void bytepack_pool_free(void* data, size_t capacity) {
+    if (data == NULL) return;
+    int cls = pool_class(capacity);
+    if (cls < 0 || ((size_t)1 << (cls + POOL_MIN_SHIFT)) != capacity) {
+        free(data);
+        return;
+    }
+    pthread_once(&pool_once, pool_init);
+    pool_cache_t* cache = cls + POOL_MIN_SHIFT <= POOL_CACHE_MAX_SHIFT ? pool_get_cache() : NULL;
+    if (cache != NULL && cache->count[cls] < POOL_CACHE_SIZE) {
+        cache->buffers[cls][cache->count[cls]++] = data;
+        return;
+    }
+    pool_push(cls, data);
+}
+
+// ------------ BYTEPACK -------------- //
+
 int bytepack_init(bytepack_t* bp, size_t bufsize) {
-    bp->data = (char*)malloc(bufsize);
+    bp->data = (char*)bytepack_pool_alloc(bufsize, &bufsize);
     if (bp->data == NULL) {
         error_msg = "Memory allocation failed";
         return -1;
     }
+    bp->owned = 1;
     bp->bufsize = bufsize;
     bp->size = 0;
     bp->offset = 0;
+    bp->refs = NULL;
+    bp->num_refs = 0;
+    bp->max_refs = 0;
+    bp->ref_size = 0;
+    bp->version = BYTEPACK_V1;
     return 0;
 }
 
 int bytepack_attach(bytepack_t* bp, void* data, size_t size) {
     bp->data = data;
+    bp->owned = 0;
     bp->bufsize = size;
     bp->size = size;
     bp->offset = 0;
+    bp->refs = NULL;
+    bp->num_refs = 0;
+    bp->max_refs = 0;
+    bp->ref_size = 0;
+    bp->version = BYTEPACK_V1;
     return 0;
 }
 
 void bytepack_free(bytepack_t* bp) {
-    free(bp->data);
+    if (bp->owned) bytepack_pool_free(bp->data, bp->bufsize);
+    free(bp->refs);
     bp->data = NULL;
+    bp->owned = 0;
+    bp->refs = NULL;
+    bp->num_refs = 0;
+    bp->max_refs = 0;
+    bp->ref_size = 0;
     bp->bufsize = 0;
     bp->size = 0;
     bp->offset = 0;
@@ -39,22 +178,44 @@ void bytepack_free(bytepack_t* bp) {
 void bytepack_reset(bytepack_t* bp) {
     bp->size = 0;
     bp->offset = 0;
-    memset(bp->data, 0, bp->bufsize);
+    bp->num_refs = 0;
+    bp->ref_size = 0;
 }
 
-int bytepack_append(bytepack_t* bp, const void* data, size_t size) {
-    if (bp->offset + size > bp->bufsize) { // Reallocation
-        size_t new_bufsize = bp->bufsize * 2;
-        while (bp->offset + size > new_bufsize) {
-            new_bufsize *= 2;
-        }
-        char* new_data = (char*)realloc(bp->data, new_bufsize);
+int bytepack_reserve(bytepack_t* bp, size_t size) {
+    if (size > bp->bufsize) { // Move to a buffer of a larger class
+        size_t new_bufsize;
+        char* new_data = (char*)bytepack_pool_alloc(size, &new_bufsize);
         if (new_data == NULL) {
             error_msg = "Memory allocation failed";
             return -1;
         }
+        size_t used = bp->size > bp->offset ? bp->size : bp->offset;
+        if (used > 0) memcpy(new_data, bp->data, used);
+        if (bp->owned) bytepack_pool_free(bp->data, bp->bufsize);
         bp->data = new_data;
         bp->bufsize = new_bufsize;
+        bp->owned = 1;
+    }
+    return 0;
+}
+
+void bytepack_trim(bytepack_t* bp, size_t size) {
+    bytepack_reset(bp);
+    if (!bp->owned || bp->bufsize <= size) return;
+    bytepack_pool_free(bp->data, bp->bufsize);
+    bp->data = (char*)bytepack_pool_alloc(size, &bp->bufsize);
+    if (bp->data == NULL) {
+        bp->bufsize = 0;
+        bp->owned = 0;
+    }
+}
+
+int bytepack_append(bytepack_t* bp, const void* data, size_t size) {
+    if (bp->offset + size > bp->bufsize) {
+        size_t new_bufsize = bp->bufsize * 2;
+        if (new_bufsize < bp->offset + size) new_bufsize = bp->offset + size;
+        if (bytepack_reserve(bp, new_bufsize) < 0) return -1;
     }
     memcpy(bp->data + bp->offset, data, size);
     bp->offset += size;
@@ -62,6 +223,81 @@ int bytepack_append(bytepack_t* bp, const void* data, size_t size) {
     return 0;
 }
 
+int bytepack_append_ref(bytepack_t* bp, const void* data, size_t size) {
+    if (bp->num_refs == bp->max_refs) {
+        int new_max_refs = bp->max_refs == 0 ? 16 : bp->max_refs * 2;
+        bytepack_ref_t* new_refs = (bytepack_ref_t*)realloc(bp->refs, new_max_refs * sizeof(bytepack_ref_t));
+        if (new_refs == NULL) {
+            error_msg = "Memory allocation failed";
+            return -1;
+        }
+        bp->refs = new_refs;
+        bp->max_refs = new_max_refs;
+    }
+    bp->refs[bp->num_refs].at = bp->offset;
+    bp->refs[bp->num_refs].data = data;
+    bp->refs[bp->num_refs].size = size;
+    bp->num_refs++;
+    bp->ref_size += size;
+    return 0;
+}
+
+// ------------ V2 ENCODING -------------- //
+
+#define VARINT_MAX 10
+
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int append_varint(bytepack_t* bp, uint64_t v) {
+    unsigned char buf[VARINT_MAX];
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (unsigned char)v;
+    return bytepack_append(bp, buf, n);
+}
+
+static int unpack_varint(bytepack_t* bp, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+        if (bp->offset >= bp->size) break;
+        unsigned char b = (unsigned char)bp->data[bp->offset++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    error_msg = "Buffer underflow";
+    return -1;
+}
+
+// Unpack the length of a string or byte string, which must fit in bp
+static int unpack_length(bytepack_t* bp, size_t* size) {
+    uint64_t v;
+    if (bp->version == BYTEPACK_V2) {
+        if (unpack_varint(bp, &v) < 0) return -1;
+    } else {
+        if (bp->offset + sizeof(size_t) > bp->size) {
+            error_msg = "Buffer underflow";
+            return -1;
+        }
+        memcpy(&v, bp->data + bp->offset, sizeof(size_t));
+        bp->offset += sizeof(size_t);
+    }
+    if (v > bp->size - bp->offset) {
+        error_msg = "Buffer underflow";
+        return -1;
+    }
+    *size = (size_t)v;
+    return 0;
+}
+
 int bytepack_pack(bytepack_t* bp, const char* format, ...) {
     va_list args;
     va_start(args, format);
@@ -72,14 +308,25 @@ int bytepack_pack(bytepack_t* bp, const char* format, ...) {
             ret = bytepack_append(bp, &c, sizeof(char));
         } else if (*p == 'i') {
             int i = va_arg(args, int);
-            ret = bytepack_append(bp, &i, sizeof(int));
+            if (bp->version == BYTEPACK_V2) {
+                ret = append_varint(bp, zigzag(i));
+            } else {
+                ret = bytepack_append(bp, &i, sizeof(int));
+            }
         } else if (*p == 'l') {
             long l = va_arg(args, long);
-            ret = bytepack_append(bp, &l, sizeof(long));
+            if (bp->version == BYTEPACK_V2) {
+                ret = append_varint(bp, zigzag(l));
+            } else {
+                ret = bytepack_append(bp, &l, sizeof(long));
+            }
         } else if (*p == 's') {
             char* s = va_arg(args, char*);
             size_t len = strlen(s);
-            if (ret == 0) {
+            if (bp->version == BYTEPACK_V2) {
+                ret = append_varint(bp, len);
+                if (ret == 0) ret = bytepack_append(bp, s, len);
+            } else {
                 ret = bytepack_append(bp, s, len + 1);
             }
         } else {
@@ -96,13 +343,20 @@ int bytepack_pack(bytepack_t* bp, const char* format, ...) {
 
 int bytepack_pack_bytes(bytepack_t* bp, const void* data, size_t size) {
     int ret = 0;
-    ret = bytepack_append(bp, &size, sizeof(size_t));
+    ret = bytepack_pack_size(bp, size);
     if (ret == 0) {
         ret = bytepack_append(bp, data, size);
     }
     return 0;
 }
 
+int bytepack_pack_size(bytepack_t* bp, size_t size) {
+    if (bp->version == BYTEPACK_V2) {
+        return append_varint(bp, size);
+    }
+    return bytepack_append(bp, &size, sizeof(size_t));
+}
+
 #define CHECK_UNDERFLOW(TYPE) \
     if (bp->offset + sizeof(TYPE) > bp->size) {\
         error_msg = "Buffer underflow";\
@@ -115,7 +369,34 @@ int bytepack_unpack(bytepack_t* bp, const char* format, ...) {
     va_start(args, format);
     int ret = 0;
     for (const char* p = format; *p != '\0' && ret >= 0; p++) {
-        if (*p == 'c') {
+        if (bp->version == BYTEPACK_V2 && *p != 'c') {
+            uint64_t v;
+            size_t len;
+            if (*p == 'i') {
+                int* i = va_arg(args, int*);
+                if ((ret = unpack_varint(bp, &v)) < 0) break;
+                int64_t value = unzigzag(v);
+                if (value < INT32_MIN || value > INT32_MAX) {
+                    error_msg = "Integer overflow";
+                    ret = -1;
+                    break;
+                }
+                *i = (int)value;
+            } else if (*p == 'l') {
+                long* l = va_arg(args, long*);
+                if ((ret = unpack_varint(bp, &v)) < 0) break;
+                *l = (long)unzigzag(v);
+            } else if (*p == 's') {
+                char* s = va_arg(args, char*);
+                if ((ret = unpack_length(bp, &len)) < 0) break;
+                memcpy(s, bp->data + bp->offset, len);
+                s[len] = '\0';
+                bp->offset += len;
+            } else {
+                error_msg = "Invalid format";
+                ret = -1;
+            }
+        } else if (*p == 'c') {
             char* c = va_arg(args, char*);
             CHECK_UNDERFLOW(char);
             *c = *(bp->data + bp->offset);
@@ -132,7 +413,7 @@ int bytepack_unpack(bytepack_t* bp, const char* format, ...) {
             bp->offset += sizeof(long);
         } else if (*p == 's') {
             char* s = va_arg(args, char*);
-            size_t len = strlen(bp->data + bp->offset) + 1;
+            size_t len = strnlen(bp->data + bp->offset, bp->size - bp->offset) + 1;
             if (bp->offset + len > bp->size) {
                 error_msg = "Buffer underflow";
                 ret = -1;
@@ -150,59 +431,148 @@ int bytepack_unpack(bytepack_t* bp, const char* format, ...) {
 }
 
 int bytepack_unpack_bytes(bytepack_t* bp, void* data, size_t* size) {
-    if (bp->offset + sizeof(size_t) > bp->size) {
-        error_msg = "Buffer underflow";
-        return -1;
-    }
-    *size = *(size_t*)(bp->data + bp->offset);
-    bp->offset += sizeof(size_t);
-    if (bp->offset + *size > bp->size) {
-        error_msg = "Buffer underflow";
-        return -1;
-    }
+    if (unpack_length(bp, size) < 0) return -1;
     memcpy(data, bp->data + bp->offset, *size);
     bp->offset += *size;
     return 0;
 }
 
-int bytepack_send(int sockfd, const bytepack_t* bp) {
-    // First send the size, then data
-    if (send(sockfd, &bp->size, sizeof(size_t), 0) == -1) {
-        error_msg = "Failed to send size";
-        return -1;
-    }
-    if (send(sockfd, bp->data, bp->size, 0) == -1) {
-        error_msg = "Failed to send data";
-        return -1;
+int bytepack_unpack_ref(bytepack_t* bp, const void** data, size_t* size) {
+    if (unpack_length(bp, size) < 0) return -1;
+    *data = bp->data + bp->offset;
+    bp->offset += *size;
+    return 0;
+}
+
+// Write all of iov, which is modified on partial writes.
+// Waits for the socket to become writable if it is non-blocking.
+static int writev_all(int sockfd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(sockfd, iov, iovcnt > BYTEPACK_IOV_MAX ? BYTEPACK_IOV_MAX : iovcnt);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            struct pollfd pfd = { .fd = sockfd, .events = POLLOUT };
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR) return -1;
+            continue;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
     return 0;
 }
 
-int bytepack_recv(int sockfd, bytepack_t* bp) {
-    // First receive the size, then data
-    if (recv(sockfd, &bp->size, sizeof(size_t), 0) == -1) {
-        error_msg = "Failed to receive size";
-        return -1;
+size_t bytepack_header_size(int version) {
+    return version == BYTEPACK_V2 ? 4 : sizeof(size_t);
+}
+
+size_t bytepack_header_decode(int version, const void* header) {
+    const unsigned char* h = (const unsigned char*)header;
+    if (version == BYTEPACK_V2) {
+        return (size_t)h[0] | (size_t)h[1] << 8 | (size_t)h[2] << 16 | (size_t)h[3] << 24;
     }
-    if (bp->size > bp->bufsize) { // reallocation
-        char* new_data = (char*)realloc(bp->data, bp->size);
-        if (new_data == NULL) {
+    size_t size;
+    memcpy(&size, header, sizeof(size_t));
+    return size;
+}
+
+int bytepack_send(int sockfd, const bytepack_t* bp) {
+    // Send the size and the chain of data and references with a single writev
+    size_t total_size = bp->size + bp->ref_size;
+    unsigned char header[BYTEPACK_MAX_HEADER];
+    if (bp->version == BYTEPACK_V2) {
+        if (total_size > UINT32_MAX) {
+            error_msg = "Message too large";
+            return -1;
+        }
+        for (int i = 0; i < 4; ++i) header[i] = (unsigned char)(total_size >> (8 * i));
+    } else {
+        memcpy(header, &total_size, sizeof(size_t));
+    }
+    struct iovec small_iov[8];
+    struct iovec* iov = small_iov;
+    int iovcnt = 2 + 2 * bp->num_refs;
+    size_t iov_capacity = 0;
+    if (iovcnt > 8) {
+        iov = (struct iovec*)bytepack_pool_alloc(iovcnt * sizeof(struct iovec), &iov_capacity);
+        if (iov == NULL) {
             error_msg = "Memory allocation failed";
             return -1;
         }
-        bp->data = new_data;
-        bp->bufsize = bp->size;
     }
-    // receive data until size is reached
+    iov[0].iov_base = header;
+    iov[0].iov_len = bytepack_header_size(bp->version);
+    iovcnt = 1;
+    size_t at = 0;
+    for (int i = 0; i < bp->num_refs; ++i) {
+        if (bp->refs[i].at > at) {
+            iov[iovcnt].iov_base = bp->data + at;
+            iov[iovcnt++].iov_len = bp->refs[i].at - at;
+            at = bp->refs[i].at;
+        }
+        iov[iovcnt].iov_base = (void*)bp->refs[i].data;
+        iov[iovcnt++].iov_len = bp->refs[i].size;
+    }
+    if (bp->size > at) {
+        iov[iovcnt].iov_base = bp->data + at;
+        iov[iovcnt++].iov_len = bp->size - at;
+    }
+    int ret = writev_all(sockfd, iov, iovcnt);
+    if (iov != small_iov) bytepack_pool_free(iov, iov_capacity);
+    if (ret == -1) {
+        error_msg = "Failed to send data";
+        return -1;
+    }
+    return 0;
+}
+
+// Receive size bytes, return how many were received before the connection closed, or -1
+static ssize_t recv_all(int sockfd, void* data, size_t size) {
     size_t received = 0;
-    while (received < bp->size) {
-        ssize_t n = recv(sockfd, bp->data + received, bp->size - received, 0);
+    while (received < size) {
+        ssize_t n = recv(sockfd, (char*)data + received, size - received, 0);
         if (n == -1) {
-            error_msg = "Failed to receive data";
+            if (errno == EINTR) continue;
             return -1;
         }
+        if (n == 0) break;
         received += n;
     }
+    return received;
+}
+
+int bytepack_recv(int sockfd, bytepack_t* bp) {
+    // First receive the size, then data
+    unsigned char header[BYTEPACK_MAX_HEADER];
+    size_t header_size = bytepack_header_size(bp->version);
+    ssize_t n = recv_all(sockfd, header, header_size);
+    if (n == 0) { // Closed, an empty message
+        bp->size = 0;
+        bp->offset = 0;
+        return 0;
+    }
+    if (n != (ssize_t)header_size) {
+        error_msg = "Failed to receive size";
+        return -1;
+    }
+    // The previous contents are dropped, nothing to copy if the buffer grows
+    size_t size = bytepack_header_decode(bp->version, header);
+    bp->size = 0;
+    bp->offset = 0;
+    if (bytepack_reserve(bp, size) == -1) return -1;
+    bp->size = size;
+    // receive data until size is reached
+    if (recv_all(sockfd, bp->data, bp->size) != (ssize_t)bp->size) {
+        error_msg = "Failed to receive data";
+        return -1;
+    }
     bp->offset = 0;
     return 0;
 }
@@ -2,38 +2,101 @@
 #define BYTEPACK_H
 
 #include <stddef.h>
+#include <sys/uio.h>
+
+// Wire formats, negotiated per connection, see connect_to_server_versioned.
+// V1: size_t frame size, native integers, NUL-terminated strings, size_t byte string lengths.
+// V2: 4-byte little-endian frame size, zigzag varint 'i' and 'l', varint string and
+// byte string lengths, strings without NUL.
+#define BYTEPACK_V1 1
+#define BYTEPACK_V2 2
+#define BYTEPACK_VERSION BYTEPACK_V2    // Newest version
+#define BYTEPACK_MAX_HEADER 8           // Largest frame header
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// External data in the chain of a bytepack, see bytepack_append_ref
+typedef struct bytepack_ref_t {
+    size_t at;              // Size of data packed before the reference
+    const void* data;
+    size_t size;
+} bytepack_ref_t;
+
 typedef struct bytepack_t_ {
     char* data;
+    int owned;              // Whether data is from the buffer pool and freed with bp
     size_t bufsize;
     size_t size;
     size_t offset;
+    bytepack_ref_t* refs;   // In order of at
+    int num_refs;
+    int max_refs;
+    size_t ref_size;        // Total size of refs
+    int version;            // Wire format, BYTEPACK_V1 unless set, kept by bytepack_reset
 } bytepack_t;
 
+/// @brief Allocate a buffer of at least size bytes from the buffer pool. Buffers come in
+/// power-of-two size classes, kept in a cache of each thread and in shared free lists.
+/// They are not cleared.
+/// @param capacity Set to the size of the buffer, to be passed to bytepack_pool_free.
+void* bytepack_pool_alloc(size_t size, size_t* capacity);
+
+/// @brief Return a buffer of bytepack_pool_alloc to the pool.
+void bytepack_pool_free(void* data, size_t capacity);
+
+/// @brief Initialize bp with a buffer of at least bufsize bytes from the pool.
 int bytepack_init(bytepack_t* bp, size_t bufsize);
 
+/// @brief Initialize bp on a buffer of the caller, which is not freed with bp.
 int bytepack_attach(bytepack_t* bp, void* data, size_t size);
 
 void bytepack_free(bytepack_t* bp);
 
 void bytepack_reset(bytepack_t* bp);
 
+/// @brief Make sure bp can hold size bytes of data, moving it to a larger buffer of the pool.
+int bytepack_reserve(bytepack_t* bp, size_t size);
+
+/// @brief Reset bp, and return its buffer to the pool for one of size bytes if it is larger.
+void bytepack_trim(bytepack_t* bp, size_t size);
+
+/// @brief Append raw bytes to bp, without any size prefix.
+int bytepack_append(bytepack_t* bp, const void* data, size_t size);
+
+/// @brief Append raw bytes by reference. bp is then a chain of the data packed before,
+/// the reference and the data packed after, which bytepack_send sends in order with a
+/// single writev. The bytes are not copied, so they must stay valid until bp is sent.
+/// References are only part of the message sent, not of what bp unpacks.
+int bytepack_append_ref(bytepack_t* bp, const void* data, size_t size);
+
 int bytepack_pack(bytepack_t* bp, const char* format, ...);
 
 int bytepack_pack_bytes(bytepack_t* bp, const void* data, size_t size);
 
 int bytepack_unpack(bytepack_t* bp, const char* format, ...);
 
+/// @brief Pack the length of a byte string whose data is appended next, e.g. by reference.
+int bytepack_pack_size(bytepack_t* bp, size_t size);
+
 int bytepack_unpack_bytes(bytepack_t* bp, void* data, size_t* size);
 
+/// @brief Unpack a byte string packed by bytepack_pack_bytes without copying it.
+/// @param data Set to point into the buffer of bp, valid until bp is reset.
+int bytepack_unpack_ref(bytepack_t* bp, const void** data, size_t* size);
+
 int bytepack_send(int sockfd, const bytepack_t* bp);
 
 int bytepack_recv(int sockfd, bytepack_t* bp);
 
+/// @brief Size of the frame header in a wire format.
+size_t bytepack_header_size(int version);
+
+/// @brief Decode a frame header of bytepack_header_size(version) bytes.
+/// @return The size of the frame data.
+size_t bytepack_header_decode(int version, const void* header);
+
 const char* bytepack_get_error();
 
 void bytepack_dbg_print(const bytepack_t* bp);
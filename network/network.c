@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "network.h"
 
 #include <stdio.h>
@@ -8,6 +9,21 @@
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#define MAX_EPOLL_EVENTS 64
+#define CONNECTION_BUFFER_SIZE 256              // Initial size of request and response buffers
+#define CONNECTION_BUFFER_KEEP (64 << 10)       // Larger buffers go back to the pool after a request
+
+// Handshake of connect_to_server_versioned: the first V1 message of a connection, followed
+// by the newest version of the client, and answered the same way with the negotiated version.
+// No request starts with it, the disk server has no '\0' request and the FS server takes it
+// for an unknown user.
+#define HELLO "\0BP"
+#define HELLO_SIZE 4
 
 
 int initialize_server_socket(int port) {
@@ -29,7 +45,7 @@ int initialize_server_socket(int port) {
         exit(EXIT_FAILURE);
     }
     // Listen for incoming connections
-    if (listen(sockfd, 5) < 0) {
+    if (listen(sockfd, SOMAXCONN) < 0) {
         fprintf(stderr, "Error: Could not listen on socket\n");
         perror("listen");
         exit(EXIT_FAILURE);
@@ -49,20 +65,305 @@ int run_server(int sock_fd, void* (*handler)(void*)) {
         }
         client_handler_args_t *args = (client_handler_args_t *) malloc(sizeof(client_handler_args_t));
         inet_ntop(AF_INET, &client_addr.sin_addr, args->client_ip, INET_ADDRSTRLEN);
+        args->client_port = ntohs(client_addr.sin_port);
         printf("Receiving connection from %s\n", args->client_ip);
         // Handle the connection in a thread
         pthread_t thread;
         args->client_fd = client_sock_fd;
-        pthread_create(&thread, NULL, handler, args);
+        if (pthread_create(&thread, NULL, handler, args) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    return 0;
+}
+
+// ------------ CALLBACK SERVER -------------- //
+
+// Reset a request or response buffer of a connection for the next request
+static void connection_buffer_reset(bytepack_t* bp) {
+    if (bp->bufsize > CONNECTION_BUFFER_KEEP) {
+        bytepack_trim(bp, CONNECTION_BUFFER_SIZE);
+    } else {
+        bytepack_reset(bp);
+    }
+}
+
+// If request is a handshake, pack the answer into response and return the negotiated version
+static int accept_hello(const bytepack_t* request, bytepack_t* response) {
+    if (request->size != HELLO_SIZE || memcmp(request->data, HELLO, HELLO_SIZE - 1) != 0) return 0;
+    char version = request->data[HELLO_SIZE - 1];
+    if (version > BYTEPACK_VERSION) version = BYTEPACK_VERSION;
+    if (version < BYTEPACK_V1) version = BYTEPACK_V1;
+    bytepack_append(response, HELLO, HELLO_SIZE - 1);
+    bytepack_append(response, &version, 1);
+    return version;
+}
+
+// Callbacks of the thread-per-client server
+static const server_callbacks_t* thread_callbacks;
+
+// Thread-per-client handler calling the callbacks
+static void* callback_handler(void* args) {
+    client_handler_args_t* client = (client_handler_args_t*) args;
+    const server_callbacks_t* callbacks = thread_callbacks;
+    void* context = callbacks->on_connect(client);
+    bytepack_t request;
+    bytepack_t response;
+    bytepack_init(&request, CONNECTION_BUFFER_SIZE);
+    bytepack_init(&response, CONNECTION_BUFFER_SIZE);
+    int first = 1;
+    while (1) {
+        connection_buffer_reset(&request);
+        connection_buffer_reset(&response);
+        if (bytepack_recv(client->client_fd, &request) < 0 || request.size == 0) break;
+        int version = first ? accept_hello(&request, &response) : 0;
+        first = 0;
+        if (version > 0) {
+            if (bytepack_send(client->client_fd, &response) < 0) break;
+            request.version = response.version = version;
+            continue;
+        }
+        server_action_t action = callbacks->on_request(context, &request, &response);
+        if (action == SERVER_RESPOND || action == SERVER_RESPOND_CLOSE) {
+            bytepack_send(client->client_fd, &response);
+        }
+        if (action == SERVER_RESPOND_CLOSE || action == SERVER_CLOSE) break;
+    }
+    callbacks->on_disconnect(context);
+    close(client->client_fd);
+    bytepack_free(&request);
+    bytepack_free(&response);
+    free(client);
+    return NULL;
+}
+
+// A connection of the event server. With EPOLLONESHOT it is owned by one thread at a time:
+// the event loop while a request is being received, then a worker until it is re-armed.
+typedef struct connection_t {
+    client_handler_args_t client;
+    void* context;
+    int greeted;                // Whether the first request, maybe a handshake, was served
+    unsigned char header[BYTEPACK_MAX_HEADER];  // Size prefix of the request being received
+    size_t request_size;
+    size_t header_received;     // Bytes of the size prefix received
+    size_t body_received;       // Bytes of the request received
+    bytepack_t request;
+    bytepack_t response;
+    struct connection_t* next;  // Next in the work queue
+} connection_t;
+
+typedef struct event_server_t {
+    int epoll_fd;
+    const server_callbacks_t* callbacks;
+    connection_t* queue_head;   // Connections with a complete request
+    connection_t* queue_tail;
+    sem_t queue_mutex;
+    sem_t queue_items;
+} event_server_t;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Wait for the next request of conn
+static int connection_arm(event_server_t* server, connection_t* conn, int op) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    return epoll_ctl(server->epoll_fd, op, conn->client.client_fd, &event);
+}
+
+static void connection_close(event_server_t* server, connection_t* conn) {
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->client.client_fd, NULL);
+    server->callbacks->on_disconnect(conn->context);
+    close(conn->client.client_fd);
+    bytepack_free(&conn->request);
+    bytepack_free(&conn->response);
+    free(conn);
+}
+
+// Receive as much of the current request as available.
+// Return 1 if the request is complete, 0 if more data is needed, -1 if the connection is closed.
+static int connection_read(connection_t* conn) {
+    int fd = conn->client.client_fd;
+    size_t header_size = bytepack_header_size(conn->request.version);
+    while (conn->header_received < header_size) {
+        ssize_t n = read(fd, conn->header + conn->header_received, header_size - conn->header_received);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->header_received += n;
+        if (conn->header_received == header_size) {
+            conn->request_size = bytepack_header_decode(conn->request.version, conn->header);
+            if (conn->request_size == 0) return -1;
+            if (bytepack_reserve(&conn->request, conn->request_size) < 0) return -1;
+        }
+    }
+    while (conn->body_received < conn->request_size) {
+        ssize_t n = read(fd, conn->request.data + conn->body_received,
+            conn->request_size - conn->body_received);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->body_received += n;
+    }
+    conn->request.size = conn->request_size;
+    conn->request.offset = 0;
+    return 1;
+}
+
+static void event_enqueue(event_server_t* server, connection_t* conn) {
+    conn->next = NULL;
+    sem_wait(&server->queue_mutex);
+    if (server->queue_tail == NULL) {
+        server->queue_head = conn;
+    } else {
+        server->queue_tail->next = conn;
+    }
+    server->queue_tail = conn;
+    sem_post(&server->queue_mutex);
+    sem_post(&server->queue_items);
+}
+
+static connection_t* event_dequeue(event_server_t* server) {
+    while (sem_wait(&server->queue_items) < 0);
+    sem_wait(&server->queue_mutex);
+    connection_t* conn = server->queue_head;
+    server->queue_head = conn->next;
+    if (server->queue_head == NULL) server->queue_tail = NULL;
+    sem_post(&server->queue_mutex);
+    return conn;
+}
+
+// Worker serving complete requests from the queue
+static void* event_worker(void* args) {
+    event_server_t* server = (event_server_t*) args;
+    while (1) {
+        connection_t* conn = event_dequeue(server);
+        int version = conn->greeted ? 0 : accept_hello(&conn->request, &conn->response);
+        conn->greeted = 1;
+        server_action_t action = version > 0 ? SERVER_RESPOND :
+            server->callbacks->on_request(conn->context, &conn->request, &conn->response);
+        if (action == SERVER_RESPOND || action == SERVER_RESPOND_CLOSE) {
+            if (bytepack_send(conn->client.client_fd, &conn->response) < 0) action = SERVER_CLOSE;
+        }
+        if (version > 0) {
+            conn->request.version = conn->response.version = version;
+        }
+        if (action == SERVER_RESPOND_CLOSE || action == SERVER_CLOSE) {
+            connection_close(server, conn);
+            continue;
+        }
+        connection_buffer_reset(&conn->request);
+        connection_buffer_reset(&conn->response);
+        conn->header_received = 0;
+        conn->body_received = 0;
+        if (connection_arm(server, conn, EPOLL_CTL_MOD) < 0) {
+            connection_close(server, conn);
+        }
+    }
+    return NULL;
+}
+
+// Accept all pending connections of the server socket
+static void event_accept(event_server_t* server, int sock_fd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_sock_fd = accept4(sock_fd, (struct sockaddr *) &client_addr, &client_addr_len, SOCK_NONBLOCK);
+        if (client_sock_fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        connection_t* conn = (connection_t*) calloc(1, sizeof(connection_t));
+        conn->client.client_fd = client_sock_fd;
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->client.client_ip, INET_ADDRSTRLEN);
+        conn->client.client_port = ntohs(client_addr.sin_port);
+        printf("Receiving connection from %s\n", conn->client.client_ip);
+        bytepack_init(&conn->request, CONNECTION_BUFFER_SIZE);
+        bytepack_init(&conn->response, CONNECTION_BUFFER_SIZE);
+        conn->context = server->callbacks->on_connect(&conn->client);
+        if (connection_arm(server, conn, EPOLL_CTL_ADD) < 0) {
+            perror("epoll_ctl");
+            connection_close(server, conn);
+        }
+    }
+}
+
+static int run_event_server(int sock_fd, const server_callbacks_t* callbacks, int num_workers) {
+    event_server_t* server = (event_server_t*) calloc(1, sizeof(event_server_t));
+    server->callbacks = callbacks;
+    sem_init(&server->queue_mutex, 0, 1);
+    sem_init(&server->queue_items, 0, 0);
+    server->epoll_fd = epoll_create1(0);
+    if (server->epoll_fd < 0 || set_nonblocking(sock_fd) < 0) {
+        perror("epoll");
+        return -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; // The server socket
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    for (int i = 0; i < num_workers; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, event_worker, server) != 0) {
+            fprintf(stderr, "Error: Could not create worker thread\n");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (1) {
+        int n = epoll_wait(server->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            connection_t* conn = (connection_t*) events[i].data.ptr;
+            if (conn == NULL) {
+                event_accept(server, sock_fd);
+                continue;
+            }
+            int ret = connection_read(conn);
+            if (ret < 0) {
+                connection_close(server, conn);
+            } else if (ret == 0) {
+                if (connection_arm(server, conn, EPOLL_CTL_MOD) < 0) connection_close(server, conn);
+            } else {
+                event_enqueue(server, conn);
+            }
+        }
     }
     return 0;
 }
 
+int run_callback_server(int sock_fd, const server_callbacks_t* callbacks, int num_workers) {
+    if (num_workers > 0) {
+        return run_event_server(sock_fd, callbacks, num_workers);
+    }
+    thread_callbacks = callbacks;
+    return run_server(sock_fd, callback_handler);
+}
+
 int connect_to_server(const char *ip, int port) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("socket");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -70,7 +371,38 @@ int connect_to_server(const char *ip, int port) {
     server_addr.sin_addr.s_addr = inet_addr(ip);
     if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("connect");
-        exit(EXIT_FAILURE);
+        close(sockfd);
+        return -1;
     }
     return sockfd;
 }
+
+int connect_to_server_versioned(const char *ip, int port, int *version) {
+    int sockfd = connect_to_server(ip, port);
+    if (sockfd < 0) return -1;
+    if (*version <= BYTEPACK_V1) {
+        *version = BYTEPACK_V1;
+        return sockfd;
+    }
+    char hello[HELLO_SIZE] = HELLO;
+    hello[HELLO_SIZE - 1] = (char)*version;
+    bytepack_t bp;
+    bytepack_init(&bp, 16);
+    int answer = 0;
+    if (bytepack_append(&bp, hello, HELLO_SIZE) == 0 && bytepack_send(sockfd, &bp) == 0) {
+        bytepack_reset(&bp);
+        if (bytepack_recv(sockfd, &bp) == 0 && bp.size == HELLO_SIZE &&
+            memcmp(bp.data, HELLO, HELLO_SIZE - 1) == 0) {
+            answer = bp.data[HELLO_SIZE - 1];
+        }
+    }
+    bytepack_free(&bp);
+    if (answer >= BYTEPACK_V1 && answer <= *version) {
+        *version = answer;
+        return sockfd;
+    }
+    // The server does not know the handshake and took it for a request, start over in V1
+    close(sockfd);
+    *version = BYTEPACK_V1;
+    return connect_to_server(ip, port);
+}
@@ -3,6 +3,8 @@
 
 #include <netinet/in.h>
 
+#include "../bytepack/bytepack.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -12,6 +14,7 @@ extern "C" {
 typedef struct client_handler_args_t {
     int client_fd;
     char client_ip[INET_ADDRSTRLEN];
+    int client_port;
 } client_handler_args_t;
 
 /// @brief The function to create, bind and listen to a server socket.
@@ -25,14 +28,51 @@ int initialize_server_socket(int port);
 /// @return Error code.
 int run_server(int sock_fd, void* (*handler)(void*));
 
+/// @brief What to do with a connection after a request is served.
+typedef enum server_action_t {
+    SERVER_RESPOND,         // Send the response and keep serving
+    SERVER_NO_RESPONSE,     // Keep serving without a response
+    SERVER_RESPOND_CLOSE,   // Send the response and close the connection
+    SERVER_CLOSE,           // Close the connection without a response
+} server_action_t;
+
+/// @brief Per-connection callbacks of a server, see run_callback_server.
+typedef struct server_callbacks_t {
+    /// @brief Called when a client connects.
+    /// @return The context of the connection passed to the other callbacks.
+    void* (*on_connect)(const client_handler_args_t* client);
+    /// @brief Serve a request of the connection, packing the response into response.
+    /// Requests of a connection are served one at a time, in order.
+    server_action_t (*on_request)(void* context, bytepack_t* request, bytepack_t* response);
+    /// @brief Called when the connection is closed, either side.
+    void (*on_disconnect)(void* context);
+} server_callbacks_t;
+
+/// @brief Accept client connections and serve their requests with callbacks.
+/// @param sock_fd The server socket.
+/// @param callbacks The callbacks, which must stay valid while the server runs.
+/// @param num_workers With 0, every client is served by its own thread. Otherwise
+/// all connections are multiplexed with epoll and requests run on num_workers threads.
+/// A connection opened by connect_to_server_versioned is answered by the server, and its
+/// requests and responses are in the negotiated wire format.
+/// @return Error code.
+int run_callback_server(int sock_fd, const server_callbacks_t* callbacks, int num_workers);
+
 // ------------ CLIENT -------------- //
 
 /// @brief Connect to a server.
 /// @param ip The IP address of the server.
 /// @param port The port number.
-/// @return The file descriptor of the client socket.
+/// @return The file descriptor of the client socket, -1 if the server cannot be reached.
 int connect_to_server(const char *ip, int port);
 
+/// @brief Connect to a server and negotiate the wire format of the connection, falling
+/// back to BYTEPACK_V1 on a new connection if the server does not know the handshake.
+/// @param version The newest version to use, set to the negotiated one, which bytepacks
+/// sent and received on the connection must be set to.
+/// @return The file descriptor of the client socket, -1 if the server cannot be reached.
+int connect_to_server_versioned(const char *ip, int port, int *version);
+
 #ifdef __cplusplus
 }
 #endif
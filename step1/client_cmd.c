@@ -5,6 +5,7 @@
 
 #include "../network/network.h"
 #include "../bytepack/bytepack.h"
+#include "disksim.h"
 
 int main(int argc, char *argv[]) {
     if (argc != 3) {
@@ -12,7 +13,8 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     int server_fd = connect_to_server(argv[1], atoi(argv[2]));
-    char data[320];
+    if (server_fd < 0) exit(EXIT_FAILURE);
+    static char data[MAX_SECTOR_SIZE + 1];
     bytepack_t request, response;
     bytepack_init(&request, 1024);
     bytepack_init(&response, 1024);
@@ -45,7 +47,7 @@ int main(int argc, char *argv[]) {
         } else if (request_type[0] == 'W') {
             int cylinder, sector, data_size;
             scanf("%d %d %d ", &cylinder, &sector, &data_size);
-            fgets(data, 320, stdin);
+            fgets(data, sizeof(data), stdin);
             bytepack_pack(&request, "ciii", 'W', cylinder, sector, data_size);
             bytepack_pack_bytes(&request, data, strlen(data) - 1);
             bytepack_dbg_print(&request);
@@ -58,15 +60,55 @@ int main(int argc, char *argv[]) {
             } else {
                 printf("Yes\n");
             }
+        } else if (request_type[0] == 'T') {
+            int cylinder, sector, count;
+            scanf("%d %d %d", &cylinder, &sector, &count);
+            bytepack_pack(&request, "ciii", 'T', cylinder, sector, count);
+            bytepack_send(server_fd, &request);
+            bytepack_recv(server_fd, &response);
+            bytepack_unpack(&response, "i", &result);
+            if (result == 0) {
+                bytepack_unpack(&response, "s", data);
+                printf("No: %s\n", data);
+            } else {
+                printf("Yes %d\n", result);
+            }
+        } else if (request_type[0] == 'K') {
+            bytepack_pack(&request, "c", 'K');
+            bytepack_send(server_fd, &request);
+            bytepack_recv(server_fd, &response);
+            long clock, num_requests;
+            bytepack_unpack(&response, "ll", &clock, &num_requests);
+            printf("clock %ld us, %ld requests\n", clock, num_requests);
+        } else if (request_type[0] == 'S') {
+            int reset, num_clients;
+            long clock, total_time;
+            diskstat_t stat;
+            scanf("%d", &reset);
+            bytepack_pack(&request, "cc", 'S', reset);
+            bytepack_send(server_fd, &request);
+            bytepack_recv(server_fd, &response);
+            bytepack_unpack(&response, "ill", &result, &clock, &total_time);
+            printf("clock %ld us, total time %ld\n", clock, total_time);
+            diskstat_unpack(&stat, &response);
+            diskstat_print(&stat, "disk");
+            bytepack_unpack(&response, "i", &num_clients);
+            for (int i = 0; i < num_clients; ++i) {
+                char name[64];
+                bytepack_unpack(&response, "s", name);
+                diskstat_unpack(&stat, &response);
+                diskstat_print(&stat, name);
+            }
         } else if (request_type[0] == 'I') {
             bytepack_pack(&request, "c", 'I');
             bytepack_send(server_fd, &request);
             bytepack_dbg_print(&request);
             bytepack_recv(server_fd, &response);
             bytepack_dbg_print(&response);
-            int r1, r2;
+            int r1, r2, r3 = DEFAULT_SECTOR_SIZE;
             bytepack_unpack(&response, "ii", &r1, &r2);
-            printf("%d %d\n", r1, r2);
+            bytepack_unpack(&response, "i", &r3);
+            printf("%d %d %d\n", r1, r2, r3);
         }
     } while (1);
     close(server_fd);
@@ -11,6 +11,7 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     int server_fd = connect_to_server(argv[1], atoi(argv[2]));
+    if (server_fd < 0) exit(EXIT_FAILURE);
     char response[MAX_RESPONSE_LEN];
     char *request = NULL;
     do { // Generate random data to test the server
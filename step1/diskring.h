@@ -0,0 +1,48 @@
+#ifndef DISKRING_H
+#define DISKRING_H
+
+// Shared-memory transport between the disk server and a client on the same host.
+// The client creates the region and asks the disk server to attach to it with an
+// 'L' request. The TCP connection stays open, closing it detaches the ring.
+//
+// Requests are submitted in order into entries[submitted % DISKRING_SLOTS], with
+// the sector data in the payload slot of the same index, and completed in order.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+
+#define DISKRING_MAGIC 0x474E4952   // "RING"
+#define DISKRING_SLOTS 64           // Same as DISK_MAX_BATCH
+#define DISKRING_HEADER_SIZE 4096   // Payload slots start at this offset
+
+typedef struct diskring_entry_t {
+    char op;            // 'R', 'W' or 'C'
+    int cylinder;
+    int sector;
+    int data_size;      // Bytes to write from the payload slot
+    int result;         // 1 on success, 0 on failure
+} diskring_entry_t;
+
+typedef struct diskring_t {
+    uint32_t magic;
+    int sector_size;
+    unsigned submitted;         // Entries ever submitted, advanced by the client
+    unsigned completed;         // Entries ever completed, advanced by the server
+    sem_t submit_sem;           // Posted by the client after submitting entries
+    sem_t complete_sem;         // Posted by the server after completing entries
+    int head_cylinder;          // Where the head was after the last completed entries
+    diskring_entry_t entries[DISKRING_SLOTS];
+} diskring_t;
+
+/// @brief Size of a ring with payload slots of sector_size bytes.
+static inline size_t diskring_size(int sector_size) {
+    return DISKRING_HEADER_SIZE + (size_t)DISKRING_SLOTS * sector_size;
+}
+
+/// @brief Payload slot of the entry at index.
+static inline char* diskring_slot(diskring_t *ring, unsigned index) {
+    return (char*)ring + DISKRING_HEADER_SIZE + (size_t)(index % DISKRING_SLOTS) * ring->sector_size;
+}
+
+#endif // !DISKRING_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "disksim.h"
 
 #include <string.h>
@@ -5,25 +6,71 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
 
 #define CHKRET(cond) if ((ret=(cond))<0) { return ret; }
 
-int disk_init(disk_t *disk, const char* filename, int num_cylinders, int num_sectors, int sector_move_time) {
+#define DISK_NO_HEAD -1         // A request that does not use the head, see disk_request_cylinder
+#define DISK_BAD_REQUEST -2
+
+#define IS_ALLOCATED(disk, index) ((disk)->allocated[(index) >> 3] & (1 << ((index) & 7)))
+#define SET_ALLOCATED(disk, index) ((disk)->allocated[(index) >> 3] |= (1 << ((index) & 7)))
+#define CLEAR_ALLOCATED(disk, index) ((disk)->allocated[(index) >> 3] &= ~(1 << ((index) & 7)))
+
+// Mark the sectors that hold data in the disk file, the others are holes
+void disk_scan_allocated(disk_t *disk, size_t diskfile_size) {
+    size_t num_sectors = diskfile_size / disk->sector_size;
+    off_t pos = 0;
+    while ((size_t)pos < diskfile_size) {
+        off_t data = lseek(disk->fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO) { // Holes are not supported, treat everything as data
+                memset(disk->allocated, 0xff, (num_sectors + 7) / 8);
+            }
+            return;
+        }
+        off_t hole = lseek(disk->fd, data, SEEK_HOLE);
+        if (hole < 0 || (size_t)hole > diskfile_size) hole = diskfile_size;
+        for (size_t i = data / disk->sector_size; i < (hole + disk->sector_size - 1) / disk->sector_size; ++i) {
+            SET_ALLOCATED(disk, i);
+        }
+        pos = hole;
+    }
+}
+
+int disk_init(disk_t *disk, const char* filename, int num_cylinders, int num_sectors, int sector_size, int sector_move_time) {
     disk->num_cylinders = num_cylinders;
     disk->num_sectors = num_sectors;
+    disk->sector_size = sector_size;
     disk->sector_move_time = sector_move_time;
     disk->current_cylinder = 0;
     disk->current_sector = 0;
     disk->total_time = 0;
+    disk->policy = DISK_SCHED_FIFO;
+    disk->busy = 0;
+    disk->direction = 1;
+    disk->pending = NULL;
+    disk->closing = NULL;
+    disk->virtual_clock = 0;
+    disk->clock = 0;
+    disk->num_requests = 0;
+    disk->trace = NULL;
+    diskstat_reset(&disk->stat);
+    disk->clients = NULL;
+    disk->current_client = NULL;
     // Open the disk file
     int diskfile_fd = open(filename, O_RDWR | O_CREAT, 0);
+    disk->fd = diskfile_fd;
     if (diskfile_fd < 0) {
         perror("open");
         return -1;
     }
     // Calculate the size of the disk file
-    size_t diskfile_size = num_cylinders * num_sectors * SECTOR_SIZE;
+    size_t diskfile_size = (size_t)num_cylinders * num_sectors * sector_size;
     // Truncate the disk file to the correct size
     if (ftruncate(diskfile_fd, diskfile_size) < 0) {
         perror("ftruncate");
@@ -35,19 +82,109 @@ int disk_init(disk_t *disk, const char* filename, int num_cylinders, int num_sec
         perror("mmap");
         return -1;
     }
+    // Find the sectors that were never written or have been trimmed
+    disk->allocated = calloc(((size_t)num_cylinders * num_sectors + 7) / 8, 1);
+    disk->zero_sector = calloc(disk->sector_size, 1);
+    if (disk->allocated == NULL || disk->zero_sector == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    disk_scan_allocated(disk, diskfile_size);
     // Initialize the mutex
-    if (sem_init(&disk->mutex, 0, 1) < 0) {
+    if (sem_init(&disk->mutex, 0, 1) < 0 || sem_init(&disk->stat_mutex, 0, 1) < 0) {
         perror("sem_init");
         return -1;
     }
     return 0;
 }
 
+int disk_parse_policy(const char *name) {
+    if (strcmp(name, "fifo") == 0) return DISK_SCHED_FIFO;
+    if (strcmp(name, "sstf") == 0) return DISK_SCHED_SSTF;
+    if (strcmp(name, "scan") == 0) return DISK_SCHED_SCAN;
+    if (strcmp(name, "clook") == 0) return DISK_SCHED_CLOOK;
+    return -1;
+}
+
+const char* disk_policy_name(disk_sched_t policy) {
+    static const char* names[] = { "fifo", "sstf", "scan", "clook" };
+    return names[policy];
+}
+
+// Current time in microseconds, on the simulated clock in virtual clock mode
+long disk_now(disk_t *disk) {
+    if (disk->virtual_clock) {
+        sem_wait(&disk->stat_mutex);
+        long clock = disk->clock;
+        sem_post(&disk->stat_mutex);
+        return clock;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Account bytes moved by the request being served
+void disk_add_bytes(disk_t *disk, long bytes_read, long bytes_written) {
+    sem_wait(&disk->stat_mutex);
+    disk->stat.bytes_read += bytes_read;
+    disk->stat.bytes_written += bytes_written;
+    if (disk->current_client != NULL) {
+        disk->current_client->stat.bytes_read += bytes_read;
+        disk->current_client->stat.bytes_written += bytes_written;
+    }
+    sem_post(&disk->stat_mutex);
+}
+
 void move_head(disk_t *disk, int cylinder) {
-    int wait_time = abs(disk->current_cylinder - cylinder) * disk->sector_move_time;
+    long distance = abs(disk->current_cylinder - cylinder);
+    sem_wait(&disk->stat_mutex);
+    diskstat_add_seek(&disk->stat, distance);
+    if (disk->current_client != NULL) {
+        diskstat_add_seek(&disk->current_client->stat, distance);
+    }
+    long wait_time = distance * disk->sector_move_time;
     disk->total_time += wait_time;
-    disk->current_cylinder = cylinder;
-    usleep(wait_time);
+    disk->clock += wait_time;
+    sem_post(&disk->stat_mutex);
+    __atomic_store_n(&disk->current_cylinder, cylinder, __ATOMIC_RELAXED); // Read by ring threads
+    if (!disk->virtual_clock) usleep(wait_time);
+}
+
+// Data of a sector to read, without touching the disk file if it is not allocated
+const char* disk_sector_data(disk_t *disk, int cylinder, int sector) {
+    size_t index = (size_t)cylinder * disk->num_sectors + sector;
+    if (!IS_ALLOCATED(disk, index)) return disk->zero_sector;
+    return disk->diskfile + index * disk->sector_size;
+}
+
+// Data of a sector to write, which becomes allocated
+char* disk_sector_write(disk_t *disk, int cylinder, int sector) {
+    size_t index = (size_t)cylinder * disk->num_sectors + sector;
+    SET_ALLOCATED(disk, index);
+    return disk->diskfile + index * disk->sector_size;
+}
+
+// Release count sectors starting from index in the disk file, they read as zeros afterwards
+void disk_trim(disk_t *disk, size_t index, size_t count) {
+    if (fallocate(disk->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)(index * disk->sector_size), (off_t)(count * disk->sector_size)) < 0) {
+        memset(disk->diskfile + index * disk->sector_size, 0, count * disk->sector_size);
+    }
+    for (size_t i = index; i < index + count; ++i) {
+        CLEAR_ALLOCATED(disk, i);
+    }
+}
+
+// Reference the data of a sector in a read response, without copying it out of the disk
+// file. The response is sent before the disk is released, see disk_serve_request.
+int disk_pack_sector(disk_t *disk, int cylinder, int sector, bytepack_t *response) {
+    return bytepack_append_ref(response, disk_sector_data(disk, cylinder, sector), disk->sector_size);
+}
+
+// End the response to a sector request with the cylinder the head is left at
+int disk_pack_head(disk_t *disk, bytepack_t *response) {
+    return bytepack_pack(response, "i", disk->current_cylinder);
 }
 
 #define CHECK_DISK_RANGE \
@@ -59,39 +196,181 @@ void move_head(disk_t *disk, int cylinder) {
 int disk_read(disk_t *disk, int cylinder, int sector, bytepack_t *response) {
     CHECK_DISK_RANGE;
     move_head(disk, cylinder);
-    bytepack_pack(response, "i", SECTOR_SIZE);
-    bytepack_pack_bytes(response, disk->diskfile + (cylinder * disk->num_sectors + sector) * SECTOR_SIZE, SECTOR_SIZE);
+    disk_add_bytes(disk, disk->sector_size, 0);
+    bytepack_pack(response, "i", disk->sector_size);
+    bytepack_pack_size(response, disk->sector_size);
+    disk_pack_sector(disk, cylinder, sector, response);
+    disk_pack_head(disk, response);
     return 0;
 }
 
 int disk_write(disk_t *disk, int cylinder, int sector, int data_size, const char *data, bytepack_t *response) {
     CHECK_DISK_RANGE;
-    if (data_size > SECTOR_SIZE) {
+    if (data_size > disk->sector_size) {
         bytepack_pack(response, "is", 0, "Error: Data size too large");
         return -1;
     }
     move_head(disk, cylinder);
-    memcpy(disk->diskfile + (cylinder * disk->num_sectors + sector) * SECTOR_SIZE, data, data_size);
-    memset(disk->diskfile + (cylinder * disk->num_sectors + sector) * SECTOR_SIZE + data_size, 0, SECTOR_SIZE - data_size);
+    disk_add_bytes(disk, 0, disk->sector_size);
+    char *dest = disk_sector_write(disk, cylinder, sector);
+    memcpy(dest, data, data_size);
+    memset(dest + data_size, 0, disk->sector_size - data_size);
     bytepack_pack(response, "i", 1);
+    disk_pack_head(disk, response);
     return 0;
 }
 
 int disk_clear_section(disk_t *disk, int cylinder, int sector, bytepack_t *response) {
     CHECK_DISK_RANGE;
     move_head(disk, cylinder);
-    memset(disk->diskfile + (cylinder * disk->num_sectors + sector) * SECTOR_SIZE, 0, SECTOR_SIZE);
+    disk_add_bytes(disk, 0, disk->sector_size);
+    disk_trim(disk, (size_t)cylinder * disk->num_sectors + sector, 1);
     bytepack_pack(response, "i", 1);
+    disk_pack_head(disk, response);
+    return 0;
+}
+
+#define CHECK_BATCH_SIZE \
+    if (count <= 0 || count > DISK_MAX_BATCH) {\
+        bytepack_pack(response, "is", 0, "Error: Invalid batch size");\
+        return -1;\
+    }
+
+#define CHECK_BATCH_RANGE \
+    for (int i = 0; i < count; ++i) {\
+        int cylinder = cylinders[i], sector = sectors[i];\
+        CHECK_DISK_RANGE;\
+    }
+
+// Batched read: "i" count, then "ii" (cylinder, sector) per sector.
+// Response: "ii" count, sector size, all sectors as one byte string, "i" head cylinder.
+int disk_read_batch(disk_t *disk, bytepack_t *request, bytepack_t *response) {
+    int count, ret;
+    int cylinders[DISK_MAX_BATCH], sectors[DISK_MAX_BATCH];
+    CHKRET(bytepack_unpack(request, "i", &count));
+    CHECK_BATCH_SIZE;
+    for (int i = 0; i < count; ++i) {
+        CHKRET(bytepack_unpack(request, "ii", &cylinders[i], &sectors[i]));
+    }
+    CHECK_BATCH_RANGE;
+    CHKRET(bytepack_pack(response, "ii", count, disk->sector_size));
+    disk_add_bytes(disk, (long)count * disk->sector_size, 0);
+    CHKRET(bytepack_pack_size(response, (size_t)count * disk->sector_size));
+    for (int i = 0; i < count; ++i) {
+        move_head(disk, cylinders[i]);
+        CHKRET(disk_pack_sector(disk, cylinders[i], sectors[i], response));
+    }
+    CHKRET(disk_pack_head(disk, response));
+    return 0;
+}
+
+// Batched write: "i" count, then "iii" (cylinder, sector, data_size) and the data per sector.
+// Response: "ii" count, head cylinder.
+int disk_write_batch(disk_t *disk, bytepack_t *request, bytepack_t *response) {
+    int count, ret;
+    int cylinders[DISK_MAX_BATCH], sectors[DISK_MAX_BATCH], data_sizes[DISK_MAX_BATCH];
+    const void *data[DISK_MAX_BATCH];
+    CHKRET(bytepack_unpack(request, "i", &count));
+    CHECK_BATCH_SIZE;
+    for (int i = 0; i < count; ++i) {
+        size_t data_real_size;
+        CHKRET(bytepack_unpack(request, "iii", &cylinders[i], &sectors[i], &data_sizes[i]));
+        CHKRET(bytepack_unpack_ref(request, &data[i], &data_real_size));
+        if (data_sizes[i] < 0 || data_real_size < (size_t)data_sizes[i]) {
+            bytepack_pack(response, "is", 0, "Error: Data size mismatch");
+            return -1;
+        }
+        if (data_sizes[i] > disk->sector_size) {
+            bytepack_pack(response, "is", 0, "Error: Data size too large");
+            return -1;
+        }
+    }
+    CHECK_BATCH_RANGE;
+    disk_add_bytes(disk, 0, (long)count * disk->sector_size);
+    for (int i = 0; i < count; ++i) {
+        move_head(disk, cylinders[i]);
+        char *dest = disk_sector_write(disk, cylinders[i], sectors[i]);
+        memcpy(dest, data[i], data_sizes[i]);
+        memset(dest + data_sizes[i], 0, disk->sector_size - data_sizes[i]);
+    }
+    CHKRET(bytepack_pack(response, "i", count));
+    CHKRET(disk_pack_head(disk, response));
     return 0;
 }
 
+// Batched clear: "i" count, then "ii" (cylinder, sector) per sector.
+// Response: "ii" count, head cylinder.
+int disk_clear_batch(disk_t *disk, bytepack_t *request, bytepack_t *response) {
+    int count, ret;
+    int cylinders[DISK_MAX_BATCH], sectors[DISK_MAX_BATCH];
+    CHKRET(bytepack_unpack(request, "i", &count));
+    CHECK_BATCH_SIZE;
+    for (int i = 0; i < count; ++i) {
+        CHKRET(bytepack_unpack(request, "ii", &cylinders[i], &sectors[i]));
+    }
+    CHECK_BATCH_RANGE;
+    disk_add_bytes(disk, 0, (long)count * disk->sector_size);
+    for (int i = 0; i < count; ++i) {
+        move_head(disk, cylinders[i]);
+        disk_trim(disk, (size_t)cylinders[i] * disk->num_sectors + sectors[i], 1);
+    }
+    CHKRET(bytepack_pack(response, "i", count));
+    CHKRET(disk_pack_head(disk, response));
+    return 0;
+}
+
+// Trim: "iii" cylinder, sector, count of consecutive sectors, which may span cylinders.
+// The head is not moved. Response: "i" count.
+int disk_trim_range(disk_t *disk, bytepack_t *request, bytepack_t *response) {
+    int cylinder, sector, count, ret;
+    CHKRET(bytepack_unpack(request, "iii", &cylinder, &sector, &count));
+    CHECK_DISK_RANGE;
+    size_t index = (size_t)cylinder * disk->num_sectors + sector;
+    if (count <= 0 || index + count > (size_t)disk->num_cylinders * disk->num_sectors) {
+        bytepack_pack(response, "is", 0, "Error: Invalid trim range");
+        return -1;
+    }
+    disk_trim(disk, index, count);
+    CHKRET(bytepack_pack(response, "i", count));
+    return 0;
+}
+
+// Statistics: "c" reset flag, the statistics are reset after being returned if it is non-zero.
+// Response: "i" 1, "ll" clock, total_time, the statistics of the disk, "i" number of clients,
+// then "s" name and the statistics per client, each packed by diskstat_pack.
+int disk_stat(disk_t *disk, bytepack_t *request, bytepack_t *response) {
+    int ret, num_clients = 0;
+    char reset;
+    CHKRET(bytepack_unpack(request, "c", &reset));
+    sem_wait(&disk->stat_mutex);
+    for (disk_client_t *client = disk->clients; client != NULL; client = client->next) {
+        num_clients++;
+    }
+    ret = bytepack_pack(response, "ill", 1, disk->clock, disk->total_time);
+    if (ret == 0) ret = diskstat_pack(&disk->stat, response);
+    if (ret == 0) ret = bytepack_pack(response, "i", num_clients);
+    for (disk_client_t *client = disk->clients; client != NULL && ret == 0; client = client->next) {
+        ret = bytepack_pack(response, "s", client->name);
+        if (ret == 0) ret = diskstat_pack(&client->stat, response);
+    }
+    if (ret == 0 && reset) {
+        diskstat_reset(&disk->stat);
+        for (disk_client_t *client = disk->clients; client != NULL; client = client->next) {
+            diskstat_reset(&client->stat);
+        }
+        disk->total_time = 0;
+    }
+    sem_post(&disk->stat_mutex);
+    return ret;
+}
+
 int disk_serve_request_(disk_t *disk, bytepack_t *request, bytepack_t *response) {
     int cylinder, sector, data_size, ret;
-    // read the request type: I R W
+    // read the request type: I R W C E, batched r w c
     char request_type;
     CHKRET(bytepack_unpack(request, "c", &request_type));
     if (request_type == 'I') {
-        CHKRET(bytepack_pack(response, "ii", disk->num_cylinders, disk->num_sectors));
+        CHKRET(bytepack_pack(response, "iii", disk->num_cylinders, disk->num_sectors, disk->sector_size));
     } else if (request_type == 'C') {
         CHKRET(bytepack_unpack(request, "ii", &cylinder, &sector));
         CHKRET(disk_clear_section(disk, cylinder, sector, response));
@@ -99,20 +378,38 @@ int disk_serve_request_(disk_t *disk, bytepack_t *request, bytepack_t *response)
         CHKRET(bytepack_unpack(request, "ii", &cylinder, &sector));
         CHKRET(disk_read(disk, cylinder, sector, response));
     } else if (request_type == 'W') {
-        char data[320];
+        const void *data;
         CHKRET(bytepack_unpack(request, "iii", &cylinder, &sector, &data_size));
         size_t data_real_size;
         // printf("data_size: %d\n", data_size);
-        CHKRET(bytepack_unpack_bytes(request, data, &data_real_size));
+        CHKRET(bytepack_unpack_ref(request, &data, &data_real_size));
         // printf("data_real_size: %ld\n", data_real_size);
         // printf("data: %s\n", data);
-        if (data_real_size < data_size) {
+        if (data_size < 0 || data_real_size < (size_t)data_size) {
             CHKRET(bytepack_pack(response, "is", 0, "Error: Data size mismatch"));
         } else {
             CHKRET(disk_write(disk, cylinder, sector, data_size, data, response));
         }
+    } else if (request_type == 'r') {
+        CHKRET(disk_read_batch(disk, request, response));
+    } else if (request_type == 'w') {
+        CHKRET(disk_write_batch(disk, request, response));
+    } else if (request_type == 'c') {
+        CHKRET(disk_clear_batch(disk, request, response));
+    } else if (request_type == 'T') {
+        CHKRET(disk_trim_range(disk, request, response));
+    } else if (request_type == 'K') {
+        sem_wait(&disk->stat_mutex);
+        long clock = disk->clock, num_requests = disk->num_requests;
+        sem_post(&disk->stat_mutex);
+        CHKRET(bytepack_pack(response, "ll", clock, num_requests));
+    } else if (request_type == 'S') {
+        CHKRET(disk_stat(disk, request, response));
     } else if (request_type == 'E') {
-        CHKRET(bytepack_pack(response, "ii", 1, disk->total_time));
+        sem_wait(&disk->stat_mutex);
+        long total_time = disk->total_time;
+        sem_post(&disk->stat_mutex);
+        CHKRET(bytepack_pack(response, "il", 1, total_time));
         return 'E';
     } else {
         CHKRET(bytepack_pack(response, "is", 0, "Error: Invalid request type"));
@@ -120,23 +417,333 @@ int disk_serve_request_(disk_t *disk, bytepack_t *request, bytepack_t *response)
     return 0;
 }
 
-// Wrapper function to serve request with mutex
-int disk_serve_request(disk_t *disk, bytepack_t *request, bytepack_t *response) {
+// Peek the first cylinder a request seeks to. DISK_NO_HEAD for the requests that only
+// read the geometry or the statistics, DISK_BAD_REQUEST for unknown or malformed ones.
+int disk_request_cylinder(disk_t *disk, const bytepack_t *request) {
+    bytepack_t peek = *request;
+    char request_type;
+    int count, cylinder;
+    if (bytepack_unpack(&peek, "c", &request_type) < 0) return DISK_BAD_REQUEST;
+    if (request_type == 'I' || request_type == 'K' || request_type == 'S' || request_type == 'E') {
+        return DISK_NO_HEAD;
+    }
+    if (request_type == 'r' || request_type == 'w' || request_type == 'c') {
+        if (bytepack_unpack(&peek, "i", &count) < 0) return DISK_BAD_REQUEST;
+    } else if (request_type != 'R' && request_type != 'W' && request_type != 'C' && request_type != 'T') {
+        return DISK_BAD_REQUEST;
+    }
+    if (bytepack_unpack(&peek, "i", &cylinder) < 0) return DISK_BAD_REQUEST;
+    if (cylinder < 0 || cylinder >= disk->num_cylinders) return DISK_BAD_REQUEST;
+    return cylinder;
+}
+
+// Remove and return the pending request to serve next. Must hold disk->mutex.
+// For SCAN, *edge is set to the cylinder the head sweeps to before reversing.
+disk_waiter_t* disk_pick_next(disk_t *disk, int *edge) {
+    disk_waiter_t **best = NULL, **p;
+    int current = disk->current_cylinder;
+    *edge = -1;
+    if (disk->pending == NULL) return NULL;
+    switch (disk->policy) {
+    case DISK_SCHED_FIFO:
+        best = &disk->pending;
+        break;
+    case DISK_SCHED_SSTF:
+        for (p = &disk->pending; *p != NULL; p = &(*p)->next) {
+            if (best == NULL || abs((*p)->cylinder - current) < abs((*best)->cylinder - current)) {
+                best = p;
+            }
+        }
+        break;
+    case DISK_SCHED_SCAN:
+        for (int pass = 0; pass < 2 && best == NULL; ++pass) {
+            for (p = &disk->pending; *p != NULL; p = &(*p)->next) {
+                int distance = ((*p)->cylinder - current) * disk->direction;
+                if (distance >= 0 && (best == NULL || distance < ((*best)->cylinder - current) * disk->direction)) {
+                    best = p;
+                }
+            }
+            if (best == NULL) { // Nothing ahead: sweep to the end, then reverse
+                *edge = disk->direction > 0 ? disk->num_cylinders - 1 : 0;
+                current = *edge;
+                disk->direction = -disk->direction;
+            }
+        }
+        break;
+    case DISK_SCHED_CLOOK:
+        for (p = &disk->pending; *p != NULL; p = &(*p)->next) {
+            int ahead = (*p)->cylinder >= current;
+            if (best == NULL) {
+                best = p;
+                continue;
+            }
+            int best_ahead = (*best)->cylinder >= current;
+            if (ahead != best_ahead) {
+                if (ahead) best = p;
+            } else if ((*p)->cylinder < (*best)->cylinder) {
+                best = p;
+            }
+        }
+        break;
+    }
+    disk_waiter_t *next = *best;
+    *best = next->next;
+    return next;
+}
+
+// Wait until the disk is granted to a request seeking to cylinder
+void disk_acquire(disk_t *disk, int cylinder) {
     sem_wait(&disk->mutex);
-    int ret = disk_serve_request_(disk, request, response);
+    if (!disk->busy) {
+        disk->busy = 1;
+        sem_post(&disk->mutex);
+        return;
+    }
+    disk_waiter_t waiter, **tail;
+    waiter.cylinder = cylinder;
+    waiter.next = NULL;
+    sem_init(&waiter.ready, 0, 0);
+    for (tail = &disk->pending; *tail != NULL; tail = &(*tail)->next);
+    *tail = &waiter;
     sem_post(&disk->mutex);
+    sem_wait(&waiter.ready); // The disk is handed over by disk_release
+    sem_destroy(&waiter.ready);
+}
+
+// Hand the disk over to the next pending request
+void disk_release(disk_t *disk) {
+    int edge = -1;
+    sem_wait(&disk->mutex);
+    disk_waiter_t *next = disk->closing;
+    if (next != NULL) {
+        disk->closing = NULL;
+    } else {
+        next = disk_pick_next(disk, &edge);
+    }
+    if (next == NULL) disk->busy = 0;
+    sem_post(&disk->mutex);
+    if (next != NULL) {
+        if (edge >= 0) move_head(disk, edge);
+        sem_post(&next->ready);
+    }
+}
+
+// Record a finished request in the statistics
+void disk_add_request(disk_t *disk, disk_client_t *client, char op, long latency) {
+    sem_wait(&disk->stat_mutex);
+    diskstat_add_request(&disk->stat, op, latency);
+    if (client != NULL) {
+        diskstat_add_request(&client->stat, op, latency);
+    }
+    sem_post(&disk->stat_mutex);
+}
+
+// Wait for the disk to serve a request of client seeking to cylinder
+void disk_begin(disk_t *disk, disk_client_t *client, int cylinder) {
+    disk_acquire(disk, cylinder);
+    disk->current_client = client;
+}
+
+// Finish a request started at start and hand the disk over
+void disk_end(disk_t *disk, disk_client_t *client, char op, int cylinder, long start) {
+    disk->current_client = NULL;
+    sem_wait(&disk->stat_mutex);
+    disk->num_requests++;
+    sem_post(&disk->stat_mutex);
+    if (disk->trace != NULL) {
+        fprintf(disk->trace, "%ld %c %d\n", disk->clock, op, cylinder);
+    }
+    disk_add_request(disk, client, op, disk_now(disk) - start);
+    disk_release(disk);
+}
+
+// Wrapper function to serve request in the order of the scheduling policy
+// Replace what a failed request packed after the first size bytes of response with an error,
+// so that it is still answered
+static void disk_fail_response(bytepack_t *response, size_t size, int num_refs) {
+    response->size = response->offset = size;
+    while (response->num_refs > num_refs) response->ref_size -= response->refs[--response->num_refs].size;
+    bytepack_pack(response, "is", 0, "Error: Malformed request");
+}
+int disk_serve_request(disk_t *disk, disk_client_t *client, bytepack_t *request, bytepack_t *response,
+    disk_send_t send, void *context) {
+    int ret, num_refs = response->num_refs;
+    size_t size = response->offset;
+    char op = request->offset < request->size ? request->data[request->offset] : 0;
+    long start = disk_now(disk);
+    int cylinder = disk_request_cylinder(disk, request);
+    if (cylinder == DISK_BAD_REQUEST) { // Rejected before it can hold the disk
+        ret = bytepack_pack(response, "is", 0, "Error: Invalid request");
+        send(context, response);
+        return ret;
+    }
+    if (cylinder == DISK_NO_HEAD) { // Does not move the head, no need to wait in queue
+        ret = disk_serve_request_(disk, request, response);
+        if (ret < 0) disk_fail_response(response, size, num_refs);
+        send(context, response);
+        disk_add_request(disk, client, op, disk_now(disk) - start);
+        return ret;
+    }
+    disk_begin(disk, client, cylinder);
+    ret = disk_serve_request_(disk, request, response);
+    if (ret < 0) disk_fail_response(response, size, num_refs);
+    send(context, response); // Sectors in the response may change once the disk is released
+    disk_end(disk, client, op, cylinder, start);
     return ret;
 }
 
+int disk_serve_sector(disk_t *disk, disk_client_t *client, char op, int cylinder, int sector,
+    char *data, int data_size) {
+    if (cylinder < 0 || cylinder >= disk->num_cylinders || sector < 0 || sector >= disk->num_sectors) return 0;
+    if (op != 'R' && op != 'W' && op != 'C') return 0;
+    if (op == 'W' && (data_size < 0 || data_size > disk->sector_size)) return 0;
+    long start = disk_now(disk);
+    disk_begin(disk, client, cylinder);
+    move_head(disk, cylinder);
+    if (op == 'R') {
+        disk_add_bytes(disk, disk->sector_size, 0);
+        memcpy(data, disk_sector_data(disk, cylinder, sector), disk->sector_size);
+    } else if (op == 'W') {
+        disk_add_bytes(disk, 0, disk->sector_size);
+        char *dest = disk_sector_write(disk, cylinder, sector);
+        memcpy(dest, data, data_size);
+        memset(dest + data_size, 0, disk->sector_size - data_size);
+    } else {
+        disk_add_bytes(disk, 0, disk->sector_size);
+        disk_trim(disk, (size_t)cylinder * disk->num_sectors + sector, 1);
+    }
+    disk_end(disk, client, op, cylinder, start);
+    return 1;
+}
+
+_Static_assert(sizeof(diskring_t) <= DISKRING_HEADER_SIZE, "diskring_t does not fit in the ring header");
+
+// Serve the entries of a ring as they are submitted, until it is detached
+void* disk_ring_serve(void *args) {
+    disk_ring_t *ring = (disk_ring_t*)args;
+    diskring_t *r = ring->ring;
+    int broken = 0;
+    while (1) {
+        if (sem_wait(&r->submit_sem) < 0) continue;
+        if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) break;
+        if (broken) continue;
+        unsigned submitted = __atomic_load_n(&r->submitted, __ATOMIC_ACQUIRE);
+        unsigned completed = r->completed;
+        if (submitted == completed) continue;
+        if (submitted - completed > DISKRING_SLOTS) { // Broken client, stop serving it
+            fprintf(stderr, "%s Error: Shared-memory ring overflow\n", ring->client->name);
+            broken = 1;
+            continue;
+        }
+        for (; completed != submitted; ++completed) {
+            diskring_entry_t *entry = &r->entries[completed % DISKRING_SLOTS];
+            entry->result = disk_serve_sector(ring->disk, ring->client, entry->op, entry->cylinder,
+                entry->sector, diskring_slot(r, completed), entry->data_size);
+        }
+        // Other clients may have moved it since, it is a hint
+        r->head_cylinder = __atomic_load_n(&ring->disk->current_cylinder, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->completed, completed, __ATOMIC_RELEASE);
+        sem_post(&r->complete_sem);
+    }
+    munmap(r, ring->size);
+    if (ring->on_exit != NULL) ring->on_exit(ring->context);
+    free(ring);
+    return NULL;
+}
+
+disk_ring_t* disk_ring_attach(disk_t *disk, disk_client_t *client, const char *name,
+    void (*on_exit)(void*), void *context, const char **error) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) { // Not created on this host
+        *error = "Error: Cannot open shared memory";
+        return NULL;
+    }
+    struct stat st;
+    size_t size = diskring_size(disk->sector_size);
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < size) {
+        close(fd);
+        *error = "Error: Shared memory too small";
+        return NULL;
+    }
+    diskring_t *r = (diskring_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+        *error = "Error: Cannot map shared memory";
+        return NULL;
+    }
+    if (r->magic != DISKRING_MAGIC || r->sector_size != disk->sector_size) {
+        munmap(r, size);
+        *error = "Error: Bad shared-memory ring";
+        return NULL;
+    }
+    disk_ring_t *ring = (disk_ring_t*)malloc(sizeof(disk_ring_t));
+    ring->ring = r;
+    ring->size = size;
+    ring->stop = 0;
+    ring->disk = disk;
+    ring->client = client;
+    ring->on_exit = on_exit;
+    ring->context = context;
+    if (pthread_create(&ring->thread, NULL, disk_ring_serve, ring) != 0) {
+        munmap(r, size);
+        free(ring);
+        *error = "Error: Cannot create ring thread";
+        return NULL;
+    }
+    pthread_detach(ring->thread);
+    return ring;
+}
+
+void disk_ring_detach(disk_ring_t *ring) {
+    __atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&ring->ring->submit_sem); // Wake up the thread to exit
+}
+
+void disk_client_init(disk_t *disk, disk_client_t *client, const char *name) {
+    snprintf(client->name, sizeof(client->name), "%s", name);
+    diskstat_reset(&client->stat);
+    sem_wait(&disk->stat_mutex);
+    client->next = disk->clients;
+    disk->clients = client;
+    sem_post(&disk->stat_mutex);
+}
+
+void disk_client_free(disk_t *disk, disk_client_t *client) {
+    sem_wait(&disk->stat_mutex);
+    for (disk_client_t **p = &disk->clients; *p != NULL; p = &(*p)->next) {
+        if (*p == client) {
+            *p = client->next;
+            break;
+        }
+    }
+    sem_post(&disk->stat_mutex);
+}
+
+// The disk is taken like a request and kept, so the request being served finishes first and
+// no other one starts. Requests queued or arriving later block for good on the semaphores,
+// which are not destroyed for that reason: the process is expected to exit next.
 int disk_free(disk_t *disk) {
-    sem_wait(&disk->mutex); // Wait for the disk mutex
-    if (munmap(disk->diskfile, disk->num_cylinders * disk->num_sectors * SECTOR_SIZE) < 0) {
-        perror("munmap");
-        return -1;
+    sem_wait(&disk->mutex);
+    if (!disk->busy) {
+        disk->busy = 1;
+        sem_post(&disk->mutex);
+    } else {
+        disk_waiter_t waiter;
+        sem_init(&waiter.ready, 0, 0);
+        disk->closing = &waiter;
+        sem_post(&disk->mutex);
+        sem_wait(&waiter.ready);
     }
-    if (sem_destroy(&disk->mutex) < 0) {
-        perror("sem_destroy");
+    if (disk->trace != NULL) {
+        fclose(disk->trace);
+        disk->trace = NULL;
+    }
+    if (munmap(disk->diskfile, (size_t)disk->num_cylinders * disk->num_sectors * disk->sector_size) < 0) {
+        perror("munmap");
         return -1;
     }
+    close(disk->fd);
+    free(disk->allocated);
+    free(disk->zero_sector);
     return 0;
 }
\ No newline at end of file
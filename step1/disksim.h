@@ -1,33 +1,144 @@
 #ifndef DISKSIM_H
 #define DISKSIM_H
 
-#define SECTOR_SIZE 256
+#define DEFAULT_SECTOR_SIZE 256
+#define MIN_SECTOR_SIZE 256
+#define MAX_SECTOR_SIZE 65536
+#define DISK_MAX_BATCH 64   // Max number of sectors in one batched request
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <semaphore.h>
 
 #include "../bytepack/bytepack.h"
+#include "diskstat.h"
+#include "diskring.h"
+
+/// @brief Policies to order requests waiting for the disk
+typedef enum {
+    DISK_SCHED_FIFO = 0,    // Arrival order
+    DISK_SCHED_SSTF,        // Shortest seek time first
+    DISK_SCHED_SCAN,        // Elevator, sweeping to the last cylinder before reversing
+    DISK_SCHED_CLOOK,       // Serve upwards only, then jump back to the lowest request
+} disk_sched_t;
+
+/// @brief A request waiting for the disk
+typedef struct disk_waiter_t_ {
+    int cylinder;                   // Cylinder the request seeks to first
+    sem_t ready;                    // Posted when the request is granted the disk
+    struct disk_waiter_t_ *next;
+} disk_waiter_t;
+
+/// @brief A connection to the disk, with its own statistics
+typedef struct disk_client_t_ {
+    char name[64];                  // ip:port of the client
+    diskstat_t stat;                // Statistics of requests from this client
+    struct disk_client_t_ *next;
+} disk_client_t;
+
+/// @brief A shared-memory ring of a client being served, see diskring.h
+typedef struct disk_ring_t_ {
+    diskring_t *ring;
+    size_t size;                    // Size of the mapping of ring
+    int stop;                       // Set to stop serving
+    struct disk_t_ *disk;
+    disk_client_t *client;          // The client owning the ring
+    pthread_t thread;               // Serving the requests in the ring
+    void (*on_exit)(void*);         // Called by the thread once it stops serving
+    void *context;                  // Passed to on_exit
+} disk_ring_t;
+
+/// @brief Sends the response to a request, see disk_serve_request.
+/// @return 0 on success, -1 if the client is gone.
+typedef int (*disk_send_t)(void *context, const bytepack_t *response);
 
 /// @brief Disk structure
-typedef struct {
+typedef struct disk_t_ {
     int num_cylinders;      // Number of cylinders
     int num_sectors;        // Number of sectors per cylinder
+    int sector_size;        // Size of a sector in bytes
     int sector_move_time;   // Time to move between adjacent sectors
     char *diskfile;         // Pointer to the disk file buffer
+    int fd;                 // File descriptor of the disk file
+    unsigned char *allocated; // Bitmap of sectors backed by data in the disk file
+    char *zero_sector;      // Served for sectors that are not allocated
     int current_cylinder;   // Current cylinder
     int current_sector;     // Current sector
-    int total_time;         // Total time taken to serve requests
+    long total_time;        // Total time taken to serve requests
     sem_t mutex;            // Mutex to protect the disk structure
+    disk_sched_t policy;    // Scheduling policy of pending requests
+    int busy;               // Whether a request is being served
+    int direction;          // Head direction for SCAN: 1 for up, -1 for down
+    disk_waiter_t *pending; // Requests waiting for the disk, in arrival order
+    disk_waiter_t *closing; // disk_free waiting for the disk, ahead of the pending requests
+    int virtual_clock;      // Accumulate seek time on clock instead of sleeping
+    long clock;             // Simulated time in microseconds
+    long num_requests;      // Number of requests served by the disk
+    FILE *trace;            // Completion timestamp of every request, if not NULL
+    diskstat_t stat;        // Statistics of all requests
+    disk_client_t *clients; // Connected clients
+    disk_client_t *current_client; // Client of the request being served
+    sem_t stat_mutex;       // Mutex to protect the statistics and clients
 } disk_t;
 
-int disk_init(disk_t *disk, const char* filename, int num_cylinders, int num_sectors, int sector_move_time);
+int disk_init(disk_t *disk, const char* filename, int num_cylinders, int num_sectors, int sector_size, int sector_move_time);
+
+/// @brief Parse a scheduling policy name: fifo, sstf, scan or clook.
+/// @return The policy, or -1 if the name is unknown.
+int disk_parse_policy(const char *name);
+
+const char* disk_policy_name(disk_sched_t policy);
 
 /// @brief Simulate the disk serving a request.
+/// 'I' returns the number of cylinders, sectors per cylinder and the sector size.
+/// Single sector requests: 'R' 'W' 'C'. Batched requests carrying up to
+/// DISK_MAX_BATCH sectors: 'r' 'w' 'c', served under one lock acquisition.
+/// Requests from all connections that arrive while the disk is busy are
+/// queued and served in the order chosen by disk->policy.
+/// 'T' trims a range of sectors: their space in the disk file is released
+/// and they read as zeros.
+/// Responses to successful sector requests (R W C r w c) end with "i" the cylinder the
+/// head is left at, so clients can place writes near it. Older clients ignore it.
+/// 'K' returns the simulated clock and the number of requests served.
+/// 'S' returns the statistics of the disk and of every client, see disk_stat.
+/// Only 'I' 'K' 'S' 'E' are served without waiting for the disk. Unknown or malformed
+/// requests, and ones to a cylinder out of range, get "is" 0 and an error right away.
+/// Read responses reference the sectors in the disk file instead of copying them, so the
+/// response is passed to send(context, response) while the request still holds the disk.
 /// @param disk 
+/// @param client The connection sending the request.
 /// @param request 
-/// @return Response to the request. The buffer is fix-sized.
-int disk_serve_request(disk_t *disk, bytepack_t *request, bytepack_t *response);
+/// @param response Packed and sent, it must not be sent again by the caller.
+/// @return 'E' if the client is leaving, -1 on a failed request, 0 otherwise.
+int disk_serve_request(disk_t *disk, disk_client_t *client, bytepack_t *request, bytepack_t *response,
+    disk_send_t send, void *context);
+
+/// @brief Serve a single sector request with its data in memory, in the order of the
+/// scheduling policy like disk_serve_request.
+/// @param op 'R' reads the sector into data, 'W' writes data_size bytes of data to it, 'C' clears it.
+/// @return 1 on success, 0 on an invalid request.
+int disk_serve_sector(disk_t *disk, disk_client_t *client, char op, int cylinder, int sector,
+    char *data, int data_size);
+
+/// @brief Attach to the shared-memory ring a client created under name and serve its
+/// requests in a thread. client must stay valid until on_exit(context) is called.
+/// @return The ring, or NULL with the reason in *error.
+disk_ring_t* disk_ring_attach(disk_t *disk, disk_client_t *client, const char *name,
+    void (*on_exit)(void*), void *context, const char **error);
+
+/// @brief Stop serving a ring without waiting. Its thread detaches from it and frees it
+/// once the requests being served are done, then calls on_exit.
+void disk_ring_detach(disk_ring_t *ring);
+
+/// @brief Register a new connection to the disk.
+void disk_client_init(disk_t *disk, disk_client_t *client, const char *name);
+
+/// @brief Unregister a connection. Its requests stay in the disk statistics.
+void disk_client_free(disk_t *disk, disk_client_t *client);
 
+/// @brief Wait for the request being served, then unmap the disk file. The disk stays held,
+/// so requests queued or sent afterwards never return: call it right before exiting.
 int disk_free(disk_t *disk);
 
 #endif // !DISKSIM_H
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "diskstat.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int diskstat_bucket(long value) {
+    if (value <= 0) return 0;
+    int bucket = 64 - __builtin_clzl((unsigned long)value);
+    return bucket < DISKSTAT_BUCKETS ? bucket : DISKSTAT_BUCKETS - 1;
+}
+
+void diskstat_reset(diskstat_t *stat) {
+    memset(stat, 0, sizeof(diskstat_t));
+}
+
+void diskstat_add_request(diskstat_t *stat, char op, long latency) {
+    stat->requests[(unsigned char)op % DISKSTAT_OPS]++;
+    stat->latency[diskstat_bucket(latency)]++;
+}
+
+void diskstat_add_seek(diskstat_t *stat, long distance) {
+    stat->seek[diskstat_bucket(distance)]++;
+}
+
+int diskstat_pack(const diskstat_t *stat, bytepack_t *bp) {
+    int ret = 0, num_ops = 0;
+    for (int op = 0; op < DISKSTAT_OPS; ++op) {
+        if (stat->requests[op] > 0) num_ops++;
+    }
+    ret |= bytepack_pack(bp, "i", num_ops);
+    for (int op = 0; op < DISKSTAT_OPS; ++op) {
+        if (stat->requests[op] > 0) {
+            ret |= bytepack_pack(bp, "cl", op, stat->requests[op]);
+        }
+    }
+    for (int i = 0; i < DISKSTAT_BUCKETS; ++i) {
+        ret |= bytepack_pack(bp, "l", stat->latency[i]);
+    }
+    for (int i = 0; i < DISKSTAT_BUCKETS; ++i) {
+        ret |= bytepack_pack(bp, "l", stat->seek[i]);
+    }
+    ret |= bytepack_pack(bp, "ll", stat->bytes_read, stat->bytes_written);
+    return ret < 0 ? -1 : 0;
+}
+
+int diskstat_unpack(diskstat_t *stat, bytepack_t *bp) {
+    int num_ops;
+    diskstat_reset(stat);
+    if (bytepack_unpack(bp, "i", &num_ops) < 0) return -1;
+    for (int i = 0; i < num_ops; ++i) {
+        char op;
+        long count;
+        if (bytepack_unpack(bp, "cl", &op, &count) < 0) return -1;
+        stat->requests[(unsigned char)op % DISKSTAT_OPS] = count;
+    }
+    for (int i = 0; i < DISKSTAT_BUCKETS; ++i) {
+        if (bytepack_unpack(bp, "l", &stat->latency[i]) < 0) return -1;
+    }
+    for (int i = 0; i < DISKSTAT_BUCKETS; ++i) {
+        if (bytepack_unpack(bp, "l", &stat->seek[i]) < 0) return -1;
+    }
+    return bytepack_unpack(bp, "ll", &stat->bytes_read, &stat->bytes_written);
+}
+
+void diskstat_print_histogram(const long *histogram, const char *unit) {
+    for (int i = 0; i < DISKSTAT_BUCKETS; ++i) {
+        if (histogram[i] == 0) continue;
+        if (i == 0) {
+            printf("    %20s %s: %ld\n", "0", unit, histogram[i]);
+        } else {
+            char range[32];
+            snprintf(range, sizeof(range), "%lu-%lu", 1UL << (i - 1), (1UL << i) - 1);
+            printf("    %20s %s: %ld\n", range, unit, histogram[i]);
+        }
+    }
+}
+
+void diskstat_print(const diskstat_t *stat, const char *title) {
+    printf("%s\n  requests:", title);
+    for (int op = 0; op < DISKSTAT_OPS; ++op) {
+        if (stat->requests[op] > 0) printf(" %c=%ld", op, stat->requests[op]);
+    }
+    printf("\n  bytes read: %ld, bytes written: %ld\n", stat->bytes_read, stat->bytes_written);
+    printf("  latency:\n");
+    diskstat_print_histogram(stat->latency, "us");
+    printf("  seek distance:\n");
+    diskstat_print_histogram(stat->seek, "cylinders");
+}
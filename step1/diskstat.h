@@ -0,0 +1,35 @@
+#ifndef DISKSTAT_H
+#define DISKSTAT_H
+
+#include "../bytepack/bytepack.h"
+
+#define DISKSTAT_BUCKETS 32     // Number of log2 buckets in a histogram
+#define DISKSTAT_OPS 128        // Request types are indexed by their opcode
+
+/// @brief Statistics of the requests served by the disk.
+/// Histogram bucket 0 counts zero values, bucket i counts values in [2^(i-1), 2^i).
+typedef struct {
+    long requests[DISKSTAT_OPS];        // Number of requests per opcode
+    long latency[DISKSTAT_BUCKETS];     // Request latency in microseconds, including queueing
+    long seek[DISKSTAT_BUCKETS];        // Seek distance in cylinders
+    long bytes_read;                    // Bytes read from the disk
+    long bytes_written;                 // Bytes written to the disk
+} diskstat_t;
+
+void diskstat_reset(diskstat_t *stat);
+
+void diskstat_add_request(diskstat_t *stat, char op, long latency);
+
+void diskstat_add_seek(diskstat_t *stat, long distance);
+
+/// @brief Pack the statistics as: "i" number of opcodes, "cl" (opcode, count) per opcode
+/// with requests, DISKSTAT_BUCKETS "l" latency, DISKSTAT_BUCKETS "l" seek, "ll" bytes read, written.
+int diskstat_pack(const diskstat_t *stat, bytepack_t *bp);
+
+/// @brief Unpack statistics packed by diskstat_pack.
+int diskstat_unpack(diskstat_t *stat, bytepack_t *bp);
+
+/// @brief Print the statistics in a human readable form.
+void diskstat_print(const diskstat_t *stat, const char *title);
+
+#endif // !DISKSTAT_H
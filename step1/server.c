@@ -7,6 +7,8 @@
 #include <stdint.h>
 #include <signal.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "network/network.h"
 #include "disksim.h"
@@ -15,90 +17,284 @@ int num_cylinders;      // Number of cylinders
 int num_sectors;        // Number of sectors per cylinder
 int sector_move_time;   // Time to move between adjacent sectors
 int port;               // Port number
-int diskfile_fd;        // File descriptor of the disk file
 int server_fd;          // File descriptor of the server socket
 disk_t disk;            // Disk structure
 
-// The function to handle client requests
-void* handler(void*);
-// The function to handle SIGINT
-void SIGINThandler(int);
+#define TAGGED_WORKERS 16  // Number of tagged requests served at once
+
+// A connected client. It is freed by whoever drops the last reference: the connection,
+// the ring thread or a tagged request, so disconnecting never waits for them.
+typedef struct client_t {
+    disk_client_t disk_client;
+    disk_ring_t *ring;      // Shared-memory ring attached by the client, if any
+    int fd;                 // Socket, for responses to tagged requests, -1 once disconnected
+    sem_t send_mutex;       // Serialize responses to tagged requests, and protect fd
+    int refs;               // The connection, the ring and each tagged request in flight
+} client_t;
+
+// A tagged request waiting for a worker, in one buffer of the pool with the request data
+typedef struct tagged_request_t {
+    client_t *client;
+    long tag;                   // Sent back before the response
+    bytepack_t request;         // Attached to the data following the struct
+    size_t capacity;            // Of the buffer
+    struct tagged_request_t *next;
+} tagged_request_t;
+
+tagged_request_t *tagged_head = NULL;   // Queue of tagged requests
+tagged_request_t *tagged_tail = NULL;
+sem_t tagged_mutex;                     // Protect the queue
+sem_t tagged_items;                     // Number of requests in the queue
+
+void* tagged_worker(void*);
+void client_release(void*);
+
+// The callbacks to serve clients
+void* on_connect(const client_handler_args_t*);
+server_action_t on_request(void*, bytepack_t*, bytepack_t*);
+void on_disconnect(void*);
+// The thread waiting for SIGINT to clean up
+void* SIGINTwaiter(void*);
 
 int main(int argc, char *argv[]) {
     // Parse the command line arguments
-    if (argc != 6) {
-        fprintf(stderr, "Usage: %s <diskfilename> <num_cylinders> <num_sectors> <sector_move_time> <port>\n", argv[0]);
+    int opt, policy = DISK_SCHED_FIFO, virtual_clock = 0, sector_size = DEFAULT_SECTOR_SIZE, num_workers = 0;
+    const char *trace_file = NULL;
+    while ((opt = getopt(argc, argv, "p:vt:s:e:")) != -1) {
+        if (opt == 'p') {
+            policy = disk_parse_policy(optarg);
+        } else if (opt == 'v') {
+            virtual_clock = 1;
+        } else if (opt == 't') {
+            trace_file = optarg;
+        } else if (opt == 's') {
+            sector_size = atoi(optarg);
+        } else if (opt == 'e') {
+            num_workers = atoi(optarg);
+        } else {
+            policy = -1;
+        }
+        if (policy < 0) break;
+    }
+    if (argc - optind != 5 || policy < 0) {
+        fprintf(stderr, "Usage: %s [-p fifo|sstf|scan|clook] [-v] [-t tracefile] [-s sector_size] [-e workers] "
+            "<diskfilename> <num_cylinders> <num_sectors> <sector_move_time> <port>\n", argv[0]);
+        fprintf(stderr, "  -v: simulate seek time on a virtual clock instead of sleeping\n");
+        fprintf(stderr, "  -t: write the completion time of every request to tracefile\n");
+        fprintf(stderr, "  -s: size of a sector in bytes, a power of 2 in [%d, %d], default %d\n",
+            MIN_SECTOR_SIZE, MAX_SECTOR_SIZE, DEFAULT_SECTOR_SIZE);
+        fprintf(stderr, "  -e: serve all clients with an epoll loop and workers threads, "
+            "instead of a thread per client\n");
         exit(EXIT_FAILURE);
     }
+    argv += optind - 1;
     num_cylinders = atoi(argv[2]);
     num_sectors = atoi(argv[3]);
     sector_move_time = atoi(argv[4]);
     port = atoi(argv[5]);
     // check arguments
-    if (num_cylinders <= 0 || num_sectors <= 0 || sector_move_time <= 0 || port <= 64 || port >= 65536) {
+    if (num_cylinders <= 0 || num_sectors <= 0 || sector_move_time <= 0 || port <= 64 || port >= 65536 || num_workers < 0 ||
+        sector_size < MIN_SECTOR_SIZE || sector_size > MAX_SECTOR_SIZE || (sector_size & (sector_size - 1)) != 0) {
         fprintf(stderr, "Error: Invalid arguments\n");
         exit(EXIT_FAILURE);
     }
-    if (disk_init(&disk, argv[1], num_cylinders, num_sectors, sector_move_time) < 0) {
+    if (disk_init(&disk, argv[1], num_cylinders, num_sectors, sector_size, sector_move_time) < 0) {
         fprintf(stderr, "Error: disk_init failed\n");
         exit(EXIT_FAILURE);
     }
+    disk.policy = policy;
+    disk.virtual_clock = virtual_clock;
+    if (trace_file != NULL && (disk.trace = fopen(trace_file, "w")) == NULL) {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
     server_fd = initialize_server_socket(port);
     if (server_fd < 0) {
         fprintf(stderr, "Error: initialize_server_socket failed\n");
         exit(EXIT_FAILURE);
     }
-    printf("Server started on port %d\n", port);
-    signal(SIGINT, SIGINThandler); // Register the signal handler
-    run_server(server_fd, handler);
+    printf("Server started on port %d with %s scheduling%s\n", port, disk_policy_name(disk.policy),
+        disk.virtual_clock ? " on virtual clock" : "");
+    // SIGINT is taken by its own thread, never one that may hold the disk, see disk_free
+    sigset_t sigint;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint, NULL);
+    pthread_t sigint_thread;
+    pthread_create(&sigint_thread, NULL, SIGINTwaiter, NULL);
+    pthread_detach(sigint_thread);
+    signal(SIGPIPE, SIG_IGN); // A client may close before its tagged responses are sent
+    sem_init(&tagged_mutex, 0, 1);
+    sem_init(&tagged_items, 0, 0);
+    for (int i = 0; i < TAGGED_WORKERS; ++i) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, tagged_worker, NULL);
+        pthread_detach(thread);
+    }
+    static const server_callbacks_t callbacks = { on_connect, on_request, on_disconnect };
+    run_callback_server(server_fd, &callbacks, num_workers);
+}
+
+void* on_connect(const client_handler_args_t* client_handler_args) {
+    // Register the client for statistics
+    char client_name[64];
+    client_t *client = (client_t*) malloc(sizeof(client_t));
+    snprintf(client_name, sizeof(client_name), "%s:%d", client_handler_args->client_ip, client_handler_args->client_port);
+    disk_client_init(&disk, &client->disk_client, client_name);
+    client->ring = NULL;
+    client->fd = client_handler_args->client_fd;
+    sem_init(&client->send_mutex, 0, 1);
+    client->refs = 1;
+    return client;
+}
+
+// Drop a reference to a client, freeing it with the last one
+void client_release(void* context) {
+    client_t *client = (client_t*) context;
+    if (__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    disk_client_free(&disk, &client->disk_client);
+    sem_destroy(&client->send_mutex);
+    free(client);
+}
+
+// Send a response to client, unless it disconnected
+int client_send(void* context, const bytepack_t* response) {
+    client_t *client = (client_t*) context;
+    int ret = -1;
+    sem_wait(&client->send_mutex);
+    if (client->fd >= 0) ret = bytepack_send(client->fd, response);
+    sem_post(&client->send_mutex);
+    return ret;
+}
+
+// Serve a request on the disk and send the response, return whether the client is leaving
+int serve_request(client_t *client, bytepack_t* request, bytepack_t* response) {
+    int ret = disk_serve_request(&disk, &client->disk_client, request, response, client_send, client);
+    if (ret == 'E') return 1;
+    if (ret < 0) {
+        const char *error = bytepack_get_error();
+        if (error == NULL) error = "Unknown error";
+        fprintf(stderr, "%s Error: %s\n", client->disk_client.name, error);
+    }
+    return 0;
 }
 
-void* handler(void* agrs) {
-    // Get the client socket file descriptor
-    client_handler_args_t* client_handler_args = (client_handler_args_t*) agrs;
-    int client_fd = client_handler_args->client_fd;
-    const char* client_ip = client_handler_args->client_ip;
-    int ret = 0;
-    // Serve the request
-    bytepack_t request;
+// 'X' with a tag, followed by any disk request. Tagged requests of a client are
+// served concurrently, so they are scheduled together with other pending requests.
+// Response: "l" the tag, followed by the response to the request, in completion order.
+// A client must not send untagged requests while tagged ones are in flight.
+server_action_t queue_tagged(client_t *client, bytepack_t* request) {
+    char op;
+    long tag;
+    // Without its tag the request cannot be answered, closing fails the pending ones of the client
+    if (bytepack_unpack(request, "cl", &op, &tag) < 0) return SERVER_CLOSE;
+    size_t capacity, size = request->size - request->offset;
+    tagged_request_t *tagged = (tagged_request_t*) bytepack_pool_alloc(sizeof(tagged_request_t) + size, &capacity);
+    tagged->client = client;
+    tagged->tag = tag;
+    tagged->capacity = capacity;
+    tagged->next = NULL;
+    bytepack_attach(&tagged->request, tagged + 1, size);
+    memcpy(tagged->request.data, request->data + request->offset, size);
+    tagged->request.version = request->version;
+    __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED);
+    sem_wait(&tagged_mutex);
+    if (tagged_tail == NULL) {
+        tagged_head = tagged;
+    } else {
+        tagged_tail->next = tagged;
+    }
+    tagged_tail = tagged;
+    sem_post(&tagged_mutex);
+    sem_post(&tagged_items);
+    return SERVER_NO_RESPONSE;
+}
+
+void* tagged_worker(void* args) {
     bytepack_t response;
-    bytepack_init(&request, 256);
     bytepack_init(&response, 256);
-    do {
-        // Read the request
-        bytepack_reset(&request);
+    while (1) {
+        sem_wait(&tagged_items);
+        sem_wait(&tagged_mutex);
+        tagged_request_t *tagged = tagged_head;
+        tagged_head = tagged->next;
+        if (tagged_head == NULL) tagged_tail = NULL;
+        sem_post(&tagged_mutex);
+        client_t *client = tagged->client;
         bytepack_reset(&response);
-        // printf("Client %s recv: ", client_ip);
-        bytepack_recv(client_fd, &request);
-        // bytepack_dbg_print(&request);
-        if (request.size == 0) break;
-        // Serve the request
-        ret = disk_serve_request(&disk, &request, &response);
-        if (ret == 'E') break;
-        if (ret < 0) {
-            const char *error = bytepack_get_error();
-            if (error == NULL) error = "Unknown error";
-            fprintf(stderr, "%s Error: %s\n", client_ip, error);
-        }
-        // printf("Client %s send: ", client_ip);
-        // bytepack_dbg_print(&response);
-        // Send the response
-        bytepack_send(client_fd, &response);
-    } while (1);
-    printf("Client %s disconnected\n", client_ip);
-    free(client_handler_args);
-    close(client_fd);
-    bytepack_free(&request);
-    bytepack_free(&response);
+        response.version = tagged->request.version;
+        bytepack_pack(&response, "l", tagged->tag);
+        serve_request(client, &tagged->request, &response);
+        bytepack_pool_free(tagged, tagged->capacity);
+        client_release(client);
+    }
     return NULL;
 }
 
-void SIGINThandler(int signum) {
+// 'L' with the name of a shared-memory ring, see diskring.h.
+// Response: "i" 1 once the ring is served, or "is" 0 and the error.
+server_action_t attach_ring(client_t *client, bytepack_t* request, bytepack_t* response) {
+    char op, name[256];
+    const char *error = "Error: Ring already attached";
+    if (request->size > sizeof(name) || bytepack_unpack(request, "cs", &op, name) < 0) {
+        bytepack_pack(response, "is", 0, "Error: Bad ring name");
+        return SERVER_RESPOND;
+    }
+    if (client->ring == NULL) {
+        __atomic_add_fetch(&client->refs, 1, __ATOMIC_RELAXED); // Dropped by the ring thread
+        client->ring = disk_ring_attach(&disk, &client->disk_client, name, client_release, client, &error);
+        if (client->ring == NULL) client_release(client);
+    }
+    if (client->ring == NULL) {
+        bytepack_pack(response, "is", 0, error);
+    } else {
+        printf("Client %s attached shared-memory ring %s\n", client->disk_client.name, name);
+        bytepack_pack(response, "i", 1);
+    }
+    return SERVER_RESPOND;
+}
+
+server_action_t on_request(void* context, bytepack_t* request, bytepack_t* response) {
+    client_t *client = (client_t*) context;
+    if (request->size > 0 && request->data[0] == 'L') {
+        return attach_ring(client, request, response);
+    }
+    if (request->size > 0 && request->data[0] == 'X') {
+        return queue_tagged(client, request);
+    }
+    // Serve the request, the response is sent while it holds the disk
+    if (serve_request(client, request, response)) return SERVER_CLOSE;
+    return SERVER_NO_RESPONSE;
+}
+
+void on_disconnect(void* context) {
+    client_t *client = (client_t*) context;
+    printf("Client %s disconnected\n", client->disk_client.name);
+    // The socket is closed next, tagged requests still being served drop their responses
+    sem_wait(&client->send_mutex);
+    client->fd = -1;
+    sem_post(&client->send_mutex);
+    if (client->ring != NULL) disk_ring_detach(client->ring);
+    client_release(client);
+}
+
+void* SIGINTwaiter(void* args) {
+    sigset_t sigint;
+    int signum;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    while (sigwait(&sigint, &signum) != 0);
     printf("\n*** CTRL-C pressed, doing cleanup...\n");
-    // Print statistics
-    printf("Total time taken to serve requests: %d\n", disk.total_time);
     disk_free(&disk);
+    // Print statistics, no request is being served now
+    sem_wait(&disk.stat_mutex);
+    printf("Total time taken to serve requests: %ld\n", disk.total_time);
+    printf("Simulated time: %ld us, requests served: %ld", disk.clock, disk.num_requests);
+    if (disk.clock > 0) {
+        printf(", throughput: %.2f requests/s", disk.num_requests * 1e6 / disk.clock);
+    }
+    printf("\n");
+    sem_post(&disk.stat_mutex);
     close(server_fd);
-    close(diskfile_fd);
     exit(EXIT_SUCCESS);
 }
\ No newline at end of file
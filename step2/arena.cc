@@ -0,0 +1,33 @@
+#include "arena.h"
+
+#include <iostream>
+#include <sys/mman.h>
+
+Arena::Arena(size_t slot_size, size_t count, bool huge_pages):
+    base_(nullptr), stride_((slot_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE),
+    count_(0), size_(0), huge_(false) {
+    size_t size = stride_ * count;
+    if (size == 0) return;
+    void* base = MAP_FAILED;
+    if (huge_pages && size >= HUGE_PAGE_SIZE) {
+        size_ = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge_ = base != MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        size_ = size;
+        base = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            std::cerr << "Arena: Failed to map " << size << " bytes" << std::endl;
+            size_ = 0;
+            return;
+        }
+        if (huge_pages && size >= HUGE_PAGE_SIZE) madvise(base, size_, MADV_HUGEPAGE);
+    }
+    base_ = static_cast<char*>(base);
+    count_ = count;
+}
+
+Arena::~Arena() {
+    if (base_ != nullptr) munmap(base_, size_);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// A fixed number of equally sized slots in one contiguous mapping, each aligned to
+// a cache line. Mappings of at least a huge page use huge pages when the system has
+// them reserved, and ask for transparent huge pages otherwise.
+class Arena {
+public:
+    Arena(size_t slot_size, size_t count, bool huge_pages = true);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // 0 if the mapping failed
+    size_t count() const { return count_; }
+    char* slot(size_t index) const { return base_ + index * stride_; }
+    bool contains(const void* p) const {
+        return p >= base_ && p < base_ + count_ * stride_;
+    }
+    bool huge_pages() const { return huge_; }
+
+private:
+    char* base_;
+    size_t stride_;
+    size_t count_;
+    size_t size_;   // Mapped bytes
+    bool huge_;
+};
+
+#endif // !ARENA_H
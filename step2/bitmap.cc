@@ -0,0 +1,103 @@
+#include "bitmap.h"
+
+#include <algorithm>
+
+constexpr uint64_t ALL = ~uint64_t(0);
+
+// Bits below b set
+static inline uint64_t below(size_t b) {
+    return (uint64_t(1) << b) - 1;
+}
+
+void Bitmap::resize(size_t bits) {
+    bits_ = bits;
+    words_.assign((bits + 63) / 64, 0);
+    full_.assign((words_.size() + 63) / 64, 0);
+    refresh();
+}
+
+// Bits past the end read as used, so searches never return them
+void Bitmap::refresh() {
+    if (bits_ % 64) words_.back() |= ~below(bits_ % 64);
+    for (size_t w = 0; w < words_.size(); ++w) {
+        update_summary_(w);
+    }
+    if (words_.size() % 64) full_.back() |= ~below(words_.size() % 64);
+}
+
+void Bitmap::set(size_t i) {
+    words_[i / 64] |= uint64_t(1) << (i % 64);
+    update_summary_(i / 64);
+}
+
+void Bitmap::clear(size_t i) {
+    words_[i / 64] &= ~(uint64_t(1) << (i % 64));
+    update_summary_(i / 64);
+}
+
+size_t Bitmap::find_free(size_t from) const {
+    if (from >= bits_) return bits_;
+    size_t w = from / 64;
+    uint64_t word = words_[w] | below(from % 64);
+    while (word == ALL) {
+        w = next_open_word_(w + 1);
+        if (w >= words_.size()) return bits_;
+        word = words_[w];
+    }
+    size_t i = w * 64 + __builtin_ctzll(~word);
+    return i < bits_ ? i : bits_;
+}
+
+size_t Bitmap::find_run(size_t from, size_t count) const {
+    size_t i = find_free(from);
+    while (i < bits_ && i + count <= bits_) {
+        size_t used = find_set_(i, i + count);
+        if (used == i + count) return i;
+        i = find_free(used);
+    }
+    return bits_;
+}
+
+size_t Bitmap::count(size_t from, size_t to) const {
+    to = std::min(to, bits_);
+    size_t n = 0;
+    for (size_t i = from; i < to;) {
+        uint64_t word = words_[i / 64] & ~below(i % 64);
+        size_t next = std::min(to, (i / 64 + 1) * 64);
+        if (next % 64) word &= below(next % 64);
+        n += __builtin_popcountll(word);
+        i = next;
+    }
+    return n;
+}
+
+// First set bit in [from, to), to if there is none
+size_t Bitmap::find_set_(size_t from, size_t to) const {
+    size_t w = from / 64;
+    uint64_t word = words_[w] & ~below(from % 64);
+    while (word == 0) {
+        if (++w * 64 >= to) return to;
+        word = words_[w];
+    }
+    size_t i = w * 64 + __builtin_ctzll(word);
+    return i < to ? i : to;
+}
+
+// First word at or after word that is not full, words_.size() if there is none
+size_t Bitmap::next_open_word_(size_t word) const {
+    while (word < words_.size()) {
+        size_t s = word / 64;
+        uint64_t full = full_[s] | below(word % 64);
+        if (full != ALL) return s * 64 + __builtin_ctzll(~full);
+        word = (s + 1) * 64;
+    }
+    return words_.size();
+}
+
+void Bitmap::update_summary_(size_t word) {
+    if (words_[word] == ALL) {
+        full_[word / 64] |= uint64_t(1) << (word % 64);
+    } else {
+        full_[word / 64] &= ~(uint64_t(1) << (word % 64));
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// One bit per block, set when the block is used. A summary with a bit per word,
+// set when the word is full, lets searches skip 4096 used blocks at a time.
+class Bitmap {
+public:
+    void resize(size_t bits);
+    size_t size() const { return bits_; }
+
+    bool test(size_t i) const { return words_[i / 64] >> (i % 64) & 1; }
+    void set(size_t i);
+    void clear(size_t i);
+
+    // First clear bit at or after from, size() if there is none
+    size_t find_free(size_t from) const;
+    // Start of the first run of count clear bits at or after from, size() if there is none
+    size_t find_run(size_t from, size_t count) const;
+
+    // Set bits in [from, to)
+    size_t count(size_t from, size_t to) const;
+
+    // The words as bytes, for storing them. refresh() after changing them.
+    char* bytes() { return reinterpret_cast<char*>(words_.data()); }
+    size_t byte_size() const { return words_.size() * sizeof(uint64_t); }
+    void refresh();
+
+private:
+    size_t find_set_(size_t from, size_t to) const;
+    size_t next_open_word_(size_t word) const;
+    void update_summary_(size_t word);
+
+    std::vector<uint64_t> words_;
+    std::vector<uint64_t> full_;
+    size_t bits_ = 0;
+};
+
+#endif // !BITMAP_H
@@ -2,216 +2,991 @@
 
 #include <iostream>
 #include <cstring>
-
-#define LOCK() LockGuard lock_guard(&lock_)
+#include <algorithm>
+#include <ctime>
 
 #define CYLINDER(x) (uint32_t)(x >> 32)
 #define SECTION(x) (uint32_t)(x & 0xFFFFFFFF)
 
-BlockManager::BlockManager(RemoteDisk* disk, bool create): disk_(disk) {
+// Frames of a shard. 2Q keeps a quarter of them in the FIFO and ghosts for half of them.
+constexpr size_t SHARD_SIZE = MAX_DATA_POOL_SIZE / CACHE_SHARDS;
+constexpr size_t A1IN_SIZE = SHARD_SIZE / 4;
+constexpr size_t A1OUT_SIZE = SHARD_SIZE / 2;
+
+int BlockManager::ReadAhead::wait() {
+    sem_wait(&lock);
+    if (!done) {
+        result = read.get();
+        done = true;
+    }
+    sem_post(&lock);
+    return result;
+}
+
+bool BlockManager::ReadAhead::ready() {
+    if (sem_trywait(&lock) < 0) return false;
+    if (!done && read.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        result = read.get();
+        done = true;
+    }
+    bool ret = done;
+    sem_post(&lock);
+    return ret;
+}
+
+BlockManager::BlockManager(Disk* disk, bool create, CachePolicy policy, AllocPolicy alloc_policy):
+    disk_(disk), mounted_(false), block_size_(disk->section_size()), policy_(policy), alloc_policy_(alloc_policy),
+    arena_(block_size_, MAX_DATA_POOL_SIZE), frames_(new Data[arena_.count()]()), reading_ahead_(0),
+    block_end_(0), dirty_count_(0), writeback_stop_(false) {
+    for (size_t i = 0; i < CACHE_SHARDS; ++i) {
+        Shard& shard = shards_[i];
+        sem_init(&shard.lock, 0, 1);
+        shard.hand = shard.clock.end();
+        for (size_t j = (i + 1) * arena_.count() / CACHE_SHARDS; j-- > i * arena_.count() / CACHE_SHARDS;) {
+            frames_[j].data = arena_.slot(j);
+            shard.free_data.push_back(&frames_[j]);
+        }
+    }
+    if (arena_.huge_pages()) {
+        std::cout << "BlockManager: Block cache is on huge pages" << std::endl;
+    }
+    sem_init(&read_ahead_lock_, 0, 1);
+    sem_init(&alloc_lock_, 0, 1);
+    sem_init(&bitmap_flush_lock_, 0, 1);
+    sem_init(&writeback_lock_, 0, 1);
+    sem_init(&writeback_wake_, 0, 0);
     // Load super block
-    auto iter = load_block_(0);
+    auto iter = load_block_(shard_(0), 0);
     superblock_ = reinterpret_cast<SuperBlock*>(iter->second->data);
     iter->second->refcnt = 1;
-    iter->second->dirty = true;
-    if (superblock_->magic != SuperBlock::MAGIC || create) {
+    mark_dirty_(iter->second);
+    // Never format unless asked to, a disk opened with the wrong arguments is refused
+    if (!create && superblock_->magic != SuperBlock::MAGIC) {
+        std::cerr << "BlockManager: No file system on the disk" << std::endl;
+        return;
+    }
+    if (!create && superblock_->block_size != block_size_) {
+        std::cerr << "BlockManager: File system block size " << superblock_->block_size
+            << " does not match disk section size " << block_size_
+            << ", open the disk with sector size " << superblock_->block_size << std::endl;
+        return;
+    }
+    if (!create && !init_bitmap_(false)) {
+        std::cerr << "BlockManager: Cannot load the free space bitmap, the disk is left as it is" << std::endl;
+        return;
+    }
+    if (create) {
         std::cout << "BlockManager: Creating file system on remote disk..." << std::endl;
         superblock_->magic = SuperBlock::MAGIC;
-        superblock_->block_size = BLOCK_SIZE;
+        superblock_->block_size = block_size_;
         superblock_->free_list_head = 0;
         superblock_->root_inode = 0;
         superblock_->block_end = 0;
         superblock_->version = time(nullptr);
+        superblock_->group_count = 0;
+        init_bitmap_(true);
     }
+    init_groups_();
+    block_end_ = superblock_->block_end;
     // print super block info
     std::cout << "BlockManager: Block size: " << superblock_->block_size
         << ", Free list head: " << superblock_->free_list_head
         << ", Root inode: " << superblock_->root_inode
         << ", Block end: " << superblock_->block_end
         << ", Version: " << superblock_->version << std::endl;
-    sem_init(&lock_, 0, 1);
+    mounted_ = true;
+    writeback_thread_ = std::thread(&BlockManager::writeback_loop_, this);
 }
 
 BlockManager::~BlockManager() {
-    LOCK();
-    size_t block_num = blocks_.size(), cur_block = 0;
-    for (auto it = blocks_.begin(); it != blocks_.end(); ++it) {
-        std::cout << "BlockManager: Flushing blocks (" << ++cur_block 
-            << "/" << block_num << ")\r" << std::flush;
-        if (it->second->dirty) {
-            disk_->write_disk_section(
-                CYLINDER(it->first), SECTION(it->first), 
-                BLOCK_SIZE, it->second->data
-            );
+    if (mounted_) {
+        writeback_stop_ = true;
+        sem_post(&writeback_wake_);
+        writeback_thread_.join();
+    }
+    collect_read_ahead_(true);
+    if (mounted_) {
+        LockGuard writeback_guard(&writeback_lock_); // A flush in progress has marked its blocks clean
+        Writeback writeback;
+        for (auto& shard : shards_) {
+            for (auto it = shard.blocks.begin(); it != shard.blocks.end(); ++it) {
+                if (it->second->dirty) {
+                    it->second->refcnt = 0;
+                    start_writeback_(it, writeback);
+                }
+            }
         }
-        delete it->second;
+        finish_writeback_(writeback);
+        flush_bitmap_();
     }
-    std::cout << std::endl;
-    while (!free_data_.empty()) {
-        delete free_data_.front();
-        free_data_.pop();
+    for (auto& shard : shards_) {
+        for (auto it = shard.blocks.begin(); it != shard.blocks.end(); ++it) {
+            delete_data_(it->second);
+        }
+        sem_destroy(&shard.lock);
     }
-    sem_destroy(&lock_);
+    sem_destroy(&read_ahead_lock_);
+    sem_destroy(&alloc_lock_);
+    sem_destroy(&bitmap_flush_lock_);
+    sem_destroy(&writeback_lock_);
+    sem_destroy(&writeback_wake_);
 }
 
 void BlockManager::dirtify(blockid_t block) {
     if (block == 0) return;
     if (check_block_range_(block) < 0) return;
-    LOCK();
-    auto it = blocks_.find(block);
-    if (it != blocks_.end()) {
-        it->second->dirty = true;
+    Shard& shard = shard_(block);
+    LockGuard lock_guard(&shard.lock);
+    auto it = shard.blocks.find(block);
+    if (it != shard.blocks.end()) {
+        mark_dirty_(it->second);
     }
 }
 
-BlockManager::map_iter_t BlockManager::allocate_() {
-    map_iter_t iter;
-    if (free_list_head_() == 0) { // Allocate new block
-        if (!incr_next_block()) {
-            std::cerr << "BlockManager: Disk is full" << std::endl;
-            return blocks_.end();
-        }
-        iter = load_block_(next_block_(), false);
-    } else { // Reuse free block
-        iter = load_block_(free_list_head_(), true);
-        auto free_block = reinterpret_cast<FreeBlock*>(iter->second->data);
-        if (free_block->magic == FreeBlock::MAGIC && free_block->version == version()) {
-            free_list_head_() = free_block->next;
+// Called with alloc_lock_ held
+BlockManager::Data* BlockManager::allocate_(blockid_t& block, blockid_t near) {
+    if (alloc_policy_ == AllocPolicy::BUMP) near = 0;
+    Data* data = allocate_from_(near != 0 && near <= block_end_ ? index_(near) : alloc_cursor_, block);
+    if (data != nullptr && near == 0) alloc_cursor_ = index_(block) + 1;
+    return data;
+}
+
+// The first free block at or after index from, wrapping around. Called with alloc_lock_ held.
+BlockManager::Data* BlockManager::allocate_from_(size_t from, blockid_t& block) {
+    size_t index = bitmap_.find_free(from);
+    if (index == bitmap_.size()) index = bitmap_.find_free(1);
+    if (index == bitmap_.size() && release_all_prealloc_()) index = bitmap_.find_free(1);
+    if (index == bitmap_.size()) {
+        std::cerr << "BlockManager: Disk is full" << std::endl;
+        return nullptr;
+    }
+    mark_bitmap_(index, true);
+    block = block_id_(index);
+    return claim_(block);
+}
+
+// Called with alloc_lock_ held
+BlockManager::Data* BlockManager::allocate_inode_(blockid_t parent, bool dir, blockid_t& block) {
+    if (alloc_policy_ == AllocPolicy::BUMP) {
+        Data* data = allocate_(block);
+        if (data != nullptr && dir) superblock_->groups[group_(index_(block))].dirs++;
+        return data;
+    }
+    size_t from = 1; // The root goes first
+    if (parent != 0 && dir) {
+        from = group_start_(dir_group_());
+    } else if (parent != 0 && parent <= block_end_) {
+        from = index_(parent);
+    }
+    int head = disk_->head_cylinder();
+    if (alloc_policy_ == AllocPolicy::NEAR_HEAD && !dir && head >= 0) {
+        from = size_t(head) * disk_->section_num(); // So are its metadata writes
+    }
+    Data* data = allocate_from_(from, block);
+    if (data != nullptr && dir) superblock_->groups[group_(index_(block))].dirs++;
+    return data;
+}
+
+// Called with alloc_lock_ held
+BlockManager::Data* BlockManager::allocate_for_(blockid_t owner, blockid_t after, blockid_t& block) {
+    if (alloc_policy_ == AllocPolicy::BUMP) return allocate_(block);
+    int head = disk_->head_cylinder();
+    if (alloc_policy_ == AllocPolicy::NEAR_HEAD && head >= 0) {
+        return allocate_from_(size_t(head) * disk_->section_num(), block);
+    }
+    auto it = prealloc_.find(owner);
+    if (it == prealloc_.end()) {
+        if (prealloc_.size() >= MAX_PREALLOC_OWNERS) release_prealloc_(prealloc_lru_.back());
+        prealloc_lru_.push_front(owner);
+        it = prealloc_.emplace(owner, Prealloc{ {}, 0, 0, prealloc_lru_.begin() }).first;
+    } else {
+        prealloc_lru_.splice(prealloc_lru_.begin(), prealloc_lru_, it->second.lru);
+    }
+    Prealloc& prealloc = it->second;
+    if (prealloc.next == prealloc.blocks.size()) {
+        prealloc.blocks.clear();
+        prealloc.next = 0;
+        prealloc.window = prealloc.window == 0 ? 1 : std::min(prealloc.window * 2, MAX_PREALLOC);
+        if (reserve_(after, prealloc.window, prealloc.blocks) == 0) {
+            // Out of space, take whatever the others have reserved
+            release_all_prealloc_();
+            return allocate_(block);
         }
-        else free_list_head_() = 0;
     }
-    memset(iter->second->data, 0, BLOCK_SIZE);
-    iter->second->dirty = true;
+    block = prealloc.blocks[prealloc.next++];
+    size_t index = index_(block);
+    reserved_.clear(index);
+    mark_bitmap_(index, true);
+    return claim_(block);
+}
+
+// Cache a newly allocated block as a zeroed dirty frame without reading it
+BlockManager::Data* BlockManager::claim_(blockid_t block) {
+    if (block > superblock_->block_end) {
+        superblock_->block_end = block;
+        block_end_ = block;
+    }
+    Shard& shard = shard_(block);
+    LockGuard lock_guard(&shard.lock);
+    auto iter = load_block_(shard, block, false);
+    memset(iter->second->data, 0, block_size_);
+    mark_dirty_(iter->second);
     iter->second->refcnt = 1;
-    return iter;
+    return iter->second;
+}
+
+// Reserve up to count contiguous free blocks, right after `after` if those are free,
+// else in the first run that fits. Called with alloc_lock_ held.
+size_t BlockManager::reserve_(blockid_t after, size_t count, std::vector<blockid_t>& blocks) {
+    size_t from = after != 0 && after <= block_end_ ? index_(after) + 1 : alloc_cursor_;
+    size_t end = bitmap_.size();
+    size_t start = end;
+    size_t n = 0;
+    if (from < end && !bitmap_.test(from)) {
+        start = from;
+        while (n < count && start + n < end && !bitmap_.test(start + n)) ++n;
+    }
+    for (size_t want = count; start == end && want > 0; want /= 2) {
+        start = bitmap_.find_run(from, want);
+        if (start == end) start = bitmap_.find_run(1, want);
+        if (start != end) n = want;
+    }
+    if (start == end) return 0;
+    for (size_t i = start; i < start + n; ++i) {
+        set_used_(i, true);
+        reserved_.set(i);
+        blocks.push_back(block_id_(i));
+    }
+    if (alloc_cursor_ >= start && alloc_cursor_ < start + n) alloc_cursor_ = start + n;
+    return n;
+}
+
+// Give the blocks reserved for owner back. Called with alloc_lock_ held.
+void BlockManager::release_prealloc_(blockid_t owner) {
+    auto it = prealloc_.find(owner);
+    if (it == prealloc_.end()) return;
+    Prealloc& prealloc = it->second;
+    for (size_t i = prealloc.next; i < prealloc.blocks.size(); ++i) {
+        size_t index = index_(prealloc.blocks[i]);
+        reserved_.clear(index);
+        set_used_(index, false);
+    }
+    prealloc_lru_.erase(prealloc.lru);
+    prealloc_.erase(it);
+}
+
+// Returns whether any owner had blocks reserved. Called with alloc_lock_ held.
+bool BlockManager::release_all_prealloc_() {
+    bool released = false;
+    for (auto& iter : prealloc_) {
+        released |= iter.second.next < iter.second.blocks.size();
+    }
+    while (!prealloc_lru_.empty()) {
+        release_prealloc_(prealloc_lru_.back());
+    }
+    return released;
 }
 
 void BlockManager::unref_block(blockid_t block) {
     if (block == 0) return;
     if (check_block_range_(block) < 0) return;
-    LOCK();
-    auto it = blocks_.find(block);
-    if (it != blocks_.end()) {
-        --it->second->refcnt;
-        if (it->second->refcnt <= 0 && blocks_.size() > MAX_DATA_POOL_SIZE) {
-            flush_block_(it);
-            release_block_(it);
-        }
+    Shard& shard = shard_(block);
+    LockGuard lock_guard(&shard.lock);
+    auto it = shard.blocks.find(block);
+    if (it == shard.blocks.end() || it->second->refcnt == 0) return;
+    if (--it->second->refcnt > 0) return;
+    enqueue_(shard, it);
+    while (shard.blocks.size() > SHARD_SIZE) {
+        auto victim = victim_(shard);
+        if (victim == shard.blocks.end()) break;
+        release_block_(shard, victim);
     }
 }
 
 void BlockManager::free_block(blockid_t block) {
     if (block == 0) return;
     if (check_block_range_(block) < 0) return;
-    LOCK();
-    auto iter = load_block_(block);
-    auto data = iter->second;
-    data->dirty = true;
-    data->refcnt = 0;
-    auto free_block = reinterpret_cast<FreeBlock*>(data->data);
-    if (free_block->magic == FreeBlock::MAGIC && free_block->version == version()) {
+    LockGuard alloc_guard(&alloc_lock_);
+    size_t index = index_(block);
+    if ((index >= bitmap_start_ && index < bitmap_start_ + bitmap_dirty_.size()) ||
+        !bitmap_.test(index) || reserved_.test(index)) {
         std::cerr << "BlockManager: Block " << block << " is already free" << std::endl;
         return;
     }
-    free_block->magic = FreeBlock::MAGIC;
-    // std::cout << "current free list head: " << free_list_head_() << std::endl;
-    free_block->next = free_list_head_();
-    // std::cout << "current free block next: " << free_block->next << std::endl;
-    free_block->version = version();
-    free_block->id = block;
-    free_list_head_() = block;
+    mark_bitmap_(index, false);
+    release_prealloc_(block); // When it was an inode
+    // Its contents are garbage now, drop them unless someone still holds the block
+    Shard& shard = shard_(block);
+    LockGuard lock_guard(&shard.lock);
+    auto it = shard.blocks.find(block);
+    if (it == shard.blocks.end() || it->second->loading) return;
+    mark_clean_(it->second);
+    if (it->second->refcnt == 0 && !it->second->writing) {
+        Data* data = it->second;
+        dequeue_(shard, it);
+        shard.blocks.erase(it);
+        release_data_(shard, data);
+    } else {
+        it->second->refcnt = 0;
+        enqueue_(shard, it);
+    }
+}
+
+void BlockManager::free_inode(blockid_t block, bool dir) {
+    if (block == 0) return;
+    if (check_block_range_(block) < 0) return;
+    if (dir) {
+        LockGuard lock_guard(&alloc_lock_);
+        auto& group = superblock_->groups[group_(index_(block))];
+        if (group.dirs > 0) group.dirs--;
+    }
+    free_block(block);
+}
+
+void BlockManager::prefetch(const blockid_t* blocks, size_t count) {
+    for (auto& batch : read_blocks_(blocks, count, count)) {
+        complete_read_ahead_(batch.get());
+    }
+}
+
+void BlockManager::read_ahead(const blockid_t* blocks, size_t count) {
+    collect_read_ahead_(false);
+    size_t limit;
+    {
+        LockGuard lock_guard(&read_ahead_lock_);
+        limit = MAX_READ_AHEAD_PENDING - std::min(reading_ahead_, MAX_READ_AHEAD_PENDING);
+    }
+    if (limit == 0) return;
+    auto batches = read_blocks_(blocks, count, limit);
+    LockGuard lock_guard(&read_ahead_lock_);
+    for (auto& batch : batches) {
+        reading_ahead_ += batch->ids.size();
+        read_ahead_.push_back(std::move(batch));
+    }
 }
 
 void BlockManager::flush() {
-    LOCK();
-    size_t block_num = blocks_.size(), cur_block = 0;
-    for (auto it = blocks_.begin(); it != blocks_.end(); ++it) {
-        std::cout << "BlockManager: Flushing blocks (" << ++cur_block 
-            << "/" << block_num << ")\r" << std::flush;
-        flush_block_(it);
+    LockGuard writeback_guard(&writeback_lock_);
+    Writeback writeback;
+    for (auto& shard : shards_) {
+        LockGuard lock_guard(&shard.lock);
+        for (auto it = shard.blocks.begin(); it != shard.blocks.end(); ++it) {
+            if (it->second->dirty && it->second->refcnt == 0) {
+                start_writeback_(it, writeback);
+            }
+        }
     }
-    std::cout << std::endl;
+    finish_writeback_(writeback);
+    flush_bitmap_();
 }
 
-bool BlockManager::incr_next_block() {
-    blockid_t block = next_block_();
-    int32_t cylinder = CYLINDER(block);
-    int32_t section = SECTION(block);
-    if (cylinder == disk_->cylinder_num()) {
-        return false;
+size_t BlockManager::index_(blockid_t block) const {
+    return size_t(CYLINDER(block)) * disk_->section_num() + SECTION(block);
+}
+
+blockid_t BlockManager::block_id_(size_t index) const {
+    return (uint64_t(index / disk_->section_num()) << 32) | (index % disk_->section_num());
+}
+
+// Create the bitmap, or load it, converting the free list of a file system without one.
+// The bitmap takes the last blocks of the disk, or the first free run when a converted
+// file system already uses them.
+bool BlockManager::init_bitmap_(bool create) {
+    size_t total = size_t(disk_->cylinder_num()) * disk_->section_num();
+    size_t bits_per_block = size_t(block_size_) * 8;
+    size_t bitmap_blocks = (total + bits_per_block - 1) / bits_per_block;
+    bitmap_start_ = total - bitmap_blocks;
+    alloc_cursor_ = 1;
+    bitmap_.resize(total);
+    reserved_.resize(total);
+    bitmap_dirty_.assign(bitmap_blocks, false);
+    if (!create && superblock_->bitmap != 0) {
+        blockid_t first = superblock_->bitmap;
+        // Bitmaps made before the disk size was recorded are always at the end
+        bool fits = superblock_->disk_blocks == 0 ? first == block_id_(bitmap_start_) :
+            superblock_->disk_blocks == total && CYLINDER(first) < uint32_t(disk_->cylinder_num()) &&
+            SECTION(first) < uint32_t(disk_->section_num()) && index_(first) > 0 &&
+            index_(first) + bitmap_blocks <= total;
+        if (!fits || superblock_->bitmap_blocks != bitmap_blocks) {
+            std::cerr << "BlockManager: Bitmap at block " << superblock_->bitmap
+                << " does not match the disk geometry" << std::endl;
+            return false;
+        }
+        bitmap_start_ = index_(first);
+        std::vector<DiskSection> sections;
+        std::vector<char> data(bitmap_blocks * block_size_);
+        std::vector<char*> buffers;
+        for (size_t i = 0; i < bitmap_blocks; ++i) {
+            blockid_t block = block_id_(bitmap_start_ + i);
+            sections.push_back({ (int)CYLINDER(block), (int)SECTION(block) });
+            buffers.push_back(data.data() + i * block_size_);
+        }
+        for (size_t i = 0; i < bitmap_blocks; i += MAX_BATCH_SECTIONS) {
+            size_t n = std::min(bitmap_blocks - i, (size_t)MAX_BATCH_SECTIONS);
+            if (disk_->read_disk_sections(&sections[i], n, &buffers[i]) < 0) {
+                std::cerr << "BlockManager: Failed to read the bitmap" << std::endl;
+                return false;
+            }
+        }
+        memcpy(bitmap_.bytes(), data.data(), std::min(data.size(), bitmap_.byte_size()));
+        bitmap_.refresh();
+        superblock_->disk_blocks = total;
+        return true;
+    }
+    bitmap_.set(0);
+    if (!create) {
+        convert_free_list_();
+        if (bitmap_.count(bitmap_start_, total) > 0) {
+            bitmap_start_ = bitmap_.find_run(1, bitmap_blocks);
+            if (bitmap_start_ == total) {
+                std::cerr << "BlockManager: No " << bitmap_blocks
+                    << " free blocks in a row for the bitmap, delete some files with a file server from before the bitmap first" << std::endl;
+                return false;
+            }
+            std::cout << "BlockManager: The end of the disk is in use, the bitmap goes to block "
+                << block_id_(bitmap_start_) << std::endl;
+        }
+    }
+    for (size_t i = bitmap_start_; i < bitmap_start_ + bitmap_blocks; ++i) {
+        bitmap_.set(i);
+    }
+    bitmap_dirty_.assign(bitmap_blocks, true);
+    superblock_->bitmap = block_id_(bitmap_start_);
+    superblock_->bitmap_blocks = bitmap_blocks;
+    superblock_->disk_blocks = total;
+    return true;
+}
+
+// Mark the blocks up to block_end used, except the ones on the free list
+void BlockManager::convert_free_list_() {
+    std::cout << "BlockManager: Moving the free list to a bitmap..." << std::endl;
+    // Old file systems may leave block_end just past the last block of a full disk
+    size_t end = std::min(index_(superblock_->block_end), bitmap_.size() - 1);
+    for (size_t i = 1; i <= end; ++i) {
+        bitmap_.set(i);
+    }
+    std::vector<char> data(block_size_);
+    auto free_block = reinterpret_cast<FreeBlock*>(data.data());
+    size_t count = 0;
+    for (blockid_t block = superblock_->free_list_head; block != 0 && count <= end; ++count) {
+        if (index_(block) > end || disk_->read_disk_section(CYLINDER(block), SECTION(block), data.data()) < 0 ||
+            free_block->magic != FreeBlock::MAGIC || free_block->version != version()) {
+            break;
+        }
+        bitmap_.clear(index_(block));
+        block = free_block->next;
     }
-    ++section;
-    if (section == disk_->section_num()) {
-        section = 0;
-        ++cylinder;
+    superblock_->free_list_head = 0;
+}
+
+// Called with alloc_lock_ held
+void BlockManager::set_used_(size_t index, bool used) {
+    if (bitmap_.test(index) == used) return;
+    if (used) {
+        bitmap_.set(index);
+        superblock_->groups[group_(index)].free_blocks--;
+    } else {
+        bitmap_.clear(index);
+        superblock_->groups[group_(index)].free_blocks++;
     }
-    next_block_() = (uint64_t(cylinder) << 32) | section;
-    return cylinder != disk_->cylinder_num();
 }
 
-BlockManager::map_iter_t BlockManager::load_block_(blockid_t block, bool read) {
-    auto it = blocks_.find(block);
-    if (it == blocks_.end()) {
-        Data* data = get_free_data_();
+// Called with alloc_lock_ held
+void BlockManager::mark_bitmap_(size_t index, bool used) {
+    set_used_(index, used);
+    bitmap_dirty_[index / (size_t(block_size_) * 8)] = true;
+}
+
+// Split the disk into groups of cylinders and count their free blocks. Directory counts
+// are kept unless the geometry changed or the file system predates groups.
+void BlockManager::init_groups_() {
+    uint32_t cylinders = disk_->cylinder_num();
+    uint32_t group_cylinders = (cylinders + MAX_CYL_GROUPS - 1) / MAX_CYL_GROUPS;
+    uint32_t group_count = (cylinders + group_cylinders - 1) / group_cylinders;
+    group_blocks_ = size_t(group_cylinders) * disk_->section_num();
+    if (superblock_->group_count != group_count || superblock_->group_cylinders != group_cylinders) {
+        superblock_->group_count = group_count;
+        superblock_->group_cylinders = group_cylinders;
+        memset(superblock_->groups, 0, sizeof(superblock_->groups));
+    }
+    for (size_t g = 0; g < group_count; ++g) {
+        size_t start = group_start_(g);
+        size_t end = std::min(start + group_blocks_, bitmap_.size());
+        superblock_->groups[g].free_blocks = end - start - bitmap_.count(start, end);
+    }
+}
+
+size_t BlockManager::group_(size_t index) const {
+    return std::min(index / group_blocks_, size_t(superblock_->group_count - 1));
+}
+
+size_t BlockManager::group_start_(size_t group) const {
+    return group * group_blocks_;
+}
+
+// The group with the fewest directories among those with at least the average free space
+size_t BlockManager::dir_group_() const {
+    size_t count = superblock_->group_count;
+    uint64_t total = 0;
+    for (size_t g = 0; g < count; ++g) {
+        total += superblock_->groups[g].free_blocks;
+    }
+    size_t best = count;
+    for (size_t g = 0; g < count; ++g) {
+        auto& group = superblock_->groups[g];
+        if (uint64_t(group.free_blocks) * count < total) continue;
+        if (best == count || group.dirs < superblock_->groups[best].dirs ||
+            (group.dirs == superblock_->groups[best].dirs && group.free_blocks > superblock_->groups[best].free_blocks)) {
+            best = g;
+        }
+    }
+    return best == count ? 0 : best;
+}
+
+// Write the bitmap blocks changed since the last flush
+void BlockManager::flush_bitmap_() {
+    // An older snapshot written after a newer one would lose allocations
+    LockGuard flush_guard(&bitmap_flush_lock_);
+    std::vector<size_t> dirty;
+    std::vector<DiskSection> sections;
+    std::vector<char> data;
+    {
+        LockGuard lock_guard(&alloc_lock_);
+        for (size_t i = 0; i < bitmap_dirty_.size(); ++i) {
+            if (bitmap_dirty_[i]) dirty.push_back(i);
+        }
+        data.assign(dirty.size() * block_size_, 0);
+        for (size_t i = 0; i < dirty.size(); ++i) {
+            size_t offset = dirty[i] * block_size_;
+            size_t size = std::min((size_t)block_size_, bitmap_.byte_size() - offset);
+            memcpy(data.data() + i * block_size_, bitmap_.bytes() + offset, size);
+            // Reserved blocks stay free on disk
+            auto words = reinterpret_cast<uint64_t*>(data.data() + i * block_size_);
+            auto reserved = reinterpret_cast<const uint64_t*>(reserved_.bytes() + offset);
+            for (size_t w = 0; w < size / sizeof(uint64_t); ++w) {
+                words[w] &= ~reserved[w];
+            }
+            bitmap_dirty_[dirty[i]] = false;
+            blockid_t block = block_id_(bitmap_start_ + dirty[i]);
+            sections.push_back({ (int)CYLINDER(block), (int)SECTION(block) });
+        }
+    }
+    std::vector<const char*> buffers;
+    for (size_t i = 0; i < dirty.size(); ++i) {
+        buffers.push_back(data.data() + i * block_size_);
+    }
+    for (size_t i = 0; i < dirty.size(); i += MAX_BATCH_SECTIONS) {
+        size_t n = std::min(dirty.size() - i, (size_t)MAX_BATCH_SECTIONS);
+        if (disk_->write_disk_sections(&sections[i], n, &buffers[i]) < 0) {
+            std::cerr << "BlockManager: Failed to write " << n << " bitmap blocks" << std::endl;
+            LockGuard lock_guard(&alloc_lock_);
+            for (size_t j = i; j < i + n; ++j) {
+                bitmap_dirty_[dirty[j]] = true;
+            }
+        }
+    }
+}
+
+BlockManager::Shard& BlockManager::shard_(blockid_t block) {
+    return shards_[(CYLINDER(block) * 31 + SECTION(block)) % CACHE_SHARDS];
+}
+
+// Called with the shard locked, which is released while waiting for a read ahead of the block
+BlockManager::map_iter_t BlockManager::load_block_(Shard& shard, blockid_t block, bool read) {
+    auto it = shard.blocks.find(block);
+    while (it != shard.blocks.end() && it->second->loading) {
+        auto batch = it->second->loading;
+        sem_post(&shard.lock);
+        batch->wait();
+        sem_wait(&shard.lock);
+        it = shard.blocks.find(block);
+        if (it != shard.blocks.end() && it->second->loading == batch) {
+            complete_read_ahead_(shard, it);
+            it = shard.blocks.find(block);
+        }
+    }
+    if (it == shard.blocks.end()) {
+        Data* data = get_free_data_(shard);
         if (read) {
             disk_->read_disk_section(CYLINDER(block), SECTION(block), data->data);
         } else {
-            memset(data->data, 0, BLOCK_SIZE);
+            memset(data->data, 0, block_size_);
         }
         data->dirty = false;
         data->refcnt = 0;
-        it = blocks_.insert({block, data}).first;
+        it = shard.blocks.insert({block, data}).first;
+        cache_(shard, it);
     } else {
-        if (it->second->refcnt < 0) it->second->refcnt = 0;
+        touch_(shard, it);
     }
     return it;
 }
 
-void BlockManager::release_block_(map_iter_t block) {
-    if (free_data_.size() < MAX_DATA_POOL_SIZE) {
-        free_data_.push(block->second);
+// Cache up to limit uncached blocks among `blocks` as loading and issue batched reads of them
+std::vector<std::shared_ptr<BlockManager::ReadAhead>> BlockManager::read_blocks_(
+    const blockid_t* blocks, size_t count, size_t limit) {
+    std::vector<std::shared_ptr<ReadAhead>> batches;
+    std::shared_ptr<ReadAhead> batch;
+    size_t taken = 0;
+    for (size_t i = 0; i <= count; ++i) {
+        if (i < count && taken < limit) {
+            if (blocks[i] == 0 || check_block_range_(blocks[i]) < 0) continue;
+            if (!batch) batch = std::make_shared<ReadAhead>();
+            Shard& shard = shard_(blocks[i]);
+            LockGuard lock_guard(&shard.lock);
+            if (shard.blocks.find(blocks[i]) != shard.blocks.end()) continue;
+            Data* data = get_free_data_(shard);
+            data->dirty = false;
+            data->refcnt = 0;
+            data->queued = false;
+            data->loading = batch;
+            shard.blocks.insert({blocks[i], data});
+            batch->ids.push_back(blocks[i]);
+            batch->frames.push_back(data);
+            ++taken;
+            if (batch->ids.size() < (size_t)MAX_BATCH_SECTIONS) continue;
+        }
+        if (batch && !batch->ids.empty()) {
+            std::vector<DiskSection> sections;
+            std::vector<char*> buffers;
+            for (size_t j = 0; j < batch->ids.size(); ++j) {
+                sections.push_back({ (int)CYLINDER(batch->ids[j]), (int)SECTION(batch->ids[j]) });
+                buffers.push_back(batch->frames[j]->data);
+            }
+            batch->read = disk_->read_disk_sections_async(sections.data(), sections.size(), buffers.data());
+            sem_post(&batch->lock); // Loads of the blocks may wait for it now
+            batches.push_back(std::move(batch));
+        }
+        batch.reset();
+        if (i < count && taken == limit) break;
+    }
+    return batches;
+}
+
+// Wait for a batch and make its blocks usable, unless something else already did
+void BlockManager::complete_read_ahead_(ReadAhead* batch) {
+    if (batch->wait() < 0) {
+        std::cerr << "BlockManager: Failed to read ahead " << batch->ids.size() << " blocks" << std::endl;
+    }
+    for (size_t i = 0; i < batch->ids.size(); ++i) {
+        Shard& shard = shard_(batch->ids[i]);
+        LockGuard lock_guard(&shard.lock);
+        auto it = shard.blocks.find(batch->ids[i]);
+        if (it != shard.blocks.end() && it->second->loading.get() == batch) {
+            complete_read_ahead_(shard, it);
+        }
+    }
+}
+
+// Called with the shard locked once the batch reading the block is done
+void BlockManager::complete_read_ahead_(Shard& shard, map_iter_t block) {
+    Data* data = block->second;
+    bool ok = data->loading->result == 0;
+    data->loading.reset();
+    if (ok) {
+        cache_(shard, block);
+    } else {
+        shard.blocks.erase(block);
+        release_data_(shard, data);
+    }
+}
+
+// Complete the read ahead batches that are done, or all of them if wait
+void BlockManager::collect_read_ahead_(bool wait) {
+    std::vector<std::shared_ptr<ReadAhead>> done;
+    {
+        LockGuard lock_guard(&read_ahead_lock_);
+        for (auto it = read_ahead_.begin(); it != read_ahead_.end();) {
+            if (wait || (*it)->ready()) {
+                reading_ahead_ -= (*it)->ids.size();
+                done.push_back(std::move(*it));
+                it = read_ahead_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (auto& batch : done) {
+        complete_read_ahead_(batch.get());
+    }
+}
+
+void BlockManager::release_block_(Shard& shard, map_iter_t block) {
+    release_data_(shard, evict_(shard, block));
+}
+
+// Write back an unpinned block and drop it from the cache, returning its frame
+BlockManager::Data* BlockManager::evict_(Shard& shard, map_iter_t block) {
+    Data* data = block->second;
+    if (data->queue == QUEUE_A1IN) { // Remember it, it goes to am if loaded again soon
+        shard.a1out.push_front(block->first);
+        shard.a1out_index[block->first] = shard.a1out.begin();
+        if (shard.a1out.size() > A1OUT_SIZE) {
+            shard.a1out_index.erase(shard.a1out.back());
+            shard.a1out.pop_back();
+        }
+    }
+    dequeue_(shard, block);
+    flush_block_(block);
+    shard.blocks.erase(block);
+    return data;
+}
+
+// The unpinned block of the shard to evict, shard.blocks.end() if all are pinned
+BlockManager::map_iter_t BlockManager::victim_(Shard& shard) {
+    if (policy_ == CachePolicy::CLOCK) {
+        while (!shard.clock.empty()) {
+            if (shard.hand == shard.clock.end()) shard.hand = shard.clock.begin();
+            auto it = shard.blocks.find(*shard.hand);
+            if (it->second->refcnt > 0 || it->second->writing) {
+                dequeue_(shard, it);
+            } else if (it->second->referenced) {
+                it->second->referenced = false;
+                ++shard.hand;
+            } else {
+                return it;
+            }
+        }
+        return shard.blocks.end();
+    }
+    while (!shard.a1in.empty() || !shard.am.empty()) {
+        bool from_a1in = !shard.a1in.empty() && (shard.a1in.size() > A1IN_SIZE || shard.am.empty());
+        auto& queue = from_a1in ? shard.a1in : shard.am;
+        auto it = shard.blocks.find(queue.back());
+        if (it->second->refcnt == 0 && !it->second->writing) return it;
+        dequeue_(shard, it);
+    }
+    return shard.blocks.end();
+}
+
+// Queue a block that was just cached
+void BlockManager::cache_(Shard& shard, map_iter_t block) {
+    Data* data = block->second;
+    data->queued = false;
+    data->referenced = false;
+    if (policy_ == CachePolicy::CLOCK) {
+        data->queue = QUEUE_CLOCK;
+    } else {
+        auto ghost = shard.a1out_index.find(block->first);
+        if (ghost != shard.a1out_index.end()) {
+            shard.a1out.erase(ghost->second);
+            shard.a1out_index.erase(ghost);
+            data->queue = QUEUE_AM;
+        } else {
+            data->queue = QUEUE_A1IN;
+        }
+    }
+    enqueue_(shard, block);
+}
+
+// A cached block is used again
+void BlockManager::touch_(Shard& shard, map_iter_t block) {
+    Data* data = block->second;
+    if (data->queue == QUEUE_CLOCK) {
+        data->referenced = true;
+    } else if (data->queue == QUEUE_AM && data->queued) {
+        shard.am.splice(shard.am.begin(), shard.am, data->pos);
+    }
+}
+
+void BlockManager::enqueue_(Shard& shard, map_iter_t block) {
+    Data* data = block->second;
+    if (data->queued || data->loading) return;
+    if (data->queue == QUEUE_CLOCK) { // Behind the hand, checked last
+        data->pos = shard.clock.insert(shard.hand, block->first);
     } else {
-        delete block->second;
+        auto& queue = queue_(shard, data->queue);
+        data->pos = queue.insert(queue.begin(), block->first);
+    }
+    data->queued = true;
+}
+
+void BlockManager::dequeue_(Shard& shard, map_iter_t block) {
+    Data* data = block->second;
+    if (!data->queued) return;
+    if (data->queue == QUEUE_CLOCK && shard.hand == data->pos) ++shard.hand;
+    queue_(shard, data->queue).erase(data->pos);
+    data->queued = false;
+}
+
+std::list<blockid_t>& BlockManager::queue_(Shard& shard, Queue queue) {
+    switch (queue) {
+    case QUEUE_A1IN: return shard.a1in;
+    case QUEUE_AM: return shard.am;
+    default: return shard.clock;
     }
-    blocks_.erase(block);
 }
 
 void BlockManager::flush_block_(map_iter_t block) {
     if (block->second->dirty && block->second->refcnt == 0) {
         disk_->write_disk_section(
-            CYLINDER(block->first), SECTION(block->first), 
-            BLOCK_SIZE, block->second->data
+            CYLINDER(block->first), SECTION(block->first),
+            block_size_, block->second->data
         );
-        block->second->dirty = false;
+        mark_clean_(block->second);
     }
 }
 
-BlockManager::Data* BlockManager::get_free_data_() {
-    Data* data;
-    if (!free_data_.empty()) {
-        data = free_data_.front();
-        free_data_.pop();
-        return data;
+// Blocks below the disk head from the top down, then the rest from the bottom up.
+// The pass ends towards the end of the disk, where the bitmap is written next.
+void BlockManager::sort_for_head_(std::vector<std::pair<blockid_t, size_t>>& blocks) {
+    std::sort(blocks.begin(), blocks.end());
+    uint32_t head = std::max(disk_->head_cylinder(), 0);
+    auto up = std::find_if(blocks.begin(), blocks.end(), [head](const std::pair<blockid_t, size_t>& block) {
+        return CYLINDER(block.first) >= head;
+    });
+    std::reverse(blocks.begin(), up);
+}
+
+// Called with the shard of the block locked. Copy the dirty block into writeback and mark it
+// clean, so a change from now on marks it dirty again for the next writeback.
+void BlockManager::start_writeback_(map_iter_t block, Writeback& writeback) {
+    Data* data = block->second;
+    writeback.blocks.push_back({ block->first, writeback.data.size() });
+    writeback.data.insert(writeback.data.end(), data->data, data->data + block_size_);
+    data->writing = true;
+    mark_clean_(data);
+}
+
+// Write the copies of writeback, then let their frames be evicted again. Blocks that
+// failed are dirty again. Returns the blocks written.
+size_t BlockManager::finish_writeback_(Writeback& writeback, bool progress) {
+    auto& blocks = writeback.blocks;
+    sort_for_head_(blocks);
+    std::vector<DiskSection> sections;
+    std::vector<const char*> data;
+    for (auto& block : blocks) {
+        sections.push_back({ (int)CYLINDER(block.first), (int)SECTION(block.first) });
+        data.push_back(&writeback.data[block.second]);
     }
-    if (blocks_.size() < MAX_DATA_POOL_SIZE) {
-        return new Data;
+    // Keep all batches in flight at once
+    std::vector<std::future<int>> writes;
+    for (size_t i = 0; i < blocks.size(); i += MAX_BATCH_SECTIONS) {
+        size_t n = std::min(blocks.size() - i, (size_t)MAX_BATCH_SECTIONS);
+        writes.push_back(disk_->write_disk_sections_async(&sections[i], n, &data[i]));
     }
-    map_iter_t it;
-    for (it = blocks_.begin(); it != blocks_.end(); ++it) {
-        if (it->second->refcnt == 0) {
-            flush_block_(it);
-            data = it->second;
-            blocks_.erase(it);
-            return data;
+    size_t written = 0;
+    for (size_t i = 0; i < blocks.size(); i += MAX_BATCH_SECTIONS) {
+        size_t n = std::min(blocks.size() - i, (size_t)MAX_BATCH_SECTIONS);
+        if (progress) {
+            std::cout << "BlockManager: Flushing blocks (" << i + n
+                << "/" << blocks.size() << ")\r" << std::flush;
+        }
+        bool ok = writes[i / MAX_BATCH_SECTIONS].get() >= 0;
+        if (ok) {
+            written += n;
+        } else {
+            std::cerr << "BlockManager: Failed to flush " << n << " blocks" << std::endl;
+        }
+        for (size_t j = i; j < i + n; ++j) {
+            Shard& shard = shard_(blocks[j].first);
+            LockGuard lock_guard(&shard.lock);
+            auto it = shard.blocks.find(blocks[j].first);
+            if (it == shard.blocks.end()) continue;
+            it->second->writing = false;
+            if (!ok) mark_dirty_(it->second);
+            if (it->second->refcnt == 0) enqueue_(shard, it);
         }
     }
-    return new Data;
+    if (progress && !blocks.empty()) std::cout << std::endl;
+    return written;
+}
+
+// Called with the shard of the block locked
+void BlockManager::mark_dirty_(Data* data) {
+    if (data->dirty) return;
+    data->dirty = true;
+    data->dirty_since = std::chrono::steady_clock::now();
+    if (++dirty_count_ == DIRTY_HIGH_WATERMARK) sem_post(&writeback_wake_);
+}
+
+// Called with the shard of the block locked
+void BlockManager::mark_clean_(Data* data) {
+    if (!data->dirty) return;
+    data->dirty = false;
+    --dirty_count_;
+}
+
+// Wake up every WRITEBACK_INTERVAL, or when the dirty blocks reach the high watermark.
+// Above it, write back until the low watermark is reached, else only the expired blocks.
+void BlockManager::writeback_loop_() {
+    while (!writeback_stop_) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(WRITEBACK_INTERVAL).count();
+        deadline.tv_nsec += interval % 1000000000;
+        deadline.tv_sec += interval / 1000000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        sem_timedwait(&writeback_wake_, &deadline);
+        if (writeback_stop_) break;
+        bool all = dirty_count_ >= DIRTY_HIGH_WATERMARK;
+        while (writeback_(all) > 0 && all && dirty_count_ > DIRTY_LOW_WATERMARK && !writeback_stop_) {}
+    }
+}
+
+// Write back up to MAX_ROUTINE_FLUSH_SIZE unpinned dirty blocks of each shard, all of them
+// or only the expired ones, one shard at a time. Returns the blocks written.
+size_t BlockManager::writeback_(bool all) {
+    LockGuard writeback_guard(&writeback_lock_);
+    auto expired = std::chrono::steady_clock::now() - DIRTY_EXPIRE;
+    size_t written = 0;
+    for (auto& shard : shards_) {
+        Writeback writeback;
+        {
+            LockGuard lock_guard(&shard.lock);
+            for (auto it = shard.blocks.begin();
+                it != shard.blocks.end() && writeback.blocks.size() < MAX_ROUTINE_FLUSH_SIZE; ++it) {
+                Data* data = it->second;
+                if (data->dirty && data->refcnt == 0 && (all || data->dirty_since <= expired)) {
+                    start_writeback_(it, writeback);
+                }
+            }
+        }
+        written += finish_writeback_(writeback, false);
+    }
+    flush_bitmap_();
+    return written;
+}
+
+BlockManager::Data* BlockManager::get_free_data_(Shard& shard) {
+    if (!shard.free_data.empty()) {
+        Data* data = shard.free_data.back();
+        shard.free_data.pop_back();
+        return data;
+    }
+    auto victim = victim_(shard);
+    if (victim != shard.blocks.end()) {
+        return evict_(shard, victim);
+    }
+    return new_data_();
+}
+
+void BlockManager::release_data_(Shard& shard, Data* data) {
+    if (arena_.contains(data->data)) {
+        shard.free_data.push_back(data);
+    } else {
+        delete_data_(data);
+    }
+}
+
+// A frame outside of the arena, for when all frames of a shard are pinned
+BlockManager::Data* BlockManager::new_data_() {
+    Data* data = new Data();
+    data->data = static_cast<char*>(aligned_alloc(CACHE_LINE_SIZE,
+        (block_size_ + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE));
+    return data;
+}
+
+void BlockManager::delete_data_(Data* data) {
+    if (arena_.contains(data->data)) return;
+    free(data->data);
+    delete data;
 }
 
 int BlockManager::check_block_range_(blockid_t block) {
-    if (block <= superblock_->block_end) {
+    if (block <= block_end_) {
         return 0;
     }
     std::cerr << "BlockManager: Invalid block " << block << std::endl;
     return -1;
-}
\ No newline at end of file
+}
@@ -2,29 +2,73 @@
 #ifndef BLOCKMGR_H
 #define BLOCKMGR_H
 
-#include <queue>
+#include <list>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <thread>
 #include <semaphore.h>
 #include <unordered_map>
 #include <iostream>
 
 #include "idisk.h"
+#include "arena.h"
+#include "bitmap.h"
 
 using blockid_t = uint64_t;
 
+// Minimum block size, the actual one is the section size of the disk.
+// On-disk structures are laid out to fit in it.
 constexpr uint32_t BLOCK_SIZE = SECTION_SIZE;
 constexpr size_t MAX_DATA_POOL_SIZE = 1024;
-constexpr size_t MAX_ROUTINE_FLUSH_SIZE = 32;
+constexpr size_t MAX_ROUTINE_FLUSH_SIZE = 32; // Blocks of a shard written back at once in the background
+constexpr size_t DIRTY_HIGH_WATERMARK = MAX_DATA_POOL_SIZE / 2; // Dirty blocks that start writeback at once
+constexpr size_t DIRTY_LOW_WATERMARK = MAX_DATA_POOL_SIZE / 4;  // and where it stops
+constexpr auto DIRTY_EXPIRE = std::chrono::seconds(1); // Blocks dirty for longer are written back anyway
+constexpr auto WRITEBACK_INTERVAL = std::chrono::milliseconds(100);
+constexpr size_t MAX_READ_AHEAD_PENDING = 256; // Blocks being read ahead at once
+constexpr size_t CACHE_SHARDS = 16; // Independently locked parts of the block cache
+constexpr size_t MAX_PREALLOC = 64; // Blocks reserved for an owner at most at once
+constexpr size_t MAX_PREALLOC_OWNERS = 32; // Owners with reserved blocks, the oldest give them back
+constexpr size_t MAX_CYL_GROUPS = 16; // The disk is split into at most this many groups of cylinders
+
+// Replacement policy of the block cache
+enum class CachePolicy {
+    CLOCK,  // Second chance over all cached blocks
+    TWO_Q,  // Blocks enter a FIFO and only move to an LRU when used again, resists scans
+};
+
+// Where new blocks go
+enum class AllocPolicy {
+    BUMP,       // The next free block after the last one allocated
+    GROUPED,    // Inodes by cylinder group, file data in contiguous windows after its inode
+    NEAR_HEAD,  // Files and their data at the first free block from the disk head, directories
+                // like GROUPED. For streams of small synchronous writes such as logs.
+};
 
 struct SuperBlock {
     static constexpr uint32_t MAGIC = 0x2C1D7C0D;
     uint32_t magic;
     uint32_t block_size;
-    blockid_t free_list_head;
+    blockid_t free_list_head;   // Free list of file systems without a bitmap
     blockid_t root_inode;
-    blockid_t block_end;
+    blockid_t block_end;        // Highest block ever allocated
     uint64_t version;
+    blockid_t bitmap;           // First block of the free space bitmap, 0 if there is none yet
+    uint64_t bitmap_blocks;     // Blocks of the bitmap, at the end of the disk unless a free list was converted
+    uint32_t group_count;       // Cylinder groups, 0 if the file system predates them
+    uint32_t group_cylinders;   // Cylinders of each group
+    struct {
+        uint32_t free_blocks;   // Recounted from the bitmap on mount
+        uint32_t dirs;          // Directories with their inode in the group
+    } groups[MAX_CYL_GROUPS];
+    uint64_t disk_blocks;       // Blocks of the disk the bitmap was made for, 0 if not recorded yet
 };
+static_assert(sizeof(SuperBlock) <= BLOCK_SIZE, "SuperBlock must fit in a block");
 
+// Header of the blocks on the free list of file systems without a bitmap,
+// read when giving them one
 struct FreeBlock {
     static constexpr uint32_t MAGIC = 0x2C1D7C0E;
     uint32_t magic;
@@ -40,39 +84,134 @@ class BlockManager {
         sem_t* lock_;
     };
 
+    // Replacement queue a block belongs to
+    enum Queue : uint8_t {
+        QUEUE_CLOCK,
+        QUEUE_A1IN, // 2Q FIFO of blocks used once
+        QUEUE_AM,   // 2Q LRU of blocks used again
+    };
+
+    struct ReadAhead;
+
+    // Blocks reserved for an owner, they are free on disk until allocated
+    struct Prealloc {
+        std::vector<blockid_t> blocks;
+        size_t next;    // Next block to allocate
+        size_t window;  // Blocks reserved last time
+        std::list<blockid_t>::iterator lru;
+    };
+
+    // Metadata of a cache frame, kept apart from the frame data
     struct Data {
         bool dirty;
-        uint32_t refcnt;
-        char data[BLOCK_SIZE];
+        bool writing;       // Written back from a copy, the frame is kept cached until done
+        std::chrono::steady_clock::time_point dirty_since;
+        bool queued;        // Pinned blocks are taken out of their queue when found
+        bool referenced;    // CLOCK reference bit
+        Queue queue;
+        std::atomic<uint32_t> refcnt;
+        char* data;         // block_size_ bytes, in the arena unless all its frames were pinned
+        std::list<blockid_t>::iterator pos;
+        std::shared_ptr<ReadAhead> loading; // The batch still reading the block
     };
 
     using block_map_t = std::unordered_map<blockid_t, Data*>;
     using map_iter_t = block_map_t::iterator;
 
+    // A batch read issued without waiting. Its frames are cached as loading from the
+    // start, so nobody reads the blocks again, and are usable once it completes.
+    struct ReadAhead {
+        ReadAhead() { sem_init(&lock, 0, 0); } // Locked until the read is issued
+        ~ReadAhead() { sem_destroy(&lock); }
+        int wait();
+        bool ready();
+
+        sem_t lock;
+        std::future<int> read;
+        int result = -1;
+        bool done = false;
+        std::vector<blockid_t> ids;
+        std::vector<Data*> frames;
+    };
+
+    // Dirty blocks written back from copies of their frames, so that their shards are
+    // not held during the writes, see start_writeback_
+    struct Writeback {
+        std::vector<std::pair<blockid_t, size_t>> blocks; // Each block and its copy in data
+        std::vector<char> data;
+    };
+
+    // Part of the cache, blocks are spread over the shards by id
+    struct Shard {
+        sem_t lock;
+        block_map_t blocks;
+        std::vector<Data*> free_data;
+
+        // Unpinned cached blocks in replacement order, the front is the newest
+        std::list<blockid_t> clock;
+        std::list<blockid_t>::iterator hand; // Next block the CLOCK checks
+        std::list<blockid_t> a1in;
+        std::list<blockid_t> am;
+        std::list<blockid_t> a1out; // 2Q ghosts of blocks evicted from a1in
+        std::unordered_map<blockid_t, std::list<blockid_t>::iterator> a1out_index;
+    };
+
 public:
-    BlockManager(RemoteDisk* disk, bool create = false);
+    BlockManager(Disk* disk, bool create = false, CachePolicy policy = CachePolicy::TWO_Q,
+        AllocPolicy alloc_policy = AllocPolicy::GROUPED);
     ~BlockManager();
 
+    // False if the file system on the disk could not be loaded, nothing is written then
+    bool mounted() const { return mounted_; }
+
     template <class block_t>
     inline block_t* load(blockid_t block) {
         if (block == 0) return nullptr;
         if (check_block_range_(block) < 0) return nullptr;
-        LockGuard lock_guard(&lock_);
-        auto iter = load_block_(block);
+        Shard& shard = shard_(block);
+        LockGuard lock_guard(&shard.lock);
+        auto iter = load_block_(shard, block);
         iter->second->refcnt++;
         return reinterpret_cast<block_t*>(iter->second->data);
     }
 
+    // Allocate a block, at or after `near` if given
     template <class block_t>
-    inline block_t* allocate(blockid_t& block) {
-        LockGuard lock_guard(&lock_);
-        auto iter = allocate_();
-        if (iter == blocks_.end()) {
+    inline block_t* allocate(blockid_t& block, blockid_t near = 0) {
+        LockGuard lock_guard(&alloc_lock_);
+        Data* data = allocate_(block, near);
+        if (data == nullptr) {
             block = 0;
             return nullptr;
         }
-        block = iter->first;
-        return reinterpret_cast<block_t*>(iter->second->data);
+        return reinterpret_cast<block_t*>(data->data);
+    }
+
+    // Allocate an inode in the cylinder group of its parent directory. Directories are
+    // spread instead, to the group with the fewest of them among those with enough space.
+    template <class block_t>
+    inline block_t* allocate_inode(blockid_t parent, bool dir, blockid_t& block) {
+        LockGuard lock_guard(&alloc_lock_);
+        Data* data = allocate_inode_(parent, dir, block);
+        if (data == nullptr) {
+            block = 0;
+            return nullptr;
+        }
+        return reinterpret_cast<block_t*>(data->data);
+    }
+
+    // Allocate a data block of owner, placed after the block `after`. Each owner gets
+    // a window of contiguous blocks reserved at a time, so files written at the same
+    // time do not interleave. The window doubles while the owner keeps allocating.
+    template <class block_t>
+    inline block_t* allocate_for(blockid_t owner, blockid_t after, blockid_t& block) {
+        LockGuard lock_guard(&alloc_lock_);
+        Data* data = allocate_for_(owner, after, block);
+        if (data == nullptr) {
+            block = 0;
+            return nullptr;
+        }
+        return reinterpret_cast<block_t*>(data->data);
     }
 
     void dirtify(blockid_t block);
@@ -81,31 +220,114 @@ public:
     
     void free_block(blockid_t block);
 
+    // Free an inode allocated with allocate_inode
+    void free_inode(blockid_t block, bool dir);
+
+    // Load the uncached blocks among `blocks` into cache with batched disk reads.
+    void prefetch(const blockid_t* blocks, size_t count);
+
+    // Start reading the uncached blocks among `blocks` without waiting for them.
+    void read_ahead(const blockid_t* blocks, size_t count);
+
+    // Write back all unpinned dirty blocks and the bitmap now. The writeback thread
+    // does it incrementally otherwise.
     void flush();
 
+    uint32_t block_size() const { return block_size_; }
+
 private:
-    map_iter_t allocate_();
+    Data* allocate_(blockid_t& block, blockid_t near = 0);
+    Data* allocate_from_(size_t from, blockid_t& block);
+    Data* allocate_inode_(blockid_t parent, bool dir, blockid_t& block);
+    Data* allocate_for_(blockid_t owner, blockid_t after, blockid_t& block);
+    Data* claim_(blockid_t block);
+    size_t reserve_(blockid_t after, size_t count, std::vector<blockid_t>& blocks);
+    void release_prealloc_(blockid_t owner);
+    bool release_all_prealloc_();
 
-    blockid_t& next_block_() { return superblock_->block_end; }
-    blockid_t& free_list_head_() { return superblock_->free_list_head; }
     blockid_t& root_inode() { return superblock_->root_inode; }
     uint64_t version() { return superblock_->version; }
 
-    bool incr_next_block();
+    size_t index_(blockid_t block) const;
+    blockid_t block_id_(size_t index) const;
+    bool init_bitmap_(bool create);
+    void convert_free_list_();
+    void set_used_(size_t index, bool used);
+    void mark_bitmap_(size_t index, bool used);
+    void init_groups_();
+    size_t group_(size_t index) const;
+    size_t group_start_(size_t group) const;
+    size_t dir_group_() const;
+    void flush_bitmap_();
 
-    map_iter_t load_block_(blockid_t block, bool read = true);
-    void release_block_(map_iter_t block);
+    Shard& shard_(blockid_t block);
+    map_iter_t load_block_(Shard& shard, blockid_t block, bool read = true);
+    std::vector<std::shared_ptr<ReadAhead>> read_blocks_(const blockid_t* blocks, size_t count, size_t limit);
+    void complete_read_ahead_(ReadAhead* batch);
+    void complete_read_ahead_(Shard& shard, map_iter_t block);
+    void collect_read_ahead_(bool wait);
+    void release_block_(Shard& shard, map_iter_t block);
+    Data* evict_(Shard& shard, map_iter_t block);
+    map_iter_t victim_(Shard& shard);
+    void cache_(Shard& shard, map_iter_t block);
+    void touch_(Shard& shard, map_iter_t block);
+    void enqueue_(Shard& shard, map_iter_t block);
+    void dequeue_(Shard& shard, map_iter_t block);
+    std::list<blockid_t>& queue_(Shard& shard, Queue queue);
+    void mark_dirty_(Data* data);
+    void mark_clean_(Data* data);
     void flush_block_(map_iter_t block);
-    Data* get_free_data_();
+    void sort_for_head_(std::vector<std::pair<blockid_t, size_t>>& blocks);
+    void start_writeback_(map_iter_t block, Writeback& writeback);
+    size_t finish_writeback_(Writeback& writeback, bool progress = true);
+    void writeback_loop_();
+    size_t writeback_(bool all);
+    Data* get_free_data_(Shard& shard);
+    void release_data_(Shard& shard, Data* data);
+    Data* new_data_();
+    void delete_data_(Data* data);
     int check_block_range_(blockid_t block);
 
-    RemoteDisk* disk_;
+    Disk* disk_;
+    bool mounted_;
+    uint32_t block_size_;
+    CachePolicy policy_;
+    AllocPolicy alloc_policy_;
 
-    block_map_t blocks_;
-    std::queue<Data*> free_data_;
+    // Frames of the cache, each shard owns a contiguous slice of them
+    Arena arena_;
+    std::unique_ptr<Data[]> frames_;
+    Shard shards_[CACHE_SHARDS];
+
+    // Read ahead batches not yet collected, and how many blocks they read
+    std::list<std::shared_ptr<ReadAhead>> read_ahead_;
+    size_t reading_ahead_;
+    sem_t read_ahead_lock_;
 
     SuperBlock* superblock_;
-    sem_t lock_;
+    std::atomic<blockid_t> block_end_; // Copy of the superblock's, checked without alloc_lock_
+
+    // Free space, the bitmap blocks are written directly and never cached
+    Bitmap bitmap_;
+    Bitmap reserved_;                  // Set in bitmap_ as well, but free on disk
+    std::vector<bool> bitmap_dirty_;   // Bitmap blocks to write on flush
+    size_t bitmap_start_;              // Index of the first bitmap block
+    size_t alloc_cursor_;              // Allocation goes on from here
+    size_t group_blocks_;              // Blocks of each cylinder group
+
+    // Reserved windows by owner, and owners from the least recently allocating
+    std::unordered_map<blockid_t, Prealloc> prealloc_;
+    std::list<blockid_t> prealloc_lru_;
+
+    sem_t alloc_lock_; // Guards the superblock, the bitmap and the reservations
+    sem_t bitmap_flush_lock_; // Held from the bitmap snapshot until it is written, so flushes land in order
+
+    // Background writeback, woken early when the dirty blocks reach the high watermark
+    sem_t writeback_lock_; // One writeback or flush at a time, so writes of a block land in order
+    std::atomic<size_t> dirty_count_;
+    std::atomic<bool> writeback_stop_;
+    sem_t writeback_wake_;
+    std::thread writeback_thread_;
 };
 
 #endif // !BLOCKMGR_H
\ No newline at end of file
@@ -2,8 +2,11 @@
 #include <cstring>
 #include <string>
 #include <unistd.h>
+#include <signal.h>
 
 #include "bytepack/bytepack.h"
+#include "codec.h"
+#include "protocol.h"
 #include "network/network.h"
 #include "errorcode.h"
 
@@ -15,19 +18,23 @@ int main(int argc, char *argv[]) {
         std::cerr << "Usage: " << argv[0] << " <ip> <port>" << std::endl;
         return 1;
     }
-    int server_fd = connect_to_server(argv[1], atoi(argv[2]));
+    signal(SIGPIPE, SIG_IGN); // Sends to a closed server fail instead of killing the client
+    int version = BYTEPACK_VERSION;
+    int server_fd = connect_to_server_versioned(argv[1], atoi(argv[2]), &version);
+    if (server_fd < 0) return 1;
     std::string line, full_path = "/";
     bytepack_t request, response;
     bytepack_init(&request, 1024);
     bytepack_init(&response, 1024);
+    request.version = response.version = version;
     // login
     std::cout << "Enter username: ";
     std::getline(std::cin, line);
-    bytepack_pack(&request, "s", line.c_str());
+    codec::pack(&request, line);
     bytepack_send(server_fd, &request);
     bytepack_recv(server_fd, &response);
     ecode_t result;
-    bytepack_unpack(&response, "i", &result);
+    codec::unpack(&response, result);
     if (result != 0) {
         std::cerr << msg(result) << std::endl;
         return 1;
@@ -40,166 +47,167 @@ int main(int argc, char *argv[]) {
         std::cin >> cmd;
         bytepack_reset(&request);
         if (cmd == "format") {
-            bytepack_pack(&request, "i", OP_FORMAT);
+            codec::pack(&request, OP_FORMAT);
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "mk") {
             std::string filename;
             std::cin >> filename;
-            bytepack_pack(&request, "is", OP_CREATE, filename.c_str());
+            codec::pack(&request, OP_CREATE, PathRequest{ filename });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "mkdir") {
             std::string dirname;
             std::cin >> dirname;
-            bytepack_pack(&request, "is", OP_MKDIR, dirname.c_str());
+            codec::pack(&request, OP_MKDIR, PathRequest{ dirname });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         }
         else if (cmd == "rm") {
             std::string filename;
             std::cin >> filename;
-            bytepack_pack(&request, "is", OP_RMFILE, filename.c_str());
+            codec::pack(&request, OP_RMFILE, PathRequest{ filename });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "rmdir") {
             std::string dirname;
             std::cin >> dirname;
-            bytepack_pack(&request, "is", OP_RMDIR, dirname.c_str());
+            codec::pack(&request, OP_RMDIR, PathRequest{ dirname });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "ls") {
-            bytepack_pack(&request, "i", OP_LS);
+            codec::pack(&request, OP_LS);
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             if (result != 0) {
                 std::cout << msg(result);
             } else {
                 size_t count;
-                bytepack_unpack(&response, "l", &count);
+                codec::unpack(&response, count);
                 std::cout << "total: " << count << std::endl;
                 for (size_t i = 0; i < count; ++i) {
                     char name[256];
-                    bytepack_unpack(&response, "s", name);
+                    codec::unpack(&response, name);
                     std::cout << name << std::endl;
                 }
             }
         } else if (cmd == "cd") {
             std::string dirname;
             std::cin >> dirname;
-            bytepack_pack(&request, "is", OP_CD, dirname.c_str());
+            codec::pack(&request, OP_CD, PathRequest{ dirname });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
             if (result == 0) {
                 size_t len;
-                bytepack_unpack(&response, "l", &len);
+                codec::unpack(&response, len);
                 char path[256];
-                bytepack_unpack(&response, "s", path);
+                codec::unpack(&response, path);
                 full_path = path;
             }
         } else if (cmd == "chmod") {
             std::string filename;
             int mode;
             std::cin >> filename >> mode;
-            bytepack_pack(&request, "isi", OP_CHMOD, filename.c_str(), mode);
+            codec::pack(&request, OP_CHMOD, AttrRequest{ filename, mode });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "chown") {
             std::string filename;
             int owner;
             std::cin >> filename >> owner;
-            bytepack_pack(&request, "isi", OP_CHOWN, filename.c_str(), owner);
+            codec::pack(&request, OP_CHOWN, AttrRequest{ filename, owner });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "rename") {
             std::string oldname, newname;
             std::cin >> oldname >> newname;
-            bytepack_pack(&request, "iss", OP_RENAME, oldname.c_str(), newname.c_str());
+            codec::pack(&request, OP_RENAME, RenameRequest{ oldname, newname });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "exit" || cmd == "e") {
-            bytepack_pack(&request, "i", OP_EXIT);
+            codec::pack(&request, OP_EXIT);
             bytepack_send(server_fd, &request);
             break;
         } else if (cmd == "cat") {
             std::string filename;
             std::cin >> filename;
-            bytepack_pack(&request, "is", OP_CAT, filename.c_str());
+            codec::pack(&request, OP_CAT, PathRequest{ filename });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             if (result != 0) {
                 std::cout << msg(result);
             } else {
                 size_t size;
-                bytepack_unpack(&response, "l", &size);
-                char *data = new char[size];
-                bytepack_unpack_bytes(&response, data, &size);
-                std::cout.write(data, size);
-                delete[] data;
+                const void* data;
+                if (codec::unpack(&response, size, codec::bytes_ref(data, size)) < 0) {
+                    std::cerr << "Error: Malformed response from server" << std::endl;
+                } else {
+                    std::cout.write(static_cast<const char*>(data), size);
+                }
             }
         } else if (cmd == "w") {
             std::string filename, data;
             size_t offset;
             std::cin >> filename >> offset >> data;
-            bytepack_pack(&request, "isll", OP_WRITE, filename.c_str(), offset, data.size());
-            bytepack_pack_bytes(&request, data.c_str(), data.size());
+            codec::pack(&request, OP_WRITE, RangeRequest{ filename, offset, data.size() },
+                codec::ref(data.c_str(), data.size()));
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "i") { // insert
             std::string filename, data;
             size_t offset;
             std::cin >> filename >> offset >> data;
-            bytepack_pack(&request, "isll", OP_INSERT, filename.c_str(), offset, data.size());
-            bytepack_pack_bytes(&request, data.c_str(), data.size());
+            codec::pack(&request, OP_INSERT, RangeRequest{ filename, offset, data.size() },
+                codec::ref(data.c_str(), data.size()));
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "d") { // delete
             std::string filename;
             size_t offset, size;
             std::cin >> filename >> offset >> size;
-            bytepack_pack(&request, "isll", OP_DELETE, filename.c_str(), offset, size);
+            codec::pack(&request, OP_DELETE, RangeRequest{ filename, offset, size });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "stat") {
             std::string filename;
             std::cin >> filename;
-            bytepack_pack(&request, "is", OP_STAT, filename.c_str());
+            codec::pack(&request, OP_STAT, PathRequest{ filename });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             if (result != 0) {
                 std::cout << msg(result);
             } else {
                 size_t len;
-                bytepack_unpack(&response, "l", &len);
+                codec::unpack(&response, len);
                 char *data = new char[len];
-                bytepack_unpack(&response, "s", data);
+                codec::unpack(&response, codec::str_out(data, len));
                 std::cout << data << std::endl;
                 delete[] data;
             }
@@ -207,71 +215,72 @@ int main(int argc, char *argv[]) {
             std::string filename;
             size_t size;
             std::cin >> filename >> size;
-            bytepack_pack(&request, "isl", OP_TRUNCATE, filename.c_str(), size);
+            codec::pack(&request, OP_TRUNCATE, TruncateRequest{ filename, size });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "del") { // delall
             std::string filename;
             std::cin >> filename;
-            bytepack_pack(&request, "is", OP_DELALL, filename.c_str());
+            codec::pack(&request, OP_DELALL, PathRequest{ filename });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "flush") {
-            bytepack_pack(&request, "i", OP_FLUSH);
+            codec::pack(&request, OP_FLUSH);
             bytepack_send(server_fd, &request);
         } else if (cmd == "rn") {
             std::string oldname, newname;
             std::cin >> oldname >> newname;
-            bytepack_pack(&request, "iss", OP_RENAME, oldname.c_str(), newname.c_str());
+            codec::pack(&request, OP_RENAME, RenameRequest{ oldname, newname });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "adduser") {
             std::string username;
             std::cin >> username;
-            bytepack_pack(&request, "is", OP_ADDUSER, username.c_str());
+            codec::pack(&request, OP_ADDUSER, PathRequest{ username });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             std::cout << msg(result);
         } else if (cmd == "r") { // read
             std::string filename;
             size_t offset, size;
             std::cin >> filename >> offset >> size;
-            bytepack_pack(&request, "isll", OP_READ, filename.c_str(), offset, size);
+            codec::pack(&request, OP_READ, RangeRequest{ filename, offset, size });
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             if (result != 0) {
                 std::cout << msg(result);
             } else {
                 size_t len;
-                bytepack_unpack(&response, "l", &len);
-                char *data = new char[len];
-                bytepack_unpack_bytes(&response, data, &len);
-                std::cout.write(data, len);
-                std::cout << std::endl;
-                delete[] data;
+                const void* data;
+                if (codec::unpack(&response, len, codec::bytes_ref(data, len)) < 0) {
+                    std::cerr << "Error: Malformed response from server" << std::endl;
+                } else {
+                    std::cout.write(static_cast<const char*>(data), len);
+                    std::cout << std::endl;
+                }
             }
         } else if (cmd == "lsuser") {
-            bytepack_pack(&request, "i", OP_LSUSER);
+            codec::pack(&request, OP_LSUSER);
             bytepack_send(server_fd, &request);
             bytepack_recv(server_fd, &response);
-            bytepack_unpack(&response, "i", &result);
+            codec::unpack(&response, result);
             if (result != 0) {
                 std::cout << msg(result);
             } else {
                 size_t count;
-                bytepack_unpack(&response, "l", &count);
+                codec::unpack(&response, count);
                 std::cout << "total: " << count;
                 for (size_t i = 0; i < count; ++i) {
                     char name[256];
-                    bytepack_unpack(&response, "s", name);
+                    codec::unpack(&response, name);
                     std::cout << std::endl << name;
                 }
             }
@@ -0,0 +1,436 @@
+#pragma once
+#ifndef CODEC_H
+#define CODEC_H
+
+// Typed packing of bytepack messages. Field types are resolved at compile time
+// instead of parsing a format string, and the wire format is the same as bytepack,
+// in the version of the bytepack:
+//   char                            'c'
+//   4-byte integers and enums       'i'
+//   8-byte integers                 'l'
+//   const char*, std::string        's'
+//   codec::bytes                    bytepack_pack_bytes
+//   codec::ref                      bytepack_pack_bytes, without copying the data
+// Integers are written with their own width, so a field is packed and unpacked
+// with the same type on both sides, e.g. long for 'l'. Messages are structs that list
+// their fields in wire order with CODEC_FIELDS, so both sides share one definition:
+//   struct DiskSectorRequest { char op; int cylinder; int sector; CODEC_FIELDS(op, cylinder, sector) };
+//   codec::pack(bp, DiskSectorRequest{ 'R', 0, 1 });
+// A message is packed as its fields, alone or next to other values.
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+
+#include "bytepack/bytepack.h"
+
+// The fields of a message in wire order
+#define CODEC_FIELDS(...) \
+    auto fields() { return std::tie(__VA_ARGS__); } \
+    auto fields() const { return std::tie(__VA_ARGS__); }
+
+namespace codec {
+
+// A byte string to pack
+struct Bytes {
+    const void* data;
+    size_t size;
+};
+
+inline Bytes bytes(const void* data, size_t size) {
+    return { data, size };
+}
+
+// A byte string to pack by reference, see bytepack_append_ref
+struct Ref {
+    const void* data;
+    size_t size;
+};
+
+inline Ref ref(const void* data, size_t size) {
+    return { data, size };
+}
+
+// Unpack a byte string into data, which holds at most capacity bytes
+struct BytesOut {
+    void* data;
+    size_t capacity;
+    size_t* size;
+};
+
+inline BytesOut bytes_out(void* data, size_t capacity, size_t& size) {
+    return { data, capacity, &size };
+}
+
+// Unpack a byte string as a pointer into the message, without copying
+struct BytesRef {
+    const void** data;
+    size_t* size;
+};
+
+inline BytesRef bytes_ref(const void*& data, size_t& size) {
+    return { &data, &size };
+}
+
+// Unpack a string into data, which holds at most capacity bytes with the NUL
+struct StrOut {
+    char* data;
+    size_t capacity;
+};
+
+inline StrOut str_out(char* data, size_t capacity) {
+    return { data, capacity };
+}
+
+namespace detail {
+
+template <class T>
+constexpr bool is_scalar_v = (std::is_integral_v<T> || std::is_enum_v<T>) && !std::is_same_v<T, bool> &&
+    (sizeof(T) == 1 || sizeof(T) == 4 || sizeof(T) == 8);
+
+template <class T>
+constexpr bool is_string_v = std::is_same_v<T, const char*> || std::is_same_v<T, char*> ||
+    std::is_same_v<T, std::string>;
+
+template <class T, class = void>
+struct is_message : std::false_type {};
+
+template <class T>
+struct is_message<T, std::void_t<decltype(std::declval<T&>().fields())>> : std::true_type {};
+
+template <class T>
+constexpr bool is_message_v = is_message<std::remove_cv_t<std::remove_reference_t<T>>>::value;
+
+// The fields of a message, or the value itself
+template <class T>
+inline auto fields_of(T& value) {
+    if constexpr (is_message_v<T>) {
+        return value.fields();
+    } else {
+        return std::tie(value);
+    }
+}
+
+template <class M>
+using fields_t = decltype(std::declval<const M&>().fields());
+
+constexpr size_t VARINT_MAX = 10;
+
+// Size of a field known at compile time, 0 for strings and bytes. In V2, an upper bound.
+template <class T, bool V2>
+constexpr size_t fixed_size() {
+    using U = std::decay_t<T>;
+    if constexpr (!is_scalar_v<U>) {
+        return 0;
+    } else if constexpr (V2 && sizeof(U) > 1) {
+        return sizeof(U) == 4 ? 5 : VARINT_MAX;
+    } else {
+        return sizeof(U);
+    }
+}
+
+template <bool V2, class T>
+inline size_t variable_size(const T& value) {
+    using U = std::decay_t<T>;
+    if constexpr (std::is_same_v<U, std::string>) {
+        return V2 ? VARINT_MAX + value.size() : value.size() + 1;
+    } else if constexpr (is_string_v<U>) {
+        return V2 ? VARINT_MAX + strlen(value) : strlen(value) + 1;
+    } else if constexpr (std::is_same_v<U, Bytes>) {
+        return (V2 ? VARINT_MAX : sizeof(size_t)) + value.size;
+    } else {
+        static_assert(is_scalar_v<U>, "Fields are char, 4 or 8-byte integers, enums, strings or codec::bytes");
+        return 0;
+    }
+}
+
+inline uint64_t zigzag(int64_t v) {
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v) {
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+inline void put_varint(char*& p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = static_cast<char>(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = static_cast<char>(v);
+}
+
+// Length of a string or byte string
+template <bool V2>
+inline void put_length(char*& p, size_t size) {
+    if constexpr (V2) {
+        put_varint(p, size);
+    } else {
+        memcpy(p, &size, sizeof(size_t));
+        p += sizeof(size_t);
+    }
+}
+
+template <bool V2>
+inline void put_str(char*& p, const char* value, size_t len) {
+    if constexpr (V2) {
+        put_varint(p, len);
+    } else {
+        len += 1; // With the NUL
+    }
+    memcpy(p, value, len);
+    p += len;
+}
+
+template <bool V2, class T>
+inline void put(char*& p, const T& value) {
+    using U = std::decay_t<T>;
+    if constexpr (std::is_same_v<U, std::string>) {
+        put_str<V2>(p, value.c_str(), value.size());
+    } else if constexpr (is_string_v<U>) {
+        put_str<V2>(p, value, strlen(value));
+    } else if constexpr (std::is_same_v<U, Bytes>) {
+        put_length<V2>(p, value.size);
+        memcpy(p, value.data, value.size);
+        p += value.size;
+    } else if constexpr (V2 && sizeof(U) == 4) {
+        put_varint(p, zigzag(static_cast<int32_t>(value)));
+    } else if constexpr (V2 && sizeof(U) == 8) {
+        put_varint(p, zigzag(static_cast<int64_t>(value)));
+    } else {
+        memcpy(p, &value, sizeof(U));
+        p += sizeof(U);
+    }
+}
+
+// Make room for size more bytes, growing geometrically like bytepack_append
+inline int grow(bytepack_t* bp, size_t size) {
+    if (bp->offset + size <= bp->bufsize) return 0;
+    size_t bufsize = bp->bufsize * 2;
+    if (bufsize < bp->offset + size) bufsize = bp->offset + size;
+    return bytepack_reserve(bp, bufsize);
+}
+
+template <class Tuple>
+struct message_size;
+
+template <class... Ts>
+struct message_size<std::tuple<Ts...>> {
+    static constexpr bool fixed = (is_scalar_v<std::decay_t<Ts>> && ...);
+    static constexpr size_t value = (size_t(0) + ... + fixed_size<Ts, false>());
+};
+
+// Unpack a V1 scalar, the size was checked by the caller
+template <class T>
+inline void get_fixed(const char*& p, T& value) {
+    static_assert(is_scalar_v<T>, "Fields are char, 4 or 8-byte integers, enums, strings or codec::bytes");
+    memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+}
+
+inline int get_varint(bytepack_t* bp, uint64_t& value) {
+    value = 0;
+    for (size_t shift = 0; shift < 7 * VARINT_MAX && bp->offset < bp->size; shift += 7) {
+        unsigned char b = static_cast<unsigned char>(bp->data[bp->offset++]);
+        value |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+template <class T>
+inline int get_scalar(bytepack_t* bp, T& value) {
+    static_assert(is_scalar_v<T>, "Fields are char, 4 or 8-byte integers, enums, strings or codec::bytes");
+    if (bp->version == BYTEPACK_V2 && sizeof(T) > 1) {
+        uint64_t v;
+        if (get_varint(bp, v) < 0) return -1;
+        int64_t i = unzigzag(v);
+        if (sizeof(T) == 4 && (i < INT32_MIN || i > INT32_MAX)) return -1;
+        value = static_cast<T>(i);
+        return 0;
+    }
+    if (bp->offset + sizeof(T) > bp->size) return -1;
+    const char* p = bp->data + bp->offset;
+    get_fixed(p, value);
+    bp->offset += sizeof(T);
+    return 0;
+}
+
+// Find the next string, len without the NUL
+inline int get_str_span(bytepack_t* bp, const char*& data, size_t& len) {
+    size_t left = bp->size - bp->offset;
+    if (bp->version == BYTEPACK_V2) {
+        uint64_t v;
+        if (get_varint(bp, v) < 0 || v > bp->size - bp->offset) return -1;
+        data = bp->data + bp->offset;
+        len = v;
+        bp->offset += len;
+        return 0;
+    }
+    len = strnlen(bp->data + bp->offset, left);
+    if (len >= left) return -1;
+    data = bp->data + bp->offset;
+    bp->offset += len + 1;
+    return 0;
+}
+
+inline int get_str(bytepack_t* bp, char* data, size_t capacity) {
+    size_t offset = bp->offset;
+    const char* str;
+    size_t len;
+    if (get_str_span(bp, str, len) < 0) return -1;
+    if (len >= capacity) {
+        bp->offset = offset;
+        return -1;
+    }
+    memcpy(data, str, len);
+    data[len] = '\0';
+    return 0;
+}
+
+inline int get_bytes(bytepack_t* bp, const void** data, size_t* size) {
+    uint64_t len;
+    if (bp->version == BYTEPACK_V2) {
+        if (get_varint(bp, len) < 0) return -1;
+    } else {
+        if (bp->offset + sizeof(size_t) > bp->size) return -1;
+        memcpy(&len, bp->data + bp->offset, sizeof(size_t));
+        bp->offset += sizeof(size_t);
+    }
+    if (len > bp->size - bp->offset) return -1;
+    *data = bp->data + bp->offset;
+    *size = len;
+    bp->offset += len;
+    return 0;
+}
+
+template <class T>
+inline int get(bytepack_t* bp, T&& value) {
+    using U = std::remove_reference_t<T>;
+    if constexpr (std::is_same_v<std::decay_t<U>, StrOut>) {
+        return get_str(bp, value.data, value.capacity);
+    } else if constexpr (std::is_array_v<U>) {
+        static_assert(std::is_same_v<std::remove_extent_t<U>, char>, "Strings are unpacked into char arrays");
+        return get_str(bp, value, std::extent_v<U>);
+    } else if constexpr (std::is_same_v<U, std::string>) {
+        const char* str;
+        size_t len;
+        if (get_str_span(bp, str, len) < 0) return -1;
+        value.assign(str, len);
+        return 0;
+    } else if constexpr (std::is_same_v<std::decay_t<U>, BytesRef>) {
+        return get_bytes(bp, value.data, value.size);
+    } else if constexpr (std::is_same_v<std::decay_t<U>, BytesOut>) {
+        const void* data;
+        if (get_bytes(bp, &data, value.size) < 0) return -1;
+        if (*value.size > value.capacity) return -1;
+        memcpy(value.data, data, *value.size);
+        return 0;
+    } else {
+        if (get_scalar(bp, value) < 0) {
+            value = U();
+            return -1;
+        }
+        return 0;
+    }
+}
+
+// Unpack the next field if the ones before it were unpacked, or clear it
+template <class T>
+inline void get_next(bytepack_t* bp, bool& ok, T&& value) {
+    using U = std::remove_reference_t<T>;
+    if (ok) {
+        ok = get(bp, std::forward<T>(value)) == 0;
+    } else if constexpr (is_scalar_v<U>) {
+        value = U();
+    }
+}
+
+template <bool V2, class... Ts>
+inline int pack(bytepack_t* bp, const Ts&... values) {
+    constexpr size_t fixed = (size_t(0) + ... + fixed_size<Ts, V2>());
+    size_t size = (fixed + ... + variable_size<V2>(values));
+    if (grow(bp, size) < 0) return -1;
+    char* p = bp->data + bp->offset;
+    (put<V2>(p, values), ...);
+    bp->offset = p - bp->data;
+    bp->size = bp->offset;
+    return 0;
+}
+
+// Pack a field of a message with references
+template <class T>
+inline int pack_field(bytepack_t* bp, const T& value) {
+    if constexpr (std::is_same_v<T, Ref>) {
+        if (bytepack_pack_size(bp, value.size) < 0) return -1;
+        return bytepack_append_ref(bp, value.data, value.size);
+    } else if (bp->version == BYTEPACK_V2) {
+        return pack<true>(bp, value);
+    } else {
+        return pack<false>(bp, value);
+    }
+}
+
+} // namespace detail
+
+/// @brief True if all fields of message M are scalars, so it has a fixed layout.
+template <class M>
+constexpr bool is_fixed_v = detail::message_size<detail::fields_t<M>>::fixed;
+
+/// @brief Size of the scalar fields of message M in V1, all of it if is_fixed_v<M>.
+template <class M>
+constexpr size_t fixed_size_v = detail::message_size<detail::fields_t<M>>::value;
+
+/// @brief Pack values at the end of bp, messages as their fields.
+/// @return 0 on success, -1 if bp cannot grow.
+template <class... Ts>
+inline int pack(bytepack_t* bp, const Ts&... values) {
+    if constexpr ((detail::is_message_v<Ts> || ...)) {
+        return std::apply([bp](const auto&... fields) { return codec::pack(bp, fields...); },
+            std::tuple_cat(detail::fields_of(values)...));
+    } else if constexpr ((std::is_same_v<Ts, Ref> || ...)) {
+        // The fields around a reference are packed separately
+        return ((detail::pack_field(bp, values) == 0) && ...) ? 0 : -1;
+    } else if (bp->version == BYTEPACK_V2) {
+        return detail::pack<true>(bp, values...);
+    } else {
+        return detail::pack<false>(bp, values...);
+    }
+}
+
+/// @brief Unpack values from bp. Scalars are unpacked into variables of their type, strings
+/// into char arrays, std::string or codec::str_out, byte strings with codec::bytes_out or
+/// codec::bytes_ref, messages as their fields. When all fields are V1 scalars, the size is
+/// checked once. Scalars that are missing from bp are set to zero.
+/// @return 0 on success, -1 if bp is too short or a buffer is too small.
+template <class... Ts>
+inline int unpack(bytepack_t* bp, Ts&&... values) {
+    if constexpr ((detail::is_message_v<Ts> || ...)) {
+        return std::apply([bp](auto&... fields) { return codec::unpack(bp, fields...); },
+            std::tuple_cat(detail::fields_of(values)...));
+    } else {
+        if constexpr ((detail::is_scalar_v<std::remove_reference_t<Ts>> && ...)) {
+            if (bp->version != BYTEPACK_V2) {
+                constexpr size_t size = (size_t(0) + ... + sizeof(std::remove_reference_t<Ts>));
+                if (bp->offset + size > bp->size) {
+                    ((values = std::remove_reference_t<Ts>()), ...);
+                    return -1;
+                }
+                const char* p = bp->data + bp->offset;
+                (detail::get_fixed(p, values), ...);
+                bp->offset += size;
+                return 0;
+            }
+        }
+        bool ok = true;
+        (detail::get_next(bp, ok, std::forward<Ts>(values)), ...);
+        return ok ? 0 : -1;
+    }
+}
+
+} // namespace codec
+
+#endif // !CODEC_H
@@ -83,7 +83,7 @@ ecode_t WorkingDir::create_file(const char* filename) {
         UNLOCK(ERROR_INVALID_NAME);
     }
     CHKRET(node->dir->lookup(name.c_str()) == 0, ERROR_EXIST);
-    blockid_t file_inode = active_file_.create(user_, 033, TYPE_FILE);
+    blockid_t file_inode = active_file_.create(user_, 033, TYPE_FILE, node->file->inode_id());
     CHKRET(file_inode != 0, ERROR_INVALID);
     active_file_.close();
     ret = node->dir->add_entry(name.c_str(), file_inode);
@@ -102,7 +102,7 @@ ecode_t WorkingDir::create_dir(const char* dirname) {
         UNLOCK(ERROR_INVALID_NAME);
     }
     CHKRET(node->dir->lookup(name.c_str()) == 0, ERROR_EXIST);
-    blockid_t dir_inode = active_file_.create(user_, 033, TYPE_DIR);
+    blockid_t dir_inode = active_file_.create(user_, 033, TYPE_DIR, node->file->inode_id());
     CHKRET(dir_inode != 0, ERROR_INVALID);
     { // flush directoy info into file
         Directory dir(&active_file_, node->file->inode_id());
@@ -134,7 +134,7 @@ ecode_t WorkingDir::remove(const char* name) {
     node->dir->remove_entry(filename.c_str());
     active_file_.removeall();
     active_file_.close();
-    fs_->block_mgr()->free_block(inode);
+    fs_->block_mgr()->free_inode(inode, false);
     UNLOCK(0);
 }
 
@@ -239,8 +239,8 @@ void WorkingDir::release_file() {
     UNLOCK();
 }
 
-FileSystem::FileSystem(RemoteDisk* disk, bool create): 
-    disk_(disk), block_mgr_(nullptr), userfile_(nullptr) {
+FileSystem::FileSystem(Disk* disk, bool create, CachePolicy policy, AllocPolicy alloc_policy): 
+    disk_(disk), policy_(policy), alloc_policy_(alloc_policy), block_mgr_(nullptr), userfile_(nullptr) {
     sem_init(&lock_, 0, 1);
     if (create) {
         format_();
@@ -319,7 +319,7 @@ ecode_t FileSystem::format() {
 
 void FileSystem::format_() {
     if (block_mgr_) close_();
-    block_mgr_ = new BlockManager(disk_, true);
+    block_mgr_ = new BlockManager(disk_, true, policy_, alloc_policy_);
     // Create root inode
     InodeFile *root = new InodeFile(block_mgr_);
     blockid_t root_inode = root->create(0, 010, TYPE_DIR);
@@ -332,19 +332,25 @@ void FileSystem::format_() {
     nodes_[ROOT_INODE] = root_node;
     // Create user file
     InodeFile *uf_base = new InodeFile(block_mgr_);
-    blockid_t uf_inode = uf_base->create(0, 000, TYPE_FILE);
+    blockid_t uf_inode = uf_base->create(0, 000, TYPE_FILE, ROOT_INODE);
     userfile_ = new UserFile(uf_base);
     root_node->dir->add_entry("userfile", uf_inode);
     // Create home directory
     InodeFile *home = new InodeFile(block_mgr_);
-    blockid_t home_inode = home->create(0, 013, TYPE_DIR);
+    blockid_t home_inode = home->create(0, 013, TYPE_DIR, ROOT_INODE);
     node_t* home_node = new node_t(home, ROOT_INODE);
     nodes_[home_inode] = home_node;
     root_node->dir->add_entry("home", home_inode);
 }
 
 void FileSystem::load_() {
-    block_mgr_ = new BlockManager(disk_);
+    block_mgr_ = new BlockManager(disk_, false, policy_, alloc_policy_);
+    if (!block_mgr_->mounted()) {
+        std::cerr << "Failed to load the file system" << std::endl;
+        delete block_mgr_;
+        block_mgr_ = nullptr;
+        return;
+    }
     // Load root inode
     auto root_node = load_node_(ROOT_INODE);
     // std::cerr << "Root inode: " << root_node->file->inode_id() << std::endl;
@@ -569,11 +575,12 @@ ecode_t FileSystem::remove_(blockid_t inode, uint32_t user) {
         std::cout << "remove node: " << (*it)->file->inode_id() << std::endl;
         auto node = *it;
         auto inode = node->file->inode_id();
+        bool dir = node->dir != nullptr;
         node->file->removeall();
         node->file->close();
         nodes_.erase(inode);
         delete node;
-        block_mgr_->free_block(inode);
+        block_mgr_->free_inode(inode, dir);
     }
     return 0;
 }
\ No newline at end of file
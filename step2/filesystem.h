@@ -62,9 +62,13 @@ public:
         InodeFile active_file_;
     };
 
-    FileSystem(RemoteDisk* disk, bool create = false);
+    FileSystem(Disk* disk, bool create = false, CachePolicy policy = CachePolicy::TWO_Q,
+        AllocPolicy alloc_policy = AllocPolicy::GROUPED);
     ~FileSystem();
 
+    // False if the file system on the disk could not be loaded
+    bool open() const { return block_mgr_ != nullptr; }
+
     WorkingDir* open_working_dir(const char* username);
     void close_working_dir(WorkingDir*& wd);
 
@@ -96,7 +100,9 @@ private:
 
     std::unordered_map<blockid_t, node_t*> nodes_;
 
-    RemoteDisk* disk_;
+    Disk* disk_;
+    CachePolicy policy_;
+    AllocPolicy alloc_policy_;
     BlockManager* block_mgr_;
     UserFile* userfile_;
 
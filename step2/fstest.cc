@@ -1,10 +1,12 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <random>
 
 #include "blockmgr.h"
 #include "inodefile.h"
 #include "filesystem.h"
+#include "localdisk.h"
 
 struct HexCharStruct {
   unsigned char c;
@@ -19,6 +21,20 @@ inline HexCharStruct hex(unsigned char _c) {
   return HexCharStruct(_c);
 }
 
+// Disk file given on the command line, the tests use a disk server otherwise
+struct LocalDiskArgs {
+    const char* filename = nullptr;
+    int cylinders = 0;
+    int sectors = 0;
+    int section_size = SECTION_SIZE;
+} local_disk;
+
+Disk* open_disk(int port) {
+    if (local_disk.filename)
+        return new LocalDisk(local_disk.filename, local_disk.cylinders, local_disk.sectors, local_disk.section_size);
+    return new RemoteDisk("127.0.0.1", port);
+}
+
 class TestBase {
 public:
     virtual int run() = 0;
@@ -38,7 +54,7 @@ public:
 
     int run() override {
         out() << "start testing..." << std::endl;
-        disk = new RemoteDisk("127.0.0.1", 9348);
+        disk = open_disk(9348);
         if (!disk->open()) {
             out() << "Failed to open disk" << std::endl;
             return 1;
@@ -104,7 +120,7 @@ public:
     }
 
 private:
-    RemoteDisk* disk = nullptr;
+    Disk* disk = nullptr;
     BlockManager* blockmgr = nullptr;
 };
 
@@ -112,12 +128,18 @@ class InodeFileTest : public TestBase {
 public:
     int run() override {
         out() << "start testing..." << std::endl;
-        disk = new RemoteDisk("127.0.0.1", 9348);
+        disk = open_disk(9348);
         if (!disk->open()) {
             out() << "Failed to open disk" << std::endl;
             return 1;
         }
         blockmgr = new BlockManager(disk, false);
+        if (!blockmgr->mounted()) {
+            out() << "Failed to load the file system" << std::endl;
+            delete blockmgr;
+            delete disk;
+            return 1;
+        }
         std::string line;
         InodeFile inodefile(blockmgr);
         blockid_t inode_block;
@@ -185,7 +207,7 @@ public:
     }
 
 private:
-    RemoteDisk* disk = nullptr;
+    Disk* disk = nullptr;
     BlockManager* blockmgr = nullptr;
 };
 
@@ -193,7 +215,7 @@ class FileSystemTest : public TestBase {
 public:
     int run() override {
         out() << "start testing..." << std::endl;
-        disk = new RemoteDisk("127.0.0.1", 10383);
+        disk = open_disk(10383);
         if (!disk->open()) {
             out() << "Failed to open disk" << std::endl;
             return 1;
@@ -202,6 +224,11 @@ public:
         out() << "load last fs? [yes] ";
         std::cin >> line;
         fs = new FileSystem(disk, line != "yes");
+        if (!fs->open()) {
+            delete fs;
+            delete disk;
+            return 1;
+        }
         out() << "FS loaded, login as: ";
         std::cin >> line;
         auto wd = fs->open_working_dir(line.c_str());
@@ -338,15 +365,90 @@ public:
     }
 
 private:
-    RemoteDisk* disk = nullptr;
+    Disk* disk = nullptr;
     FileSystem* fs = nullptr;
 };
 
-int main() {
+// Appends to a few logs, each followed by a flush, while other reads move the disk head
+// around. Compares the seek time the disk server accumulates under each placement policy.
+class AllocBenchmark : public TestBase {
+public:
+    static constexpr int LOGS = 4;
+    static constexpr int APPENDS = 256;
+
+    int run() override {
+        out() << "start testing..." << std::endl;
+        if (local_disk.filename) {
+            out() << "Needs a disk server to measure seek time" << std::endl;
+            return 1;
+        }
+        const std::pair<AllocPolicy, const char*> policies[] = {
+            { AllocPolicy::BUMP, "bump" },
+            { AllocPolicy::GROUPED, "grouped" },
+            { AllocPolicy::NEAR_HEAD, "head" },
+        };
+        for (auto& policy : policies) {
+            long time = measure(policy.first);
+            if (time < 0) return 1;
+            out() << policy.second << ": total time " << time << std::endl;
+        }
+        return 0;
+    }
+
+    long measure(AllocPolicy policy) {
+        RemoteDisk disk("127.0.0.1", 9348);
+        if (!disk.open()) {
+            out() << "Failed to open disk" << std::endl;
+            return -1;
+        }
+        BlockManager blockmgr(&disk, true, CachePolicy::TWO_Q, policy);
+        InodeFile file(&blockmgr);
+        std::mt19937 random(1); // The same reads for every policy
+        std::vector<char> buffer(disk.section_size());
+        auto other_read = [&]() {
+            disk.read_disk_section(random() % disk.cylinder_num(), random() % disk.section_num(), buffer.data());
+        };
+        blockid_t logs[LOGS];
+        for (auto& log : logs) {
+            other_read();
+            log = file.create(0, FILE_READ | FILE_WRITE, TYPE_FILE);
+            file.close();
+        }
+        blockmgr.flush();
+        std::vector<char> record(blockmgr.block_size() - sizeof(InodeDataBlock), 'x');
+        disk.total_time(true);
+        for (int i = 0; i < APPENDS; ++i) {
+            other_read();
+            file.open(logs[i % LOGS]);
+            file.write(record.data(), record.size(), file.size());
+            file.close();
+            blockmgr.flush();
+        }
+        return disk.total_time();
+    }
+
+    const char* name() const override {
+        static const char* name = "AllocBenchmark";
+        return name;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc == 4 || argc == 5) {
+        local_disk.filename = argv[1];
+        local_disk.cylinders = atoi(argv[2]);
+        local_disk.sectors = atoi(argv[3]);
+        if (argc == 5)
+            local_disk.section_size = atoi(argv[4]);
+    } else if (argc != 1) {
+        std::cerr << "Usage: " << argv[0] << " [<DiskFile> <Cylinders> <Sectors> [<SectorSize>]]\n";
+        return 1;
+    }
     std::vector<TestBase*> tests = {
         // new TestBlockManager(),
         new FileSystemTest(),
         // new InodeFileTest(),
+        // new AllocBenchmark(),
     };
     for (auto test : tests) {
         if (test->run() == 0) test->out() << " passed" << std::endl;
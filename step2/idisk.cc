@@ -2,46 +2,247 @@
 
 #include <cstring>
 #include <cstdlib>
+#include <cerrno>
+#include <ctime>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #include <iostream>
+#include <algorithm>
 
 #include "bytepack/bytepack.h"
+#include "codec.h"
+#include "protocol.h"
 #include "network/network.h"
+#include "step1/diskring.h"
 
-constexpr int BUFFER_SIZE = 2 * SECTION_SIZE;
 static char error_msg[1024];
 
-RemoteDisk::RemoteDisk(const char* host, int port):
-    host_(host), port_(port) {
-    sockfd_ = connect_to_server(host, port);
-    if (sockfd_ < 0) {
-        std::cerr << "Failed to connect to disk on " << host << ":" << port << std::endl;
-        return;
+static_assert(MAX_BATCH_SECTIONS <= DISKRING_SLOTS, "A batch must fit in the shared-memory ring");
+
+// Large enough for a batch of MAX_BATCH_SECTIONS sections and their headers
+static size_t batch_buffer_size(int section_size) {
+    return MAX_BATCH_SECTIONS * (section_size + 32) + 64;
+}
+
+RemoteDisk::RemoteDisk(const char* host, int port, int connections):
+    ring_(nullptr), ring_fd_(-1), ring_size_(0), host_(host), port_(port), version_(BYTEPACK_VERSION), head_cylinder_(-1),
+    next_connection_(0),
+    async_connections_(std::max(connections, 1)), next_tag_(1) {
+    sem_init(&ring_lock_, 0, 1);
+    sem_init(&async_lock_, 0, 1);
+    for (int i = 0; i < std::max(connections, 1); ++i) {
+        if (!open_connection_()) {
+            if (i == 0) {
+                std::cerr << "Failed to connect to disk on " << host << ":" << port << std::endl;
+                return;
+            }
+            // Go on with a smaller pool
+            std::cerr << "Only " << i << " of " << connections << " connections to disk on "
+                << host << ":" << port << " succeeded" << std::endl;
+            async_connections_ = i;
+            break;
+        }
+        // Buffers of the next connections fit the section size
+        if (i == 0) get_disk_info(nullptr, nullptr);
+    }
+    if (server_local_()) {
+        attach_ring_();
     }
-    buffer_ = new char[BUFFER_SIZE];
-    get_disk_info(nullptr, nullptr);
     std::cout << "Connected to disk on " << host << ":" << port
         << " with " << cylinder_num_ << " cylinders and " << section_num_
-        << " sectors" << std::endl;
+        << " sectors of " << section_size_ << " bytes over "
+        << (ring_ != nullptr ? "shared memory" : std::to_string(connections_.size()) + " connections")
+        << std::endl;
 }
 
 RemoteDisk::~RemoteDisk() {
+    for (size_t i = 0; i < async_fds_.size(); ++i) {
+        shutdown(async_fds_[i], SHUT_RDWR); // Stop the receiver, failing what is in flight
+        receivers_[i].join();
+        close(async_fds_[i]);
+    }
+    sem_destroy(&async_lock_);
+    for (auto& conn : connections_) {
+        bytepack_reset(conn->bytepack);
+        codec::pack(conn->bytepack, 'E');
+        bytepack_send(conn->fd, conn->bytepack);
+        close(conn->fd);
+        bytepack_free(conn->bytepack);
+        delete conn->bytepack;
+        sem_destroy(&conn->lock);
+    }
+    if (ring_ != nullptr) {
+        close(ring_fd_); // The server detaches the ring
+        munmap(ring_, ring_size_);
+    }
+    sem_destroy(&ring_lock_);
+}
+
+bool RemoteDisk::open_connection_() {
+    // Later connections ask for the version of the first one, which the server answers the same
+    int fd = connect_to_server_versioned(host_.c_str(), port_, &version_);
+    if (fd < 0) return false;
+    std::unique_ptr<Connection> conn(new Connection);
+    conn->fd = fd;
+    conn->bytepack = new bytepack_t;
+    bytepack_init(conn->bytepack, batch_buffer_size(section_size_));
+    conn->bytepack->version = version_;
+    sem_init(&conn->lock, 0, 1);
+    connections_.push_back(std::move(conn));
+    return true;
+}
+
+bytepack_t& RemoteDisk::ConnectionGuard::bytepack() const {
+    bytepack_reset(conn_->bytepack);
+    return *conn_->bytepack;
+}
+
+// Take an idle connection of the pool, or wait for the next one in turn
+RemoteDisk::Connection* RemoteDisk::acquire_connection_() {
+    size_t start = next_connection_++ % connections_.size();
+    for (size_t i = 0; i < connections_.size(); ++i) {
+        Connection* conn = connections_[(start + i) % connections_.size()].get();
+        if (sem_trywait(&conn->lock) == 0) return conn;
+    }
+    Connection* conn = connections_[start].get();
+    sem_wait(&conn->lock);
+    return conn;
+}
+
+// Whether the disk server is on this host, connected through the same address
+bool RemoteDisk::server_local_() {
+    int fd = connections_[0]->fd;
+    sockaddr_in local, peer;
+    socklen_t len = sizeof(local);
+    if (getsockname(fd, reinterpret_cast<sockaddr*>(&local), &len) < 0) return false;
+    len = sizeof(peer);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &len) < 0) return false;
+    return local.sin_addr.s_addr == peer.sin_addr.s_addr;
+}
+
+// Create a shared-memory ring and ask the disk server to serve it, see step1/diskring.h
+bool RemoteDisk::attach_ring_() {
+    static int ring_count = 0;
+    std::string name = "/idisk-" + std::to_string(getpid()) + "-" + std::to_string(ring_count++);
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return false;
+    size_t size = diskring_size(section_size_);
+    void* ring = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (ring == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    ring_ = static_cast<diskring_t*>(ring);
+    ring_size_ = size;
+    ring_->magic = DISKRING_MAGIC;
+    ring_->sector_size = section_size_;
+    ring_->submitted = 0;
+    ring_->completed = 0;
+    ring_->head_cylinder = -1;
+    sem_init(&ring_->submit_sem, 1, 0);
+    sem_init(&ring_->complete_sem, 1, 0);
+    // The ring is served as long as its own connection stays open
+    ring_fd_ = connect_to_server(host_.c_str(), port_);
+    if (ring_fd_ < 0) {
+        munmap(ring_, ring_size_);
+        ring_ = nullptr;
+        shm_unlink(name.c_str());
+        return false;
+    }
     bytepack_t bytepack;
-    bytepack_attach(&bytepack, buffer_, BUFFER_SIZE);
-    bytepack_pack(&bytepack, "c", 'E');
-    bytepack_send(sockfd_, &bytepack);
-    close(sockfd_);
-    delete[] buffer_;
+    bytepack_init(&bytepack, 512);
+    codec::pack(&bytepack, 'L', name);
+    bytepack_send(ring_fd_, &bytepack);
+    bytepack_reset(&bytepack);
+    bytepack_recv(ring_fd_, &bytepack);
+    // The server has mapped the ring by now, or never will
+    shm_unlink(name.c_str());
+    int ret;
+    codec::unpack(&bytepack, ret);
+    if (ret != 1) {
+        codec::unpack(&bytepack, error_msg);
+        std::cerr << "Shared memory unavailable, using TCP: " << error_msg << std::endl;
+        bytepack_free(&bytepack);
+        close(ring_fd_);
+        munmap(ring_, ring_size_);
+        ring_ = nullptr;
+        return false;
+    }
+    bytepack_free(&bytepack);
+    return true;
+}
+
+// The server never sends anything unrequested, so a readable socket means it is gone
+bool RemoteDisk::server_alive_() {
+    pollfd pfd = { ring_fd_, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 0;
+}
+
+// Serve count <= DISKRING_SLOTS single sector requests through the ring.
+// Reads are copied into buffers, data_size bytes of data are written.
+// Return the number of succeeded requests, or -1 if the server is gone.
+int RemoteDisk::ring_request_(char op, const DiskSection* sections, int count,
+    char* const* buffers, const char* const* data, int data_size) {
+    LockGuard lock_guard(&ring_lock_);
+    unsigned start = ring_->submitted;
+    for (int i = 0; i < count; ++i) {
+        diskring_entry_t& entry = ring_->entries[(start + i) % DISKRING_SLOTS];
+        entry.op = op;
+        entry.cylinder = sections[i].cylinder;
+        entry.sector = sections[i].sector;
+        entry.data_size = data_size;
+        entry.result = 0;
+        if (op == 'W') {
+            memcpy(diskring_slot(ring_, start + i), data[i], data_size);
+        }
+    }
+    __atomic_store_n(&ring_->submitted, start + count, __ATOMIC_RELEASE);
+    sem_post(&ring_->submit_sem);
+    while (__atomic_load_n(&ring_->completed, __ATOMIC_ACQUIRE) != start + count) {
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        if (sem_timedwait(&ring_->complete_sem, &deadline) < 0 && errno == ETIMEDOUT && !server_alive_()) {
+            std::cerr << "Lost disk server on " << host_ << ":" << port_ << std::endl;
+            return -1;
+        }
+    }
+    if (ring_->head_cylinder >= 0) head_cylinder_ = ring_->head_cylinder;
+    int done = 0;
+    for (int i = 0; i < count; ++i) {
+        if (ring_->entries[(start + i) % DISKRING_SLOTS].result != 1) continue;
+        if (op == 'R') {
+            memcpy(buffers[i], diskring_slot(ring_, start + i), section_size_);
+        }
+        ++done;
+    }
+    return done;
 }
 
 int RemoteDisk::get_disk_info(int* cylinders, int* sectors) {
-    bytepack_t bytepack;
-    bytepack_attach(&bytepack, buffer_, BUFFER_SIZE);
-    bytepack_pack(&bytepack, "c", 'I');
-    bytepack_send(sockfd_, &bytepack);
+    ConnectionGuard conn(this);
+    bytepack_t& bytepack = conn.bytepack();
+    codec::pack(&bytepack, 'I');
+    bytepack_send(conn->fd, &bytepack);
     bytepack_reset(&bytepack);
-    bytepack_recv(sockfd_, &bytepack);
-    bytepack_unpack(&bytepack, "ii", &cylinder_num_, &section_num_);
+    bytepack_recv(conn->fd, &bytepack);
+    DiskGeometry geometry;
+    codec::unpack(&bytepack, geometry);
+    cylinder_num_ = geometry.cylinders;
+    section_num_ = geometry.sectors;
+    // Disk servers before the sector size was configurable only send the geometry
+    if (codec::unpack(&bytepack, section_size_) < 0) {
+        section_size_ = SECTION_SIZE;
+    }
+    bytepack_reserve(&bytepack, batch_buffer_size(section_size_));
     if (cylinders)
         *cylinders = cylinder_num_;
     if (sectors)
@@ -54,16 +255,26 @@ int RemoteDisk::clear_disk_section(int cylinder, int sector) {
         std::cerr << "Invalid disk section " << cylinder << ":" << sector << std::endl;
         return -1;
     }
-    bytepack_t bytepack;
-    bytepack_attach(&bytepack, buffer_, BUFFER_SIZE);
-    bytepack_pack(&bytepack, "cii", 'C', cylinder, sector);
-    bytepack_send(sockfd_, &bytepack);
+    if (ring_ != nullptr) {
+        DiskSection section = { cylinder, sector };
+        if (ring_request_('C', &section, 1, nullptr, nullptr, 0) != 1) {
+            std::cerr << "Failed to clear disk section " << cylinder << ":" << sector << std::endl;
+            return 0;
+        }
+        return 1;
+    }
+    ConnectionGuard conn(this);
+    bytepack_t& bytepack = conn.bytepack();
+    codec::pack(&bytepack, DiskSectorRequest{ 'C', cylinder, sector });
+    bytepack_send(conn->fd, &bytepack);
     bytepack_reset(&bytepack);
-    bytepack_recv(sockfd_, &bytepack);
+    bytepack_recv(conn->fd, &bytepack);
     int ret;
-    bytepack_unpack(&bytepack, "i", &ret);
+    codec::unpack(&bytepack, ret);
     if (ret == 0) {
         std::cerr << "Failed to clear disk section " << cylinder << ":" << sector << std::endl;
+    } else {
+        update_head_(&bytepack);
     }
     return ret;
 }
@@ -73,22 +284,31 @@ int RemoteDisk::read_disk_section(int cylinder, int sector, char* buffer) {
         std::cerr << "Invalid disk section " << cylinder << ":" << sector << std::endl;
         return -1;
     }
-    bytepack_t bytepack;
-    bytepack_attach(&bytepack, this->buffer_, BUFFER_SIZE);
-    bytepack_pack(&bytepack, "cii", 'R', cylinder, sector);
-    bytepack_send(sockfd_, &bytepack);
+    if (ring_ != nullptr) {
+        DiskSection section = { cylinder, sector };
+        if (ring_request_('R', &section, 1, &buffer, nullptr, 0) != 1) {
+            std::cerr << "Failed to read disk section " << cylinder << ":" << sector << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+    ConnectionGuard conn(this);
+    bytepack_t& bytepack = conn.bytepack();
+    codec::pack(&bytepack, DiskSectorRequest{ 'R', cylinder, sector });
+    bytepack_send(conn->fd, &bytepack);
     bytepack_reset(&bytepack);
-    bytepack_recv(sockfd_, &bytepack);
+    bytepack_recv(conn->fd, &bytepack);
     int sector_size;
-    bytepack_unpack(&bytepack, "i", &sector_size);
+    codec::unpack(&bytepack, sector_size);
     if (sector_size == 0) {
-        bytepack_unpack(&bytepack, "s", error_msg);
+        codec::unpack(&bytepack, error_msg);
         std::cerr << "Failed to read disk section " << cylinder << ":" << sector <<
             " with error: " << error_msg << std::endl;
         return -1;
     }
     size_t data_size = 0;
-    bytepack_unpack_bytes(&bytepack, buffer, &data_size);
+    codec::unpack(&bytepack, codec::bytes_out(buffer, section_size_, data_size));
+    update_head_(&bytepack);
     return static_cast<size_t>(sector_size) != data_size ? -1 : 0;
 }
 
@@ -97,8 +317,17 @@ int RemoteDisk::write_disk_section(int cylinder, int sector, int data_size, cons
         std::cerr << "Invalid disk section " << cylinder << ":" << sector << std::endl;
         return -1;
     }
-    bytepack_t bytepack;
-    bytepack_attach(&bytepack, buffer_, BUFFER_SIZE);
+    if (ring_ != nullptr) {
+        DiskSection section = { cylinder, sector };
+        if (data_size < 0 || data_size > section_size_ ||
+            ring_request_('W', &section, 1, nullptr, &data, data_size) != 1) {
+            std::cerr << "Failed to write disk section " << cylinder << ":" << sector << std::endl;
+            return 0;
+        }
+        return 1;
+    }
+    ConnectionGuard conn(this);
+    bytepack_t& bytepack = conn.bytepack();
     // size_t send_size = 277, byte_size = data_size;
     // send(sockfd_, &send_size, sizeof(send_size), 0);
     // send(sockfd_, "W", 1, 0);
@@ -107,22 +336,359 @@ int RemoteDisk::write_disk_section(int cylinder, int sector, int data_size, cons
     // send(sockfd_, &data_size, sizeof(data_size), 0);
     // send(sockfd_, &byte_size, sizeof(byte_size), 0);
     // send(sockfd_, data, data_size, 0);
-    bytepack_pack(&bytepack, "ciii", 'W', cylinder, sector, data_size);
-    bytepack_pack_bytes(&bytepack, data, data_size);
-    bytepack_send(sockfd_, &bytepack);
+    codec::pack(&bytepack, 'W', DiskSectorData{ cylinder, sector, data_size, codec::bytes(data, data_size) });
+    bytepack_send(conn->fd, &bytepack);
     bytepack_reset(&bytepack);
-    bytepack_recv(sockfd_, &bytepack);
+    bytepack_recv(conn->fd, &bytepack);
     int ret;
-    bytepack_unpack(&bytepack, "i", &ret);
+    codec::unpack(&bytepack, ret);
     if (ret == 0) {
-        bytepack_unpack(&bytepack, "s", error_msg);
+        codec::unpack(&bytepack, error_msg);
         std::cerr << "Failed to write disk section " << cylinder << ":" << sector <<
             " with error: " << error_msg << std::endl;
+    } else {
+        update_head_(&bytepack);
     }
     return ret;
 }
 
-bool RemoteDisk::check_disk_section(int cylinder, int sector) {
+int RemoteDisk::clear_disk_sections(const DiskSection* sections, int count) {
+    if (!check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return -1;
+    }
+    if (ring_ != nullptr) {
+        for (int done = 0; done < count; done += MAX_BATCH_SECTIONS) {
+            int n = std::min(count - done, MAX_BATCH_SECTIONS);
+            if (ring_request_('C', sections + done, n, nullptr, nullptr, 0) != n) {
+                std::cerr << "Failed to clear " << n << " disk sections" << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+    ConnectionGuard conn(this);
+    for (int done = 0; done < count; done += MAX_BATCH_SECTIONS) {
+        int n = std::min(count - done, MAX_BATCH_SECTIONS);
+        bytepack_t& bytepack = conn.bytepack();
+        codec::pack(&bytepack, DiskBatchRequest{ 'c', n });
+        for (int i = done; i < done + n; ++i) {
+            codec::pack(&bytepack, DiskAddress{ sections[i].cylinder, sections[i].sector });
+        }
+        bytepack_send(conn->fd, &bytepack);
+        bytepack_reset(&bytepack);
+        bytepack_recv(conn->fd, &bytepack);
+        int ret;
+        codec::unpack(&bytepack, ret);
+        if (ret != n) {
+            codec::unpack(&bytepack, error_msg);
+            std::cerr << "Failed to clear " << n << " disk sections with error: " << error_msg << std::endl;
+            return -1;
+        }
+        update_head_(&bytepack);
+    }
+    return 0;
+}
+
+int RemoteDisk::read_disk_sections(const DiskSection* sections, int count, char* const* buffers) {
+    if (!check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return -1;
+    }
+    if (ring_ != nullptr) {
+        for (int done = 0; done < count; done += MAX_BATCH_SECTIONS) {
+            int n = std::min(count - done, MAX_BATCH_SECTIONS);
+            if (ring_request_('R', sections + done, n, buffers + done, nullptr, 0) != n) {
+                std::cerr << "Failed to read " << n << " disk sections" << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+    ConnectionGuard conn(this);
+    for (int done = 0; done < count; done += MAX_BATCH_SECTIONS) {
+        int n = std::min(count - done, MAX_BATCH_SECTIONS);
+        bytepack_t& bytepack = conn.bytepack();
+        codec::pack(&bytepack, DiskBatchRequest{ 'r', n });
+        for (int i = done; i < done + n; ++i) {
+            codec::pack(&bytepack, DiskAddress{ sections[i].cylinder, sections[i].sector });
+        }
+        bytepack_send(conn->fd, &bytepack);
+        bytepack_reset(&bytepack);
+        bytepack_recv(conn->fd, &bytepack);
+        int ret, sector_size;
+        codec::unpack(&bytepack, ret);
+        if (ret != n) {
+            codec::unpack(&bytepack, error_msg);
+            std::cerr << "Failed to read " << n << " disk sections with error: " << error_msg << std::endl;
+            return -1;
+        }
+        const void* data;
+        size_t data_size;
+        codec::unpack(&bytepack, sector_size);
+        if (codec::unpack(&bytepack, codec::bytes_ref(data, data_size)) < 0 ||
+            sector_size != section_size_ || data_size != static_cast<size_t>(n) * section_size_) {
+            std::cerr << "Bad response when reading " << n << " disk sections" << std::endl;
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            memcpy(buffers[done + i], static_cast<const char*>(data) + i * section_size_, section_size_);
+        }
+        update_head_(&bytepack);
+    }
+    return 0;
+}
+
+int RemoteDisk::write_disk_sections(const DiskSection* sections, int count, const char* const* data) {
+    if (!check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return -1;
+    }
+    if (ring_ != nullptr) {
+        for (int done = 0; done < count; done += MAX_BATCH_SECTIONS) {
+            int n = std::min(count - done, MAX_BATCH_SECTIONS);
+            if (ring_request_('W', sections + done, n, nullptr, data + done, section_size_) != n) {
+                std::cerr << "Failed to write " << n << " disk sections" << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+    ConnectionGuard conn(this);
+    for (int done = 0; done < count; done += MAX_BATCH_SECTIONS) {
+        int n = std::min(count - done, MAX_BATCH_SECTIONS);
+        bytepack_t& bytepack = conn.bytepack();
+        codec::pack(&bytepack, DiskBatchRequest{ 'w', n });
+        for (int i = done; i < done + n; ++i) {
+            codec::pack(&bytepack, DiskSectorData{ sections[i].cylinder, sections[i].sector, section_size_,
+                codec::bytes(data[i], section_size_) });
+        }
+        bytepack_send(conn->fd, &bytepack);
+        bytepack_reset(&bytepack);
+        bytepack_recv(conn->fd, &bytepack);
+        int ret;
+        codec::unpack(&bytepack, ret);
+        if (ret != n) {
+            codec::unpack(&bytepack, error_msg);
+            std::cerr << "Failed to write " << n << " disk sections with error: " << error_msg << std::endl;
+            return -1;
+        }
+        update_head_(&bytepack);
+    }
+    return 0;
+}
+
+std::future<int> Disk::ready_future(int value) {
+    std::promise<int> promise;
+    promise.set_value(value);
+    return promise.get_future();
+}
+
+std::future<int> RemoteDisk::read_disk_sections_async(const DiskSection* sections, int count, char* const* buffers) {
+    if (count <= 0 || count > MAX_BATCH_SECTIONS || !check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return ready_future(-1);
+    }
+    if (ring_ != nullptr) {
+        return ready_future(read_disk_sections(sections, count, buffers));
+    }
+    bytepack_t bytepack;
+    bytepack_init(&bytepack, count * 2 * sizeof(int) + 32);
+    bytepack.version = version_;
+    codec::pack(&bytepack, DiskBatchRequest{ 'r', count });
+    for (int i = 0; i < count; ++i) {
+        codec::pack(&bytepack, DiskAddress{ sections[i].cylinder, sections[i].sector });
+    }
+    return send_tagged_(&bytepack, 'r', count, buffers);
+}
+
+std::future<int> RemoteDisk::write_disk_sections_async(const DiskSection* sections, int count, const char* const* data) {
+    if (count <= 0 || count > MAX_BATCH_SECTIONS || !check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return ready_future(-1);
+    }
+    if (ring_ != nullptr) {
+        return ready_future(write_disk_sections(sections, count, data));
+    }
+    bytepack_t bytepack;
+    bytepack_init(&bytepack, batch_buffer_size(section_size_));
+    bytepack.version = version_;
+    codec::pack(&bytepack, DiskBatchRequest{ 'w', count });
+    for (int i = 0; i < count; ++i) {
+        codec::pack(&bytepack, DiskSectorData{ sections[i].cylinder, sections[i].sector, section_size_,
+            codec::bytes(data[i], section_size_) });
+    }
+    return send_tagged_(&bytepack, 'w', count, nullptr);
+}
+
+// Send a packed request tagged with 'X', then free it
+std::future<int> RemoteDisk::send_tagged_(bytepack_t* request, char op, int count, char* const* buffers) {
+    sem_wait(&async_lock_);
+    if (async_fds_.empty()) {
+        for (int i = 0; i < async_connections_; ++i) {
+            int version = version_;
+            int fd = connect_to_server_versioned(host_.c_str(), port_, &version);
+            if (fd < 0) break; // Go on with the connections opened
+            async_fds_.push_back(fd);
+            receivers_.emplace_back(&RemoteDisk::receive_tagged_, this, fd);
+        }
+        async_live_ = async_fds_;
+    }
+    if (async_live_.empty()) {
+        sem_post(&async_lock_);
+        std::cerr << "No connection to disk for tagged requests" << std::endl;
+        bytepack_free(request);
+        return ready_future(-1);
+    }
+    long tag = next_tag_++;
+    int fd = async_live_[tag % async_live_.size()]; // Spread over the connections
+    // The request follows the 'X' header without being copied
+    bytepack_t tagged;
+    bytepack_init(&tagged, 16);
+    tagged.version = version_;
+    codec::pack(&tagged, DiskTaggedRequest{ 'X', tag });
+    bytepack_append_ref(&tagged, request->data, request->size);
+    Pending& pending = pending_[tag];
+    pending.fd = fd;
+    pending.op = op;
+    pending.count = count;
+    if (buffers != nullptr) {
+        pending.buffers.assign(buffers, buffers + count);
+    }
+    std::future<int> future = pending.promise.get_future();
+    if (bytepack_send(fd, &tagged) < 0) {
+        std::cerr << "Failed to send tagged request to disk" << std::endl;
+        pending.promise.set_value(-1);
+        pending_.erase(tag);
+        shutdown(fd, SHUT_RDWR); // Its receiver takes it out of rotation
+    }
+    sem_post(&async_lock_);
+    bytepack_free(&tagged);
+    bytepack_free(request);
+    return future;
+}
+
+void RemoteDisk::receive_tagged_(int fd) {
+    bytepack_t response;
+    bytepack_init(&response, batch_buffer_size(section_size_));
+    response.version = version_;
+    while (true) {
+        bytepack_reset(&response);
+        if (bytepack_recv(fd, &response) < 0 || response.size == 0) break;
+        long tag;
+        if (codec::unpack(&response, tag) < 0) break;
+        sem_wait(&async_lock_);
+        auto it = pending_.find(tag);
+        if (it == pending_.end()) {
+            sem_post(&async_lock_);
+            std::cerr << "Unexpected response to tag " << tag << " from disk" << std::endl;
+            continue;
+        }
+        Pending pending = std::move(it->second);
+        pending_.erase(it);
+        sem_post(&async_lock_);
+        complete_tagged_(pending, &response);
+    }
+    // The connection is closed, stop sending on it and fail what is left on it
+    shutdown(fd, SHUT_RDWR);
+    sem_wait(&async_lock_);
+    async_live_.erase(std::find(async_live_.begin(), async_live_.end(), fd));
+    for (auto it = pending_.begin(); it != pending_.end();) {
+        if (it->second.fd == fd) {
+            it->second.promise.set_value(-1);
+            it = pending_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    sem_post(&async_lock_);
+    bytepack_free(&response);
+}
+
+void RemoteDisk::complete_tagged_(Pending& pending, bytepack_t* response) {
+    int ret, sector_size;
+    codec::unpack(response, ret);
+    if (ret != pending.count) {
+        char error[1024] = "";
+        codec::unpack(response, error);
+        std::cerr << "Failed to " << (pending.op == 'r' ? "read " : "write ") << pending.count
+            << " disk sections with error: " << error << std::endl;
+        pending.promise.set_value(-1);
+        return;
+    }
+    if (pending.op == 'r') {
+        const void* data;
+        size_t data_size;
+        codec::unpack(response, sector_size);
+        if (codec::unpack(response, codec::bytes_ref(data, data_size)) < 0 || sector_size != section_size_ ||
+            data_size != static_cast<size_t>(pending.count) * section_size_) {
+            std::cerr << "Bad response when reading " << pending.count << " disk sections" << std::endl;
+            pending.promise.set_value(-1);
+            return;
+        }
+        for (int i = 0; i < pending.count; ++i) {
+            memcpy(pending.buffers[i], static_cast<const char*>(data) + i * section_size_, section_size_);
+        }
+    }
+    update_head_(response);
+    pending.promise.set_value(0);
+}
+
+// Disk servers before head reporting leave it out
+void RemoteDisk::update_head_(bytepack_t* response) {
+    int cylinder;
+    if (codec::unpack(response, cylinder) == 0 && cylinder >= 0 && cylinder < cylinder_num_) {
+        head_cylinder_ = cylinder;
+    }
+}
+
+long RemoteDisk::total_time(bool reset) {
+    ConnectionGuard conn(this);
+    bytepack_t& bytepack = conn.bytepack();
+    codec::pack(&bytepack, DiskStatRequest{ 'S', char(reset) });
+    bytepack_send(conn->fd, &bytepack);
+    bytepack_reset(&bytepack);
+    bytepack_recv(conn->fd, &bytepack);
+    DiskStatResponse stat;
+    if (codec::unpack(&bytepack, stat) < 0 || stat.ret != 1) {
+        std::cerr << "Failed to get the statistics of the disk" << std::endl;
+        return -1;
+    }
+    return stat.total_time;
+}
+
+int RemoteDisk::trim_disk_sections(int cylinder, int sector, int count) {
+    if (!check_disk_section(cylinder, sector) || count <= 0) {
+        std::cerr << "Invalid disk range " << cylinder << ":" << sector << "+" << count << std::endl;
+        return -1;
+    }
+    ConnectionGuard conn(this);
+    bytepack_t& bytepack = conn.bytepack();
+    codec::pack(&bytepack, DiskTrimRequest{ 'T', cylinder, sector, count });
+    bytepack_send(conn->fd, &bytepack);
+    bytepack_reset(&bytepack);
+    bytepack_recv(conn->fd, &bytepack);
+    int ret;
+    codec::unpack(&bytepack, ret);
+    if (ret != count) {
+        codec::unpack(&bytepack, error_msg);
+        std::cerr << "Failed to trim disk range " << cylinder << ":" << sector << "+" << count
+            << " with error: " << error_msg << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+bool Disk::check_disk_sections(const DiskSection* sections, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (!check_disk_section(sections[i].cylinder, sections[i].sector)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Disk::check_disk_section(int cylinder, int sector) {
     if (cylinder < 0 || sector < 0) {
         return false;
     }
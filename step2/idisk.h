@@ -3,20 +3,59 @@
 // Disk interface
 #include <string>
 #include <cstdint>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <semaphore.h>
 
+// Default and minimum size of a disk section, the disk server may use larger ones.
 constexpr int SECTION_SIZE = 256;
+constexpr int MAX_BATCH_SECTIONS = 64; // Must match DISK_MAX_BATCH of the disk server
 
-class RemoteDisk {
+struct DiskSection {
+    int cylinder;
+    int sector;
+};
+
+// A disk of cylinders of sections, either a disk server (RemoteDisk) or a disk file
+// opened in the process (LocalDisk). Sections are addressed as cylinder:sector.
+class Disk {
 public:
-    RemoteDisk(const char* host, int port);
+    virtual ~Disk() {}
+
+    // Return 0 on success. The geometry is also known from cylinder_num() and section_num().
+    virtual int get_disk_info(int* cylinders, int* sectors) = 0;
+
+    // Return 1 on success, 0 on failure and -1 for an invalid section.
+    virtual int clear_disk_section(int cylinder, int sector) = 0;
+    // Return 0 on success and -1 on failure, the buffer holds section_size() bytes.
+    virtual int read_disk_section(int cylinder, int sector, char* buffer) = 0;
+    // Return 1 on success, 0 on failure and -1 for an invalid section. The rest of the section is zeroed.
+    virtual int write_disk_section(int cylinder, int sector, int data_size, const char* data) = 0;
+
+    // Batched operations, return 0 on success and -1 on failure.
+    // Each buffer holds exactly section_size() bytes.
+    virtual int clear_disk_sections(const DiskSection* sections, int count) = 0;
+    virtual int read_disk_sections(const DiskSection* sections, int count, char* const* buffers) = 0;
+    virtual int write_disk_sections(const DiskSection* sections, int count, const char* const* data) = 0;
+
+    // Asynchronous batched operations of at most MAX_BATCH_SECTIONS sections. The future
+    // gives 0 on success and -1 on failure, buffers and data must stay valid until then.
+    virtual std::future<int> read_disk_sections_async(const DiskSection* sections, int count, char* const* buffers) = 0;
+    virtual std::future<int> write_disk_sections_async(const DiskSection* sections, int count, const char* const* data) = 0;
 
-    ~RemoteDisk();
+    // Release count consecutive sections from cylinder:sector on disk, they read as zeros.
+    // Return 0 on success and -1 on failure.
+    virtual int trim_disk_sections(int cylinder, int sector, int count) = 0;
 
-    int get_disk_info(int* cylinders, int* sectors);
+    // Whether the disk is ready for I/O
+    virtual bool open() const = 0;
 
-    int clear_disk_section(int cylinder, int sector);
-    int read_disk_section(int cylinder, int sector, char* buffer);
-    int write_disk_section(int cylinder, int sector, int data_size, const char* data);
+    // Cylinder the head was at after the last request, -1 if the disk does not say
+    virtual int head_cylinder() const { return -1; }
 
     inline int cylinder_num() const {
         return cylinder_num_;
@@ -26,17 +65,134 @@ public:
         return section_num_;
     }
 
-    inline bool open() const {
-        return sockfd_ >= 0;
+    inline int section_size() const {
+        return section_size_;
     }
 
-private:
+protected:
     bool check_disk_section(int cylinder, int sector);
+    bool check_disk_sections(const DiskSection* sections, int count);
+
+    static std::future<int> ready_future(int value);
+
+    int cylinder_num_ = 0;
+    int section_num_ = 0;
+    int section_size_ = SECTION_SIZE;
+};
+
+struct diskring_t;
+typedef struct bytepack_t_ bytepack_t;
+
+// A disk server, over TCP or a shared-memory ring when it runs on this host
+class RemoteDisk : public Disk {
+    struct LockGuard {
+        LockGuard(sem_t* lock) : lock_(lock) { sem_wait(lock_); }
+        ~LockGuard() { sem_post(lock_); }
+        sem_t* lock_;
+    };
+
+    // A connection of the pool for synchronous requests
+    struct Connection {
+        int fd;
+        bytepack_t* bytepack;   // Grows to the largest request or response, then is reused
+        sem_t lock;             // Held while a request is using the connection
+    };
+
+    // Holds a connection of the pool for the duration of a request
+    class ConnectionGuard {
+    public:
+        ConnectionGuard(RemoteDisk* disk) : conn_(disk->acquire_connection_()) {}
+        ~ConnectionGuard() { sem_post(&conn_->lock); }
+        Connection* operator->() const { return conn_; }
+        // The bytepack of the connection, reset and in the wire format of the disk
+        bytepack_t& bytepack() const;
+    private:
+        Connection* conn_;
+    };
+
+public:
+    // Open a pool of `connections` connections to the disk server. Synchronous requests
+    // take an idle one, and as many more are opened for asynchronous requests.
+    RemoteDisk(const char* host, int port, int connections = 1);
+
+    ~RemoteDisk() override;
+
+    int get_disk_info(int* cylinders, int* sectors) override;
+
+    int clear_disk_section(int cylinder, int sector) override;
+    int read_disk_section(int cylinder, int sector, char* buffer) override;
+    int write_disk_section(int cylinder, int sector, int data_size, const char* data) override;
 
-    int sockfd_;
+    // Split into requests of at most MAX_BATCH_SECTIONS sections.
+    int clear_disk_sections(const DiskSection* sections, int count) override;
+    int read_disk_sections(const DiskSection* sections, int count, char* const* buffers) override;
+    int write_disk_sections(const DiskSection* sections, int count, const char* const* data) override;
+
+    // Sent tagged, spread over their own connections, so many can be in flight and the disk
+    // server schedules them together. Over shared memory they complete before returning.
+    std::future<int> read_disk_sections_async(const DiskSection* sections, int count, char* const* buffers) override;
+    std::future<int> write_disk_sections_async(const DiskSection* sections, int count, const char* const* data) override;
+
+    int trim_disk_sections(int cylinder, int sector, int count) override;
+
+    inline bool open() const override {
+        return !connections_.empty();
+    }
+
+    // Reported by the disk server with every sector request
+    inline int head_cylinder() const override {
+        return head_cylinder_;
+    }
+
+    // Time the disk server spent seeking, optionally starting it over. -1 on failure.
+    long total_time(bool reset = false);
+
+    // Whether sector I/O goes through a shared-memory ring instead of TCP,
+    // which is set up automatically when the disk server runs on this host.
+    inline bool shared_memory() const {
+        return ring_ != nullptr;
+    }
+
+private:
+    bool open_connection_();
+    Connection* acquire_connection_();
+
+    bool server_local_();
+    bool attach_ring_();
+    bool server_alive_();
+    int ring_request_(char op, const DiskSection* sections, int count,
+        char* const* buffers, const char* const* data, int data_size);
+
+    // A tagged request waiting for its response
+    struct Pending {
+        int fd;                 // Connection it was sent on
+        char op;
+        int count;
+        std::vector<char*> buffers;
+        std::promise<int> promise;
+    };
+
+    std::future<int> send_tagged_(bytepack_t* request, char op, int count, char* const* buffers);
+    void receive_tagged_(int fd);
+    void complete_tagged_(Pending& pending, bytepack_t* response);
+    void update_head_(bytepack_t* response);
+
+    diskring_t* ring_;
+    int ring_fd_;               // Connection the ring is attached to
+    size_t ring_size_;
+    sem_t ring_lock_;           // One batch in the ring at a time
     std::string host_;
     int port_;
-    char* buffer_;
-    int cylinder_num_;
-    int section_num_;
+    int version_;               // Wire format negotiated with the disk server
+    std::atomic<int> head_cylinder_;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    std::atomic<size_t> next_connection_;
+
+    int async_connections_;     // Number of connections for tagged requests
+    sem_t async_lock_;          // Protect the members below
+    std::vector<int> async_fds_; // Connections for tagged requests, opened on first use
+    std::vector<int> async_live_; // Those still open, new requests are spread over them
+    std::vector<std::thread> receivers_; // Complete tagged requests of each connection
+    long next_tag_;
+    std::unordered_map<long, Pending> pending_;
 };
\ No newline at end of file
@@ -10,8 +10,8 @@
 
 class TempData {
 public:
-    TempData(BlockManager* block_mgr): block_mgr(block_mgr), cur_offset(0), 
-        last_block(nullptr), last_block_id(0) {}
+    TempData(BlockManager* block_mgr, size_t data_size, blockid_t owner): block_mgr(block_mgr),
+        data_size(data_size), owner(owner), cur_offset(0), last_block(nullptr), last_block_id(0) {}
 
     ~TempData() {
         if (last_block != nullptr) {
@@ -26,18 +26,19 @@ public:
         size_t write_size = 0;
         while (write_size < size) {
             if (last_block == nullptr) {
-                last_block = block_mgr->allocate<InodeDataBlock>(last_block_id);
+                blockid_t after = data_ids.empty() ? owner : data_ids.back();
+                last_block = block_mgr->allocate_for<InodeDataBlock>(owner, after, last_block_id);
                 if (last_block == nullptr) return false;
                 last_block->magic = InodeDataBlock::MAGIC;
                 cached_data[last_block_id] = last_block;
                 data_ids.push_back(last_block_id);
             }
-            size_t write = std::min(size - write_size, InodeDataSize - cur_offset);
+            size_t write = std::min(size - write_size, data_size - cur_offset);
             memcpy(last_block->data + cur_offset, buf + write_size, write);
             block_mgr->dirtify(last_block_id);
             write_size += write;
             cur_offset += write;
-            if (cur_offset == InodeDataSize) {
+            if (cur_offset == data_size) {
                 cur_offset = 0;
                 last_block = nullptr;
             }
@@ -66,6 +67,8 @@ public:
     }
 
     BlockManager* block_mgr;
+    size_t data_size;
+    blockid_t owner;
     size_t cur_offset;
     InodeDataBlock* last_block;
     blockid_t last_block_id;
@@ -74,10 +77,12 @@ public:
 };
 
 InodeFile::InodeFile(BlockManager* block_mgr):
-    block_mgr_(block_mgr), inode_(nullptr), inode_block_(0) {}
+    block_mgr_(block_mgr), data_size_(block_mgr->block_size() - sizeof(InodeDataBlock)),
+    inode_(nullptr), inode_block_(0), ra_offset_(0), ra_end_(0), ra_window_(0) {}
 
 InodeFile::InodeFile(BlockManager* block_mgr, blockid_t inode_block):
-    block_mgr_(block_mgr), inode_(nullptr), inode_block_(0) {
+    block_mgr_(block_mgr), data_size_(block_mgr->block_size() - sizeof(InodeDataBlock)),
+    inode_(nullptr), inode_block_(0), ra_offset_(0), ra_end_(0), ra_window_(0) {
     open(inode_block);
 }
 
@@ -103,10 +108,10 @@ bool InodeFile::open(blockid_t inode_block) {
     return true;
 }
 
-blockid_t InodeFile::create(uint32_t owner, uint16_t mode, uint16_t type) {
+blockid_t InodeFile::create(uint32_t owner, uint16_t mode, uint16_t type, blockid_t parent) {
     if (is_open()) close();
     blockid_t inode_block;
-    inode_ = block_mgr_->allocate<InodeBlock>(inode_block);
+    inode_ = block_mgr_->allocate_inode<InodeBlock>(parent, type == TYPE_DIR, inode_block);
     if (inode_block == 0) return create_failed_();
     // memset(inode_, 0, sizeof(InodeBlock));
     inode_->magic = InodeBlock::MAGIC;
@@ -131,6 +136,7 @@ void InodeFile::close() {
     entry_ids_.clear();
     inode_ = nullptr;
     inode_block_ = 0;
+    ra_offset_ = ra_end_ = ra_window_ = 0;
 }
 
 size_t InodeFile::size() const {
@@ -144,12 +150,16 @@ size_t InodeFile::read(char* buf, size_t size, size_t offset) {
     inode_->atime = time(nullptr);
     size = std::min(size, (size_t)inode_->size - offset);
     size_t read_size = 0;
-    size_t index = offset / InodeDataSize;
-    size_t offset_in_block = offset % InodeDataSize;
+    size_t index = offset / data_size_;
+    size_t offset_in_block = offset % data_size_;
+    if (size > 0) {
+        prefetch_data_(index, (offset + size - 1) / data_size_ + 1);
+        read_ahead_(offset, offset + size);
+    }
     while (read_size < size) {
         auto data = load_data_(index, false);
         if (data == nullptr) return read_size;
-        size_t read = std::min(size - read_size, InodeDataSize - offset_in_block);
+        size_t read = std::min(size - read_size, data_size_ - offset_in_block);
         memcpy(buf + read_size, data->data + offset_in_block, read);
         read_size += read;
         offset_in_block = 0;
@@ -163,12 +173,12 @@ size_t InodeFile::write(const char* buf, size_t size, size_t offset) {
     if (offset > inode_->size) return 0;
     inode_->mtime = inode_->atime = time(nullptr);
     size_t write_size = 0;
-    size_t index = offset / InodeDataSize;
-    size_t offset_in_block = offset % InodeDataSize;
+    size_t index = offset / data_size_;
+    size_t offset_in_block = offset % data_size_;
     while (write_size < size) {
         auto data = load_data_(index, true);
         if (data == nullptr) return write_size;
-        size_t write = std::min(size - write_size, InodeDataSize - offset_in_block);
+        size_t write = std::min(size - write_size, data_size_ - offset_in_block);
         memcpy(data->data + offset_in_block, buf + write_size, write);
         block_mgr_->dirtify(data_ids_[index]);
         write_size += write;
@@ -185,18 +195,18 @@ size_t InodeFile::insert(const char* buf, size_t size, size_t offset) {
     if (inode_block_ == 0) return 0;
     if (offset > inode_->size) return 0;
     inode_->mtime = inode_->atime = time(nullptr);
-    size_t index = offset / InodeDataSize;
-    size_t offset_in_block = offset % InodeDataSize;
+    size_t index = offset / data_size_;
+    size_t offset_in_block = offset % data_size_;
     size_t remaining_size = inode_->size - offset;
     auto data = load_data_(index, true);
     // Construct a temporary buffer to hold the data
-    TempData temp_data(block_mgr_);
+    TempData temp_data(block_mgr_, data_size_, inode_block_);
     if (!temp_data.write(data->data, offset_in_block)) return 0;
     if (!temp_data.write(buf, size)) return 0;
     size_t i = index;
     while (remaining_size > 0) {
         data = load_data_(i, true);
-        size_t write_size = std::min(InodeDataSize - offset_in_block, remaining_size);
+        size_t write_size = std::min(data_size_ - offset_in_block, remaining_size);
         if (!temp_data.write(data->data + offset_in_block, write_size)) return 0;
         offset_in_block = 0;
         remaining_size -= write_size;
@@ -212,28 +222,28 @@ size_t InodeFile::remove(size_t size, size_t offset) {
     if (offset >= inode_->size) return 0;
     inode_->mtime = inode_->atime = time(nullptr);
     size = std::min(size, (size_t)inode_->size - offset);
-    size_t index = offset / InodeDataSize;
-    size_t offset_in_block = offset % InodeDataSize;
+    size_t index = offset / data_size_;
+    size_t offset_in_block = offset % data_size_;
     size_t remaining_size = inode_->size - offset - size;
     size_t delete_size = size;
     auto data = load_data_(index, false);
     // Construct a temporary buffer to hold the data
-    TempData temp_data(block_mgr_);
+    TempData temp_data(block_mgr_, data_size_, inode_block_);
     if (!temp_data.write(data->data, offset_in_block)) return 0;
     size_t i = index;
     do { // Skip the removed blocks
-        if (offset_in_block + delete_size < InodeDataSize) {
+        if (offset_in_block + delete_size < data_size_) {
             offset_in_block += delete_size;
             break;
         }
-        delete_size -= InodeDataSize - offset_in_block;
+        delete_size -= data_size_ - offset_in_block;
         offset_in_block = 0;
     } while (++i < data_ids_.size());
     // Copy rest of the data
     while (remaining_size > 0) {
         data = load_data_(i, false);
         if (data == nullptr) return 0;
-        size_t read_size = std::min(InodeDataSize - offset_in_block, remaining_size);
+        size_t read_size = std::min(data_size_ - offset_in_block, remaining_size);
         if (!temp_data.write(data->data + offset_in_block, read_size)) return 0;
         remaining_size -= read_size;
         offset_in_block = 0;
@@ -263,7 +273,7 @@ bool InodeFile::removeall() {
 
 bool InodeFile::truncate(size_t size) {
     if (inode_block_ == 0) return false;
-    size_t id_len = (size + InodeDataSize - 1) / InodeDataSize;
+    size_t id_len = (size + data_size_ - 1) / data_size_;
     inode_->mtime = inode_->atime = time(nullptr);
     if (size >= inode_->size) { // get more data blocks
         for (size_t i = data_ids_.size(); i < id_len; ++i) {
@@ -304,7 +314,8 @@ InodeDataBlock* InodeFile::load_data_(size_t index, bool create) {
     if (index >= data_ids_.size()) { // Need to create new data block
         if (!create || index > data_ids_.size()) return nullptr;
         blockid_t data_id;
-        auto data = block_mgr_->allocate<InodeDataBlock>(data_id);
+        blockid_t last = data_ids_.empty() ? inode_block_ : data_ids_.back();
+        auto data = block_mgr_->allocate_for<InodeDataBlock>(inode_block_, last, data_id);
         if (data_id == 0) return nullptr;
         // memset(data, 0, sizeof(InodeDataBlock)); // block_mgr_->allocate already does this
         data->magic = InodeDataBlock::MAGIC;
@@ -325,9 +336,43 @@ InodeDataBlock* InodeFile::load_data_(size_t index, bool create) {
     return data;
 }
 
+void InodeFile::prefetch_data_(size_t begin, size_t end) {
+    std::vector<blockid_t> ids;
+    for (size_t i = begin; i < end && i < data_ids_.size(); ++i) {
+        if (cached_data_.find(data_ids_[i]) == cached_data_.end()) {
+            ids.push_back(data_ids_[i]);
+        }
+    }
+    if (ids.size() > 1) block_mgr_->prefetch(ids.data(), ids.size());
+}
+
+// Keep up to ra_window_ blocks after [offset, end) read ahead while reads are sequential.
+// More is read ahead once the reader got through half of the window, so it is in flight
+// before the reader needs it.
+void InodeFile::read_ahead_(size_t offset, size_t end) {
+    bool sequential = offset == ra_offset_;
+    ra_offset_ = end;
+    if (!sequential) {
+        ra_end_ = ra_window_ = 0;
+        return;
+    }
+    size_t end_index = (end - 1) / data_size_ + 1;
+    if (ra_window_ > 0 && ra_end_ >= end_index + ra_window_ / 2) return;
+    ra_window_ = ra_window_ == 0 ? MIN_READ_AHEAD : std::min(ra_window_ * 2, MAX_READ_AHEAD);
+    size_t begin = std::max(ra_end_, end_index);
+    ra_end_ = std::min(end_index + ra_window_, data_ids_.size());
+    std::vector<blockid_t> ids;
+    for (size_t i = begin; i < ra_end_; ++i) {
+        if (cached_data_.find(data_ids_[i]) == cached_data_.end()) {
+            ids.push_back(data_ids_[i]);
+        }
+    }
+    if (!ids.empty()) block_mgr_->read_ahead(ids.data(), ids.size());
+}
+
 bool InodeFile::load_entries_() {
     if (inode_block_ == 0) return false;
-    size_t data_num = (inode_->size + InodeDataSize - 1) / InodeDataSize;
+    size_t data_num = (inode_->size + data_size_ - 1) / data_size_;
     cached_data_.clear();
     if (data_num == 0) return true;
     cached_data_.reserve(data_num);
@@ -393,7 +438,7 @@ blockid_t InodeFile::save_entries_(int level, size_t& i) {
     InodeEntryBlock* entry;
     blockid_t entry_id;
     if (entry_ids_.empty()) {
-        entry = block_mgr_->allocate<InodeEntryBlock>(entry_id);
+        entry = block_mgr_->allocate<InodeEntryBlock>(entry_id, inode_block_);
     } else {
         entry_id = entry_ids_.back();
         entry = block_mgr_->load<InodeEntryBlock>(entry_id);
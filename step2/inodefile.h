@@ -23,6 +23,10 @@ enum InodeFileType: uint16_t {
     TYPE_SYMLINK = 2,
 };
 
+// Data blocks read ahead of a sequential reader, the window doubles up to the maximum
+constexpr size_t MIN_READ_AHEAD = 4;
+constexpr size_t MAX_READ_AHEAD = 128;
+
 constexpr size_t INODE_DIRECT_BLOCK = 23;
 struct InodeBlock {
     static constexpr uint32_t MAGIC = 0x2C1D7C0F;
@@ -56,7 +60,6 @@ struct InodeDataBlock {
     uint32_t magic;
     char data[0];
 };
-constexpr size_t InodeDataSize = BLOCK_SIZE - sizeof(InodeDataBlock);
 
 class InodeFile {
 public:
@@ -65,7 +68,8 @@ public:
     ~InodeFile();
 
     bool open(blockid_t inode_id);
-    blockid_t create(uint32_t owner, uint16_t mode, uint16_t type);
+    // parent is the directory the inode is placed near, 0 for the root
+    blockid_t create(uint32_t owner, uint16_t mode, uint16_t type, blockid_t parent = 0);
     void close();
 
     inline bool is_open() const { return inode_ != nullptr; }
@@ -91,6 +95,7 @@ public:
     
 private:
     BlockManager* block_mgr_;
+    size_t data_size_; // Bytes of file data in a data block
 
     InodeBlock* inode_;
     blockid_t inode_block_;
@@ -99,8 +104,15 @@ private:
     std::vector<blockid_t> data_ids_;
     std::vector<blockid_t> entry_ids_;
 
+    // Sequential read detection, reads continuing where the last one ended are sequential
+    size_t ra_offset_;  // Offset the last read ended at
+    size_t ra_end_;     // Data blocks before this index were read ahead
+    size_t ra_window_;  // Blocks to read ahead of the reader, 0 if not sequential
+
     blockid_t create_failed_();
     InodeDataBlock* load_data_(size_t index, bool create);
+    void prefetch_data_(size_t begin, size_t end);
+    void read_ahead_(size_t offset, size_t end);
 
     inline bool load_entries_();
     inline bool load_entries_(int level, blockid_t entry_id, size_t& data_num);
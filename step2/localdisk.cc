@@ -0,0 +1,159 @@
+#include "localdisk.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <iostream>
+
+LocalDisk::LocalDisk(const char* filename, int cylinders, int sectors, int section_size):
+    fd_(-1), data_(nullptr), size_(0) {
+    if (cylinders <= 0 || sectors <= 0 || section_size < SECTION_SIZE) {
+        std::cerr << "Invalid disk geometry " << cylinders << "x" << sectors << "x" << section_size << std::endl;
+        return;
+    }
+    cylinder_num_ = cylinders;
+    section_num_ = sectors;
+    section_size_ = section_size;
+    size_ = static_cast<size_t>(cylinders) * sectors * section_size;
+    fd_ = ::open(filename, O_RDWR | O_CREAT, 0600);
+    if (fd_ < 0) {
+        std::cerr << "Failed to open disk file " << filename << ": " << strerror(errno) << std::endl;
+        return;
+    }
+    void* data = MAP_FAILED;
+    if (ftruncate(fd_, size_) == 0) {
+        data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    }
+    if (data == MAP_FAILED) {
+        std::cerr << "Failed to map disk file " << filename << ": " << strerror(errno) << std::endl;
+        close(fd_);
+        fd_ = -1;
+        return;
+    }
+    data_ = static_cast<char*>(data);
+    std::cout << "Opened disk file " << filename << " with " << cylinder_num_ << " cylinders and "
+        << section_num_ << " sectors of " << section_size_ << " bytes" << std::endl;
+}
+
+LocalDisk::~LocalDisk() {
+    if (data_ != nullptr) {
+        msync(data_, size_, MS_SYNC);
+        munmap(data_, size_);
+    }
+    if (fd_ >= 0) close(fd_);
+}
+
+int LocalDisk::get_disk_info(int* cylinders, int* sectors) {
+    if (cylinders)
+        *cylinders = cylinder_num_;
+    if (sectors)
+        *sectors = section_num_;
+    return open() ? 0 : -1;
+}
+
+char* LocalDisk::section_data_(int cylinder, int sector) const {
+    return data_ + (static_cast<size_t>(cylinder) * section_num_ + sector) * section_size_;
+}
+
+// Release count sections from index like the disk server, they read as zeros afterwards
+void LocalDisk::trim_(size_t index, size_t count) {
+    if (fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  index * section_size_, count * section_size_) < 0) {
+        memset(data_ + index * section_size_, 0, count * section_size_);
+    }
+}
+
+int LocalDisk::clear_disk_section(int cylinder, int sector) {
+    if (!open() || !check_disk_section(cylinder, sector)) {
+        std::cerr << "Invalid disk section " << cylinder << ":" << sector << std::endl;
+        return -1;
+    }
+    trim_(static_cast<size_t>(cylinder) * section_num_ + sector, 1);
+    return 1;
+}
+
+int LocalDisk::read_disk_section(int cylinder, int sector, char* buffer) {
+    if (!open() || !check_disk_section(cylinder, sector)) {
+        std::cerr << "Invalid disk section " << cylinder << ":" << sector << std::endl;
+        return -1;
+    }
+    memcpy(buffer, section_data_(cylinder, sector), section_size_);
+    return 0;
+}
+
+int LocalDisk::write_disk_section(int cylinder, int sector, int data_size, const char* data) {
+    if (!open() || !check_disk_section(cylinder, sector)) {
+        std::cerr << "Invalid disk section " << cylinder << ":" << sector << std::endl;
+        return -1;
+    }
+    if (data_size < 0 || data_size > section_size_) {
+        std::cerr << "Failed to write disk section " << cylinder << ":" << sector << std::endl;
+        return 0;
+    }
+    char* dest = section_data_(cylinder, sector);
+    memcpy(dest, data, data_size);
+    memset(dest + data_size, 0, section_size_ - data_size);
+    return 1;
+}
+
+int LocalDisk::clear_disk_sections(const DiskSection* sections, int count) {
+    if (!open() || !check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        trim_(static_cast<size_t>(sections[i].cylinder) * section_num_ + sections[i].sector, 1);
+    }
+    return 0;
+}
+
+int LocalDisk::read_disk_sections(const DiskSection* sections, int count, char* const* buffers) {
+    if (!open() || !check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        memcpy(buffers[i], section_data_(sections[i].cylinder, sections[i].sector), section_size_);
+    }
+    return 0;
+}
+
+int LocalDisk::write_disk_sections(const DiskSection* sections, int count, const char* const* data) {
+    if (!open() || !check_disk_sections(sections, count)) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return -1;
+    }
+    for (int i = 0; i < count; ++i) {
+        memcpy(section_data_(sections[i].cylinder, sections[i].sector), data[i], section_size_);
+    }
+    return 0;
+}
+
+std::future<int> LocalDisk::read_disk_sections_async(const DiskSection* sections, int count, char* const* buffers) {
+    if (count <= 0 || count > MAX_BATCH_SECTIONS) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return ready_future(-1);
+    }
+    return ready_future(read_disk_sections(sections, count, buffers));
+}
+
+std::future<int> LocalDisk::write_disk_sections_async(const DiskSection* sections, int count, const char* const* data) {
+    if (count <= 0 || count > MAX_BATCH_SECTIONS) {
+        std::cerr << "Invalid disk sections in batch" << std::endl;
+        return ready_future(-1);
+    }
+    return ready_future(write_disk_sections(sections, count, data));
+}
+
+int LocalDisk::trim_disk_sections(int cylinder, int sector, int count) {
+    size_t index = static_cast<size_t>(cylinder) * section_num_ + sector;
+    if (!open() || !check_disk_section(cylinder, sector) || count <= 0 ||
+        index + count > static_cast<size_t>(cylinder_num_) * section_num_) {
+        std::cerr << "Invalid disk range " << cylinder << ":" << sector << "+" << count << std::endl;
+        return -1;
+    }
+    trim_(index, count);
+    return 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Disk file opened in the process
+#include "idisk.h"
+
+// A disk file in the format of the disk server, sector cylinder:sector at
+// (cylinder * sectors + sector) * section size, so the two can open the same images.
+// The file is mapped and sections are copied in and out of the mapping, without a
+// disk server or a system call per section.
+class LocalDisk : public Disk {
+public:
+    // Open or create filename, which is resized to the geometry like the disk server does.
+    LocalDisk(const char* filename, int cylinders, int sectors, int section_size = SECTION_SIZE);
+
+    ~LocalDisk() override;
+
+    int get_disk_info(int* cylinders, int* sectors) override;
+
+    int clear_disk_section(int cylinder, int sector) override;
+    int read_disk_section(int cylinder, int sector, char* buffer) override;
+    int write_disk_section(int cylinder, int sector, int data_size, const char* data) override;
+
+    int clear_disk_sections(const DiskSection* sections, int count) override;
+    int read_disk_sections(const DiskSection* sections, int count, char* const* buffers) override;
+    int write_disk_sections(const DiskSection* sections, int count, const char* const* data) override;
+
+    // Complete before returning
+    std::future<int> read_disk_sections_async(const DiskSection* sections, int count, char* const* buffers) override;
+    std::future<int> write_disk_sections_async(const DiskSection* sections, int count, const char* const* data) override;
+
+    int trim_disk_sections(int cylinder, int sector, int count) override;
+
+    inline bool open() const override {
+        return data_ != nullptr;
+    }
+
+private:
+    char* section_data_(int cylinder, int sector) const;
+    void trim_(size_t index, size_t count);
+
+    int fd_;
+    char* data_;                // The mapped file, nullptr if it failed to open
+    size_t size_;
+};
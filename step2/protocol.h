@@ -0,0 +1,129 @@
+#pragma once
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Messages of the step2 protocols, packed with the codec. The disk server side is
+// step1/disksim.c, so the layouts below must not change.
+
+#include <cstddef>
+#include <string>
+
+#include "codec.h"
+
+// Requests to the disk server, see step1/disksim.h
+
+// 'C' and 'R'
+struct DiskSectorRequest {
+    char op;
+    int cylinder;
+    int sector;
+    CODEC_FIELDS(op, cylinder, sector)
+};
+
+// 'c', 'r' and 'w', followed by count DiskAddress or DiskSectorData
+struct DiskBatchRequest {
+    char op;
+    int count;
+    CODEC_FIELDS(op, count)
+};
+
+struct DiskAddress {
+    int cylinder;
+    int sector;
+    CODEC_FIELDS(cylinder, sector)
+};
+
+// After 'W', and each section of 'w'
+struct DiskSectorData {
+    int cylinder;
+    int sector;
+    int size;
+    codec::Bytes data;
+    CODEC_FIELDS(cylinder, sector, size, data)
+};
+
+// 'T'
+struct DiskTrimRequest {
+    char op;
+    int cylinder;
+    int sector;
+    int count;
+    CODEC_FIELDS(op, cylinder, sector, count)
+};
+
+// 'S'
+struct DiskStatRequest {
+    char op;
+    char reset;
+    CODEC_FIELDS(op, reset)
+};
+
+struct DiskStatResponse {
+    int ret;
+    long clock;
+    long total_time;
+    CODEC_FIELDS(ret, clock, total_time)
+};
+
+// Response to 'I', newer servers add the sector size
+struct DiskGeometry {
+    int cylinders;
+    int sectors;
+    CODEC_FIELDS(cylinders, sectors)
+};
+
+// 'X', followed by the request
+struct DiskTaggedRequest {
+    char op;
+    long tag;
+    CODEC_FIELDS(op, tag)
+};
+
+static_assert(codec::is_fixed_v<DiskSectorRequest> && codec::fixed_size_v<DiskSectorRequest> == 9);
+static_assert(codec::is_fixed_v<DiskBatchRequest> && codec::fixed_size_v<DiskBatchRequest> == 5);
+static_assert(codec::is_fixed_v<DiskAddress> && codec::fixed_size_v<DiskAddress> == 8);
+static_assert(codec::fixed_size_v<DiskSectorData> == 12);
+static_assert(codec::is_fixed_v<DiskTrimRequest> && codec::fixed_size_v<DiskTrimRequest> == 13);
+static_assert(codec::is_fixed_v<DiskStatRequest> && codec::fixed_size_v<DiskStatRequest> == 2);
+static_assert(codec::is_fixed_v<DiskStatResponse> && codec::fixed_size_v<DiskStatResponse> == 20);
+static_assert(codec::is_fixed_v<DiskGeometry> && codec::fixed_size_v<DiskGeometry> == 8);
+static_assert(codec::is_fixed_v<DiskTaggedRequest> && codec::fixed_size_v<DiskTaggedRequest> == 9);
+
+// Requests to the file server, after the Operation
+
+// OP_CREATE, OP_MKDIR, OP_RMFILE, OP_RMDIR, OP_CD, OP_CAT, OP_STAT, OP_DELALL and OP_ADDUSER
+struct PathRequest {
+    std::string path;
+    CODEC_FIELDS(path)
+};
+
+// OP_READ and OP_DELETE, OP_WRITE and OP_INSERT followed by the data
+struct RangeRequest {
+    std::string path;
+    size_t offset;
+    size_t size;
+    CODEC_FIELDS(path, offset, size)
+};
+
+// OP_TRUNCATE
+struct TruncateRequest {
+    std::string path;
+    size_t size;
+    CODEC_FIELDS(path, size)
+};
+
+// OP_CHMOD with the mode, OP_CHOWN with the owner
+struct AttrRequest {
+    std::string path;
+    int value;
+    CODEC_FIELDS(path, value)
+};
+
+// OP_RENAME
+struct RenameRequest {
+    std::string oldname;
+    std::string newname;
+    CODEC_FIELDS(oldname, newname)
+};
+
+#endif // !PROTOCOL_H
@@ -1,35 +1,82 @@
 #include <iostream>
 #include <string>
+#include <cstring>
 #include <unistd.h>
 #include <signal.h>
 #include <memory>
 
 #include "network/network.h"
 #include "bytepack/bytepack.h"
+#include "codec.h"
+#include "protocol.h"
 #include "filesystem.h"
+#include "localdisk.h"
 
-std::unique_ptr<RemoteDisk> disk;
+std::unique_ptr<Disk> disk;
 std::unique_ptr<FileSystem> fs;
 
-constexpr int FLUSH_INTERVAL = 16;
-constexpr size_t BUFFER_SIZE = 4096;
+constexpr size_t PAYLOAD_KEEP_SIZE = 1 << 20;
 
 int server_fd = -1;
-int flush_counter = FLUSH_INTERVAL;
 
-void* handler(void*);
+void* on_connect(const client_handler_args_t*);
+server_action_t on_request(void*, bytepack_t*, bytepack_t*);
+void on_disconnect(void*);
 void SIGINThandler(int);
 
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " <DiskServerAddr> <DiskServerPort> <FSPort>\n";
+    int opt, num_workers = 0, num_connections = 1, section_size = 0;
+    const char* disk_file = nullptr;
+    CachePolicy policy = CachePolicy::TWO_Q;
+    AllocPolicy alloc_policy = AllocPolicy::GROUPED;
+    while ((opt = getopt(argc, argv, "e:c:l:s:p:a:")) != -1) {
+        if (opt == 'e') {
+            num_workers = atoi(optarg);
+        } else if (opt == 'c' && atoi(optarg) > 0) {
+            num_connections = atoi(optarg);
+        } else if (opt == 'l') {
+            disk_file = optarg;
+        } else if (opt == 's' && atoi(optarg) > 0) {
+            section_size = atoi(optarg);
+        } else if (opt == 'p' && (strcmp(optarg, "clock") == 0 || strcmp(optarg, "2q") == 0)) {
+            policy = strcmp(optarg, "clock") == 0 ? CachePolicy::CLOCK : CachePolicy::TWO_Q;
+        } else if (opt == 'a' && strcmp(optarg, "bump") == 0) {
+            alloc_policy = AllocPolicy::BUMP;
+        } else if (opt == 'a' && strcmp(optarg, "grouped") == 0) {
+            alloc_policy = AllocPolicy::GROUPED;
+        } else if (opt == 'a' && strcmp(optarg, "head") == 0) {
+            alloc_policy = AllocPolicy::NEAR_HEAD;
+        } else {
+            num_workers = -1;
+            break;
+        }
+    }
+    if (argc - optind != 3 || num_workers < 0 || (section_size > 0 && !disk_file)) {
+        std::cerr << "Usage: " << argv[0] << " [-e workers] [-c connections] [-p policy] [-a placement] <DiskServerAddr> <DiskServerPort> <FSPort>\n";
+        std::cerr << "       " << argv[0] << " [-e workers] [-p policy] [-a placement] -l <DiskFile> [-s sector_size] <Cylinders> <Sectors> <FSPort>\n";
+        std::cerr << "  -e: serve all clients with an epoll loop and workers threads, instead of a thread per client\n";
+        std::cerr << "  -c: number of connections to the disk server, default 1\n";
+        std::cerr << "  -l: open the disk file in the process instead of using a disk server\n";
+        std::cerr << "  -s: sector size of the disk file, as given to the disk server, default " << SECTION_SIZE << "\n";
+        std::cerr << "  -p: block cache replacement policy, clock or 2q, default 2q\n";
+        std::cerr << "  -a: placement of new blocks, bump, grouped or head (near the disk head), default grouped\n";
         return EXIT_FAILURE;
     }
-    disk = std::make_unique<RemoteDisk>(argv[1], atoi(argv[2]));
+    argv += optind - 1;
+    signal(SIGPIPE, SIG_IGN); // A closed connection fails its sends instead of killing the server
+    if (disk_file)
+        disk = std::make_unique<LocalDisk>(disk_file, atoi(argv[1]), atoi(argv[2]),
+            section_size > 0 ? section_size : SECTION_SIZE);
+    else
+        disk = std::make_unique<RemoteDisk>(argv[1], atoi(argv[2]), num_connections);
     std::string line;
     std::cout << "Would you like to format the disk? (y/n): ";
     std::getline(std::cin, line);
-    fs = std::make_unique<FileSystem>(disk.get(), line == "y");
+    fs = std::make_unique<FileSystem>(disk.get(), line == "y", policy, alloc_policy);
+    if (!fs->open()) {
+        std::cerr << "Error: Cannot load the file system, format it or fix the disk arguments\n";
+        return EXIT_FAILURE;
+    }
     int port = atoi(argv[3]);
     server_fd = initialize_server_socket(port);
     if (server_fd < 0) {
@@ -38,298 +85,306 @@ int main(int argc, char *argv[]) {
     }
     std::cout << "Server started on port " << port << std::endl;
     signal(SIGINT, SIGINThandler);
-    run_server(server_fd, handler);
+    static const server_callbacks_t callbacks = { on_connect, on_request, on_disconnect };
+    run_callback_server(server_fd, &callbacks, num_workers);
 }
 
-#define PACK_ERR(err) bytepack_pack(&response, "i", err)
-
-void* handler(void* agrs) {
-    client_handler_args_t* client_handler_args = (client_handler_args_t*) agrs;
-    int client_fd = client_handler_args->client_fd;
-    const char* client_ip = client_handler_args->client_ip;
-    int ret = 0;
+// State of a client connection
+struct Session {
+    std::string client_ip;
     bool authenticated = false;
-    bytepack_t request;
-    bytepack_t response;
-    bytepack_init(&request, 512);
-    bytepack_init(&response, 512);
-    // Receive username
-    std::cout << client_ip << " asking for username\n";
     WorkingDir* wd = nullptr;
-    bytepack_recv(client_fd, &request);
-    if (request.size == 0) {
-        authenticated = false;
-    } else {
+    std::vector<char> payload;  // File data the last response refers to, until it is sent
+};
+
+void* on_connect(const client_handler_args_t* client_handler_args) {
+    Session* session = new Session;
+    session->client_ip = client_handler_args->client_ip;
+    std::cout << session->client_ip << " asking for username\n";
+    return session;
+}
+
+void on_disconnect(void* context) {
+    Session* session = static_cast<Session*>(context);
+    std::cout << "Client disconnected: " << session->client_ip << std::endl;
+    if (session->wd != nullptr) fs->close_working_dir(session->wd);
+    delete session;
+}
+
+#define PACK_ERR(err) codec::pack(response, static_cast<ecode_t>(err))
+
+server_action_t on_request(void* context, bytepack_t* request, bytepack_t* response) {
+    Session* session = static_cast<Session*>(context);
+    int ret = 0;
+    // The first request is the username
+    if (!session->authenticated) {
         char username[MAX_USERNAME_LEN];
-        bytepack_unpack(&request, "s", username);
-        wd = fs->open_working_dir(username);
-        if (wd == nullptr) {
-            bytepack_pack(&response, "i", ERROR_USER_NOT_FOUND);
-            authenticated = false;
-        } else {
-            bytepack_pack(&response, "i", 0);
-            authenticated = true;
-            std::cout << client_ip << " Authenticated for: " << username << std::endl;
+        codec::unpack(request, username);
+        session->wd = fs->open_working_dir(username);
+        if (session->wd == nullptr) {
+            PACK_ERR(ERROR_USER_NOT_FOUND);
+            return SERVER_RESPOND_CLOSE;
         }
-        bytepack_send(client_fd, &response);
+        PACK_ERR(0);
+        session->authenticated = true;
+        std::cout << session->client_ip << " Authenticated for: " << username << std::endl;
+        return SERVER_RESPOND;
     }
-    // Handle requests
-    while (authenticated) {
-        --flush_counter;
-        if (flush_counter < 0) {
-            std::cout << "Flushing...\n";
-            fs->flush();
-            flush_counter = FLUSH_INTERVAL;
-        }
-        char buffer[BUFFER_SIZE];
-        bytepack_reset(&request);
-        bytepack_reset(&response);
-        bytepack_recv(client_fd, &request);
-        if (request.size == 0) break;
-        if (request.size >= BUFFER_SIZE) {
-            continue;
+    // The previous response was sent, keep the buffer unless it grew large
+    if (session->payload.capacity() > PAYLOAD_KEEP_SIZE) {
+        std::vector<char>().swap(session->payload);
+    }
+    // std::cout << "Request from " << session->client_ip << std::endl;
+    // bytepack_dbg_print(request);
+    Operation op;
+    codec::unpack(request, op);
+    if (op == OP_NOPE) return SERVER_NO_RESPONSE;
+    if (op == OP_EXIT) return SERVER_CLOSE;
+    switch (op) {
+    case OP_FORMAT: {
+        fs->close_working_dir(session->wd);
+        ret = fs->format();
+        session->wd = fs->open_working_dir("root");
+        PACK_ERR(ret);
+        break;
+    } case OP_CREATE: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->create_file(req.path.c_str());
+        PACK_ERR(ret);
+        break;
+    } case OP_MKDIR: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->create_dir(req.path.c_str());
+        PACK_ERR(ret);
+        break;
+    } case OP_RMFILE: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->remove(req.path.c_str());
+        PACK_ERR(ret);
+        break;
+    } case OP_RMDIR: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->remove_dir(req.path.c_str());
+        PACK_ERR(ret);
+        break;
+    } case OP_CD: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->change_dir(req.path.c_str());
+        PACK_ERR(ret);
+        if (ret == 0) {
+            std::string full_path;
+            session->wd->current_dir(full_path);
+            codec::pack(response, full_path.size() + 1, full_path);
         }
-        // std::cout << "Request from " << client_ip << std::endl;
-        // bytepack_dbg_print(&request);
-        Operation op;
-        bytepack_unpack(&request, "i", &op);
-        if (op == OP_NOPE) continue;
-        if (op == OP_EXIT) break;
-        switch (op) {
-        case OP_FORMAT: {
-            fs->close_working_dir(wd);
-            ret = fs->format();
-            wd = fs->open_working_dir("root");
-            PACK_ERR(ret);
-            break;
-        } case OP_CREATE: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->create_file(buffer);
-            PACK_ERR(ret);
-            break;
-        } case OP_MKDIR: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->create_dir(buffer);
-            PACK_ERR(ret);
-            break;
-        } case OP_RMFILE: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->remove(buffer);
-            PACK_ERR(ret);
-            break;
-        } case OP_RMDIR: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->remove_dir(buffer);
-            PACK_ERR(ret);
-            break;
-        } case OP_CD: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->change_dir(buffer);
-            PACK_ERR(ret);
-            if (ret == 0) {
-                std::string full_path;
-                wd->current_dir(full_path);
-                bytepack_pack(&response, "l", full_path.size() + 1);
-                bytepack_pack(&response, "s", full_path.c_str());
+        break;
+    } case OP_LS: {
+        std::vector<std::string> list;
+        ret = session->wd->list_dir(list);
+        PACK_ERR(ret);
+        if (ret == 0) {
+            codec::pack(response, list.size());
+            for (const std::string& name : list) {
+                codec::pack(response, name.c_str());
             }
-            break;
-        } case OP_LS: {
-            std::vector<std::string> list;
-            ret = wd->list_dir(list);
-            PACK_ERR(ret);
-            if (ret == 0) {
-                bytepack_pack(&response, "l", list.size());
-                for (const std::string& name : list) {
-                    bytepack_pack(&response, "s", name.c_str());
-                }
-            } 
-            break;
-        } case OP_CAT: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->acquire_file(buffer, false);
-            if (ret == 0) {
-                if (wd->active_file().inode()->type == TYPE_FILE) {
-                    PACK_ERR(ret);
-                    std::vector<char> data(wd->active_file().size());
-                    wd->active_file().readall(data.data());
-                    bytepack_pack(&response, "l", data.size());
-                    bytepack_pack_bytes(&response, data.data(), data.size());
-                } else {
-                    PACK_ERR(ERROR_NOT_FILE);
-                }
-                wd->release_file();
-            } else {
+        } 
+        break;
+    } case OP_CAT: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->acquire_file(req.path.c_str(), false);
+        if (ret == 0) {
+            if (session->wd->active_file().inode()->type == TYPE_FILE) {
                 PACK_ERR(ret);
+                std::vector<char>& data = session->payload;
+                data.resize(session->wd->active_file().size());
+                session->wd->active_file().readall(data.data());
+                codec::pack(response, data.size(), codec::ref(data.data(), data.size()));
+            } else {
+                PACK_ERR(ERROR_NOT_FILE);
             }
-            break;
-        } case OP_WRITE: {
-            size_t offset, size;
-            bytepack_unpack(&request, "sll", buffer, &offset, &size);
-            ret = wd->acquire_file(buffer, true);
-            if (ret == 0) {
-                if (wd->active_file().inode()->type != TYPE_FILE) {
-                    ret = ERROR_NOT_FILE;
-                } else {
-                    char* data = (char*) malloc(size);
-                    bytepack_unpack_bytes(&request, data, &size);
-                    ret = (wd->active_file().write(data, size, offset) == size) ? 0 : ERROR_INVALID;
-                    free(data);
-                }
-                wd->release_file();
-            }
-            PACK_ERR(ret);
-            break;
-        } case OP_INSERT: {
-            size_t offset, size;
-            bytepack_unpack(&request, "sll", buffer, &offset, &size);
-            ret = wd->acquire_file(buffer, true);
-            if (ret == 0) {
-                if (wd->active_file().inode()->type != TYPE_FILE) {
-                    ret = ERROR_NOT_FILE;
-                } else {
-                    char* data = (char*) malloc(size);
-                    bytepack_unpack_bytes(&request, data, &size);
-                    ret = (wd->active_file().insert(data, size, offset) == size) ? 0 : ERROR_INVALID;
-                    free(data);
-                }
-                wd->release_file();
-            }
+            session->wd->release_file();
+        } else {
             PACK_ERR(ret);
-            break;
-        } case OP_DELETE: {
-            size_t offset, size;
-            bytepack_unpack(&request, "sll", buffer, &offset, &size);
-            ret = wd->acquire_file(buffer, true);
-            if (ret == 0) {
-                if (wd->active_file().inode()->type != TYPE_FILE) {
-                    ret = ERROR_NOT_FILE;
+        }
+        break;
+    } case OP_WRITE: {
+        RangeRequest req;
+        codec::unpack(request, req);
+        size_t offset = req.offset, size = req.size;
+        ret = session->wd->acquire_file(req.path.c_str(), true);
+        if (ret == 0) {
+            if (session->wd->active_file().inode()->type != TYPE_FILE) {
+                ret = ERROR_NOT_FILE;
+            } else {
+                const void* data;
+                size_t data_size;
+                if (codec::unpack(request, codec::bytes_ref(data, data_size)) < 0 || data_size != size) {
+                    ret = ERROR_INVALID;
                 } else {
-                    ret = (wd->active_file().remove(size, offset) == size) ? 0 : ERROR_INVALID;
+                    ret = (session->wd->active_file().write(static_cast<const char*>(data), size, offset) == size) ?
+                        0 : ERROR_INVALID;
                 }
-                wd->release_file();
             }
-            PACK_ERR(ret);
-            break;
-        } case OP_TRUNCATE: {
-            size_t size;
-            bytepack_unpack(&request, "sl", buffer, &size);
-            ret = wd->acquire_file(buffer, true);
-            if (ret == 0) {
-                if (wd->active_file().inode()->type != TYPE_FILE) {
-                    ret = ERROR_NOT_FILE;
+            session->wd->release_file();
+        }
+        PACK_ERR(ret);
+        break;
+    } case OP_INSERT: {
+        RangeRequest req;
+        codec::unpack(request, req);
+        size_t offset = req.offset, size = req.size;
+        ret = session->wd->acquire_file(req.path.c_str(), true);
+        if (ret == 0) {
+            if (session->wd->active_file().inode()->type != TYPE_FILE) {
+                ret = ERROR_NOT_FILE;
+            } else {
+                const void* data;
+                size_t data_size;
+                if (codec::unpack(request, codec::bytes_ref(data, data_size)) < 0 || data_size != size) {
+                    ret = ERROR_INVALID;
                 } else {
-                    ret = wd->active_file().truncate(size) ? 0 : ERROR_INVALID;
+                    ret = (session->wd->active_file().insert(static_cast<const char*>(data), size, offset) == size) ?
+                        0 : ERROR_INVALID;
                 }
-                wd->release_file();
-            }
-            PACK_ERR(ret);
-            break;
-        } case OP_STAT: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->acquire_file(buffer, false);
-            PACK_ERR(ret);
-            if (ret == 0) {
-                std::string info = wd->active_file().dump();
-                bytepack_pack(&response, "l", info.size() + 1);
-                bytepack_pack(&response, "s", info.c_str());
-                wd->release_file();
             }
-            break;
-        } case OP_CHMOD: {
-            int mode;
-            bytepack_unpack(&request, "si", buffer, &mode);
-            ret = wd->chmod(buffer, static_cast<uint16_t>(mode));
-            PACK_ERR(ret);
-            break;
-        } case OP_CHOWN: {
-            int owner;
-            bytepack_unpack(&request, "si", buffer, &owner);
-            ret = wd->chown(buffer, static_cast<uint32_t>(owner));
-            PACK_ERR(ret);
-            break;
-        } case OP_ADDUSER: {
-            if (wd->user() != 0) {
-                PACK_ERR(ERROR_PERMISSION);
-                break;
+            session->wd->release_file();
+        }
+        PACK_ERR(ret);
+        break;
+    } case OP_DELETE: {
+        RangeRequest req;
+        codec::unpack(request, req);
+        size_t offset = req.offset, size = req.size;
+        ret = session->wd->acquire_file(req.path.c_str(), true);
+        if (ret == 0) {
+            if (session->wd->active_file().inode()->type != TYPE_FILE) {
+                ret = ERROR_NOT_FILE;
+            } else {
+                ret = (session->wd->active_file().remove(size, offset) == size) ? 0 : ERROR_INVALID;
             }
-            bytepack_unpack(&request, "s", buffer);
-            uint32_t uid;
-            ret = fs->add_user(buffer, uid);
-            PACK_ERR(ret);
-            if (ret == 0) {
-                bytepack_pack(&response, "l", uid);
+            session->wd->release_file();
+        }
+        PACK_ERR(ret);
+        break;
+    } case OP_TRUNCATE: {
+        TruncateRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->acquire_file(req.path.c_str(), true);
+        if (ret == 0) {
+            if (session->wd->active_file().inode()->type != TYPE_FILE) {
+                ret = ERROR_NOT_FILE;
+            } else {
+                ret = session->wd->active_file().truncate(req.size) ? 0 : ERROR_INVALID;
             }
+            session->wd->release_file();
+        }
+        PACK_ERR(ret);
+        break;
+    } case OP_STAT: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->acquire_file(req.path.c_str(), false);
+        PACK_ERR(ret);
+        if (ret == 0) {
+            std::string info = session->wd->active_file().dump();
+            codec::pack(response, info.size() + 1, info);
+            session->wd->release_file();
+        }
+        break;
+    } case OP_CHMOD: {
+        AttrRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->chmod(req.path.c_str(), static_cast<uint16_t>(req.value));
+        PACK_ERR(ret);
+        break;
+    } case OP_CHOWN: {
+        AttrRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->chown(req.path.c_str(), static_cast<uint32_t>(req.value));
+        PACK_ERR(ret);
+        break;
+    } case OP_ADDUSER: {
+        if (session->wd->user() != 0) {
+            PACK_ERR(ERROR_PERMISSION);
             break;
-        } case OP_LSUSER: {
-            std::vector<std::string> list;
-            ret = fs->list_users(list);
-            PACK_ERR(ret);
-            if (ret == 0) {
-                bytepack_pack(&response, "l", list.size());
-                for (const std::string& name : list) {
-                    bytepack_pack(&response, "s", name.c_str());
-                }
+        }
+        PathRequest req;
+        codec::unpack(request, req);
+        uint32_t uid;
+        ret = fs->add_user(req.path.c_str(), uid);
+        PACK_ERR(ret);
+        if (ret == 0) {
+            codec::pack(response, static_cast<long>(uid));
+        }
+        break;
+    } case OP_LSUSER: {
+        std::vector<std::string> list;
+        ret = fs->list_users(list);
+        PACK_ERR(ret);
+        if (ret == 0) {
+            codec::pack(response, list.size());
+            for (const std::string& name : list) {
+                codec::pack(response, name.c_str());
             }
-            break;
-        } case OP_READ: {
-            size_t offset, size;
-            bytepack_unpack(&request, "sll", buffer, &offset, &size);
-            ret = wd->acquire_file(buffer, false);
-            if (ret == 0) {
-                if (wd->active_file().inode()->type != TYPE_FILE) {
-                    ret = ERROR_NOT_FILE;
-                    PACK_ERR(ret);
-                } else {
-                    PACK_ERR(ret);
-                    std::vector<char> data(size);
-                    wd->active_file().read(data.data(), size, offset);
-                    bytepack_pack(&response, "l", data.size());
-                    bytepack_pack_bytes(&response, data.data(), data.size());
-                }
-                wd->release_file();
+        }
+        break;
+    } case OP_READ: {
+        RangeRequest req;
+        codec::unpack(request, req);
+        size_t offset = req.offset, size = req.size;
+        ret = session->wd->acquire_file(req.path.c_str(), false);
+        if (ret == 0) {
+            if (session->wd->active_file().inode()->type != TYPE_FILE) {
+                ret = ERROR_NOT_FILE;
+                PACK_ERR(ret);
             } else {
                 PACK_ERR(ret);
+                std::vector<char>& data = session->payload;
+                data.resize(size);
+                session->wd->active_file().read(data.data(), size, offset);
+                codec::pack(response, data.size(), codec::ref(data.data(), data.size()));
             }
-            break;
-        } case OP_DELALL: {
-            bytepack_unpack(&request, "s", buffer);
-            ret = wd->acquire_file(buffer, true);
-            if (ret == 0) {
-                if (wd->active_file().inode()->type != TYPE_FILE) {
-                    ret = ERROR_NOT_FILE;
-                } else {
-                    ret = wd->active_file().removeall() ? 0 : ERROR_INVALID;
-                }
-                wd->release_file();
-            }
-            PACK_ERR(ret);
-        } case OP_FLUSH: {
-            flush_counter = FLUSH_INTERVAL;
-            fs->flush();
-            continue;
-        } case OP_RENAME:{
-            char newname[BUFFER_SIZE];
-            bytepack_unpack(&request, "ss", buffer, newname);
-            ret = wd->rename(buffer, newname);
+            session->wd->release_file();
+        } else {
             PACK_ERR(ret);
-            break;
-        } default: {
-            PACK_ERR(ERROR_INVALID_OP);
-            break;
         }
+        break;
+    } case OP_DELALL: {
+        PathRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->acquire_file(req.path.c_str(), true);
+        if (ret == 0) {
+            if (session->wd->active_file().inode()->type != TYPE_FILE) {
+                ret = ERROR_NOT_FILE;
+            } else {
+                ret = session->wd->active_file().removeall() ? 0 : ERROR_INVALID;
+            }
+            session->wd->release_file();
         }
-        // std::cout << "Response to " << client_ip << std::endl;
-        // bytepack_dbg_print(&response);
-        bytepack_send(client_fd, &response);
+        PACK_ERR(ret);
+    } case OP_FLUSH: {
+        fs->flush();
+        return SERVER_NO_RESPONSE;
+    } case OP_RENAME:{
+        RenameRequest req;
+        codec::unpack(request, req);
+        ret = session->wd->rename(req.oldname.c_str(), req.newname.c_str());
+        PACK_ERR(ret);
+        break;
+    } default: {
+        PACK_ERR(ERROR_INVALID_OP);
+        break;
     }
-    std::cout << "Client disconnected: " << client_ip << std::endl;
-    fs->close_working_dir(wd);
-    free(client_handler_args);
-    close(client_fd);
-    bytepack_free(&request);
-    bytepack_free(&response);
-    return NULL;
-};
+    }
+    // std::cout << "Response to " << session->client_ip << std::endl;
+    // bytepack_dbg_print(response);
+    return SERVER_RESPOND;
+}
 
 void SIGINThandler(int) {
     if (server_fd >= 0) {